@@ -0,0 +1,37 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+#ifndef __BATCH_H
+#define __BATCH_H
+
+/*
+ * What a job returns, and what its batch child exits with.
+ */
+#define BATCH_JOB_OK		0
+#define BATCH_JOB_LOAD_FAILED	1	/* the image could not be mapped */
+#define BATCH_JOB_PATCH_FAILED	2	/* finders or patch list failed */
+#define BATCH_JOB_WRITE_FAILED	3	/* patched, but the output was not written */
+
+typedef int (*batch_job_t) (const char *in, const char *out);
+
+int		batch_main (const char*, int, char**, batch_job_t);
+
+#endif /* __BATCH_H */
@@ -38,6 +38,7 @@
 #include "util.h"
 #include "exploits.h"
 #include "firmware.h"
+#include "devicetree.h"
 #include "messages/usa.h"
 #include "dprint.h"
 
@@ -0,0 +1,54 @@
+/*
+ * Flattened DeviceTree parser and property index.
+ */
+
+#ifndef _devicetree_h_
+#define _devicetree_h_
+
+#define DT_PROPERTY_NAME_LENGTH		32
+#define DT_PROPERTY_PLACEHOLDER		0x80000000
+
+typedef struct _dt_node {
+	char *path;			/* "/", "/chosen", "/arm-io/uart0", ... */
+	int parent;			/* index into nodes, -1 for the root */
+	unsigned int offset;		/* node header in the buffer */
+	int first_property;		/* index into properties */
+	int nproperties;
+	int nchildren;
+	int next;			/* hash chain */
+} dt_node_t;
+
+typedef struct _dt_property {
+	char name[DT_PROPERTY_NAME_LENGTH + 1];
+	int node;			/* index into nodes */
+	unsigned int offset;		/* value in the buffer */
+	unsigned int length;		/* without the placeholder flag */
+	int next;			/* hash chain */
+} dt_property_t;
+
+typedef struct _devicetree {
+	unsigned char *data;
+	unsigned int size;
+	dt_node_t *nodes;
+	int nnodes;
+	int node_capacity;
+	dt_property_t *properties;
+	int nproperties;
+	int property_capacity;
+	int *node_buckets;
+	int *property_buckets;
+	unsigned int mask;
+} devicetree_t;
+
+devicetree_t *devicetree_parse(unsigned char *data, unsigned int size);
+void devicetree_free(devicetree_t *dt);
+dt_node_t *devicetree_find_node(devicetree_t *dt, const char *path);
+dt_property_t *devicetree_find_property(devicetree_t *dt, const char *path, const char *name);
+void *devicetree_property_value(devicetree_t *dt, dt_property_t *prop);
+int devicetree_get_u32(devicetree_t *dt, const char *path, const char *name, unsigned int *value);
+int devicetree_set_property(devicetree_t *dt, const char *path, const char *name, const void *value, unsigned int length);
+
+int devicetree_patch_add(const char *name, const char *path, const char *property, const unsigned char *original, int original_size, const unsigned char *replacement, int size);
+int devicetree_patch_apply(devicetree_t *dt);
+
+#endif
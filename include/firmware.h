@@ -46,9 +46,21 @@ typedef struct _firmware {
 	uint8_t items;
 } firmware, *firmware_t;
 
+typedef struct _patch_matcher patch_matcher_t;
+
 extern patch_list_t *iboot_patches;
 extern patch_list_t *devicetree_patches;
 extern patch_list_t *kernel_patches;
+extern patch_matcher_t *iboot_patch_matcher;
+extern patch_matcher_t *kernel_patch_matcher;
+
+patch_matcher_t *patch_matcher_compile(patch_list_t *l);
+int patch_matcher_replace(patch_matcher_t *m, unsigned char *p, int len);
+int patch_matcher_hits(patch_matcher_t *m, int index);
+void patch_matcher_report(patch_matcher_t *m);
+void patch_matcher_free(patch_matcher_t *m);
+
+int patch_image_load(unsigned char *p, int len);
 
 int fetch_image(const char *path, const char *output);
 int patch_file(char *filename);
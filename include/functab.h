@@ -0,0 +1,45 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+#ifndef __FUNCTAB_H
+#define __FUNCTAB_H
+
+struct code_range {
+	uint32_t offset;
+	uint32_t size;
+};
+
+/*
+ * Sorted function start offsets for a Thumb image, plus the code ranges
+ * they were found in. Built once, then queried by offset.
+ */
+struct function_table {
+	uint32_t *starts;
+	uint32_t count;
+	struct code_range *ranges;
+	int nranges;
+};
+
+int		function_table_build (struct function_table*, uint8_t*, size_t, const struct code_range*, int);
+int		function_containing (const struct function_table*, uint32_t, uint32_t*, uint32_t*);
+void	function_table_free (struct function_table*);
+
+#endif /* __FUNCTAB_H */
@@ -22,9 +22,12 @@
 #ifndef __IBOOTSUP_H
 #define __IBOOTSUP_H
 
-int		ibootsup_dynapatch (void);
-int		ibootsup_map_file (const char *filename);
-int		ibootsup_write_file (const char* filename);
-int		ibootsup_map_buffer (uint8_t* buf, int size);
+typedef struct iboot_ctx iboot_ctx_t;
+
+int		ibootsup_dynapatch (iboot_ctx_t *ctx);
+int		ibootsup_map_file (iboot_ctx_t **ctxp, const char *filename);
+int		ibootsup_write_file (iboot_ctx_t *ctx, const char* filename);
+int		ibootsup_map_buffer (iboot_ctx_t **ctxp, uint8_t* buf, int size);
+void	ibootsup_close (iboot_ctx_t *ctx);
 
 #endif /* __IBOOTSUP_H */
\ No newline at end of file
@@ -0,0 +1,47 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+#ifndef __IMAGEFILE_H
+#define __IMAGEFILE_H
+
+#define IMAGE_FILE_MAPPED	0x1	/* data is a read-only mapping of fd */
+#define IMAGE_FILE_OWNED	0x2	/* data was allocated for us and is freed on close */
+
+/*
+ * An input image. A file is mapped read-only and kept open, patches are
+ * then recorded in overlay instead of being written into the mapping, and
+ * only they are written on top of a clone of the source.
+ */
+struct image_file {
+	int fd;
+	uint8_t *data;
+	size_t size;
+	int flags;
+	struct patch_plan *overlay;
+};
+
+int		image_file_open (struct image_file*, const char*);
+void	image_file_from_buffer (struct image_file*, uint8_t*, size_t, boolean_t);
+int		image_file_patch (struct image_file*, struct patch_plan*);
+int		image_file_write (struct image_file*, const char*);
+void	image_file_close (struct image_file*);
+
+#endif /* __IMAGEFILE_H */
@@ -22,10 +22,16 @@
 #ifndef __KCACHE_H
 #define __KCACHE_H
 
-float	kcache_get_ios_version (void);
-char*	kcache_get_darwin_version (void);
-int		kcache_map_file (const char *filename);
-int		kcache_dynapatch (void);
-int		kcache_write_file (const char *filename);
+typedef struct kcache_ctx kcache_ctx_t;
+
+float	kcache_get_ios_version (kcache_ctx_t *ctx);
+char*	kcache_get_darwin_version (kcache_ctx_t *ctx);
+int		kcache_map_file (kcache_ctx_t **ctxp, const char *filename);
+int		kcache_dynapatch (kcache_ctx_t *ctx);
+int		kcache_write_file (kcache_ctx_t *ctx, const char *filename);
+void	kcache_close (kcache_ctx_t *ctx);
+int		kcache_build_halfword_index (kcache_ctx_t *ctx);
+int		kcache_benchmark_search_masks (kcache_ctx_t *ctx, int);
+int		kcache_benchmark_lzss (kcache_ctx_t *ctx, int);
 
 #endif /* __KCACHE_H */
\ No newline at end of file
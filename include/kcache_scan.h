@@ -0,0 +1,67 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Search mask scanners of kcache.c, exposed to kcache_check. Nothing else
+ * includes this; the finders go through find_with_search_mask().
+ */
+
+#ifndef __KCACHE_SCAN_H
+#define __KCACHE_SCAN_H
+
+struct find_search_mask
+{
+	uint16_t mask;
+	uint16_t value;
+};
+
+typedef uint16_t *(*search_mask_scanner_t) (uint8_t *, size_t, int, const struct find_search_mask *);
+
+enum
+{
+	SEARCH_MASK_SCALAR,
+	SEARCH_MASK_SSE2,
+	SEARCH_MASK_AVX2,
+	SEARCH_MASK_LEVELS
+};
+
+/*
+ * A finder's search table together with scanners specialized for it, one
+ * per scanner level.
+ */
+struct search_mask_matcher
+{
+	const char *name;
+	const struct find_search_mask *masks;
+	int num_masks;
+	uint16_t *(*scan[SEARCH_MASK_LEVELS]) (uint8_t *, size_t);
+};
+
+/* Interpreted scanners by level, NULL past the ones built for this host. */
+extern const search_mask_scanner_t search_mask_scanners[SEARCH_MASK_LEVELS];
+
+/* The generated matchers, one per table in kcache_masks.def. */
+extern const struct search_mask_matcher *const search_mask_matchers[];
+extern const int search_mask_matcher_count;
+
+int		search_mask_cpu_level (void);
+
+#endif /* __KCACHE_SCAN_H */
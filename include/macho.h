@@ -146,6 +146,15 @@ typedef enum {
 /* 
  * These are used for segment names.
  */
+#ifndef VM_PROT_READ
+#define VM_PROT_READ    0x01
+#define VM_PROT_WRITE   0x02
+#define VM_PROT_EXECUTE 0x04
+#endif
+
+#define S_ATTR_PURE_INSTRUCTIONS    0x80000000  /* section contains only true machine instructions */
+#define S_ATTR_SOME_INSTRUCTIONS    0x00000400  /* section contains some machine instructions */
+
 #define kSegDataName    "__DATA"
 #define kSegTextName    "__TEXT"
 
@@ -182,6 +191,27 @@ struct section {                /* for 32-bit architectures */
     uint32_t reserved2;         /* reserved (for count or sizeof) */
 } __attribute__ ((packed));
 
+struct symtab_command {
+    uint32_t cmd;               /* LC_SYMTAB */
+    uint32_t cmdsize;           /* sizeof(struct symtab_command) */
+    uint32_t symoff;            /* symbol table offset */
+    uint32_t nsyms;             /* number of symbol table entries */
+    uint32_t stroff;            /* string table offset */
+    uint32_t strsize;           /* string table size in bytes */
+} __attribute__ ((packed));
+
+struct nlist {
+    uint32_t n_strx;            /* index into the string table */
+    uint8_t n_type;             /* type flag, see below */
+    uint8_t n_sect;             /* section number or NO_SECT */
+    int16_t n_desc;             /* see <mach-o/stab.h> */
+    uint32_t n_value;           /* value of this symbol (or stab offset) */
+} __attribute__ ((packed));
+
+#define N_STAB  0xe0            /* if any of these bits set, a symbolic debugging entry */
+#define N_TYPE  0x0e            /* mask for the type bits */
+#define N_SECT  0xe             /* defined in section number n_sect */
+
 
 /*
  * Format of a relocation entry of a Mach-O file.  Modified from the 4.3BSD
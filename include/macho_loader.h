@@ -48,6 +48,62 @@ typedef struct __loader_context {
     struct dysymtab_command* dsymtab;
 } loader_context_t;
 
+/*
+ * One mapped range of the file: a segment, or a section of one.
+ */
+typedef struct __macho_range {
+    char segname[17];
+    char sectname[17];          /* empty for a segment */
+    uint32_t vmaddr;
+    uint32_t vmsize;
+    uint32_t fileoff;
+    uint32_t filesize;
+    uint32_t flags;             /* initprot of a segment, flags of a section */
+} macho_range_t;
+
+typedef struct __macho_symbol {
+    const char *name;           /* in the image's string table */
+    uint32_t value;
+    uint32_t next;              /* hash chain */
+} macho_symbol_t;
+
+/*
+ * Address translation tables and symbol index for one image. Segments and
+ * sections are sorted by vmaddr, by_fileoff holds the segments backed by
+ * the file sorted by file offset, and defined symbols are hashed by name with their values sorted
+ * alongside so the extent of a symbol is a binary search.
+ */
+typedef struct __macho_map {
+    uint8_t *source;
+    uint32_t size;
+    macho_range_t *segments;
+    uint32_t nsegments;
+    macho_range_t *by_fileoff;
+    uint32_t nfileoff;
+    macho_range_t *sections;
+    uint32_t nsections;
+    macho_symbol_t *symbols;
+    uint32_t nsymbols;
+    uint32_t *buckets;
+    uint32_t mask;
+    uint32_t *values;
+} macho_map_t;
+
+/*
+ * Compiled local relocations: one bit per aligned 32-bit word of the image
+ * that holds an absolute address, plus the odd slot that is not word
+ * aligned. Built once from the dysymtab, it can rebase any number of
+ * copies of the image by any delta.
+ */
+typedef struct __macho_reloc_map {
+    uint32_t *bitmap;           /* bit n of word w covers offset (w * 32 + n) * 4 */
+    uint32_t nwords;
+    uint32_t *unaligned;        /* offsets of slots that are not word aligned */
+    uint32_t nunaligned;
+    uint32_t nslots;            /* total slots, aligned or not */
+    uint32_t size;              /* bytes of image covered */
+} macho_reloc_map_t;
+
 /*
  * These are the error codes returned by the loader for core operations.
  */
@@ -68,6 +124,12 @@ typedef enum {
  */
 loader_return_t macho_rebase(loader_context_t * ctx, uint32_t slide);
 
+loader_return_t macho_reloc_compile(macho_reloc_map_t * map, loader_context_t * ctx, uint32_t size);
+
+void macho_reloc_apply(const macho_reloc_map_t * map, uint8_t * image, uint32_t delta);
+
+void macho_reloc_free(macho_reloc_map_t * map);
+
 loader_return_t macho_initialize(loader_context_t * ctx, void *file);
 
 loader_return_t macho_set_vm_bias(loader_context_t * ctx, uint32_t vmaddr);
@@ -78,4 +140,18 @@ loader_return_t macho_file_map(loader_context_t * ctx, uint32_t loadaddr, uint32
 
 uint32_t macho_get_vmsize(loader_context_t * ctx);
 
+loader_return_t macho_map_build(macho_map_t * map, void *file, uint32_t size);
+
+void macho_map_free(macho_map_t * map);
+
+loader_return_t macho_va_to_offset(const macho_map_t * map, uint32_t va, uint32_t * offset);
+
+loader_return_t macho_offset_to_va(const macho_map_t * map, uint32_t offset, uint32_t * va);
+
+const macho_range_t *macho_find_segment(const macho_map_t * map, const char *segname);
+
+const macho_range_t *macho_find_section(const macho_map_t * map, const char *segname, const char *sectname);
+
+loader_return_t macho_find_symbol(const macho_map_t * map, const char *name, uint32_t * value, uint32_t * size);
+
 #endif
@@ -22,9 +22,14 @@
 #ifndef __PATCH_H
 #define __PATCH_H
 
-int		patch_list_add_patch (const char*, uint8_t*, uint8_t*, int);
-int		patch_list_initialize (void);
-void	patch_list_iterate (void);
-int		patch_list_get_head(struct patch_list**, int*);
+int		patch_list_add_patch (struct patch_plan*, const char*, int, uint8_t*, uint8_t*, int);
+int		patch_list_initialize (struct patch_plan*);
+void	patch_list_free (struct patch_plan*);
+void	patch_list_iterate (struct patch_plan*);
+int		patch_list_get_patches (struct patch_plan*, struct generic_patch**, int*);
+int		patch_list_reserve (struct patch_plan*, int);
+int		patch_list_verify (struct patch_plan*, uint8_t*, int);
+int		patch_list_apply (struct patch_plan*, uint8_t*, int);
+int		patch_list_write (struct patch_plan*, int);
 
 #endif /* __PATCH_H */
\ No newline at end of file
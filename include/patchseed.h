@@ -0,0 +1,34 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+#ifndef __PATCHSEED_H
+#define __PATCHSEED_H
+
+struct patch_seed;
+
+struct patch_seed *patch_seed_load (const char*, const char*, uint8_t*, size_t);
+int		patch_seed_window (struct patch_seed*, const char*, uint32_t*, uint32_t*);
+int		patch_seed_check (struct patch_seed*, const char*, uint8_t*, size_t, uint32_t);
+void	patch_seed_count (struct patch_seed*, boolean_t);
+void	patch_seed_report (struct patch_seed*);
+void	patch_seed_free (struct patch_seed*);
+
+#endif /* __PATCHSEED_H */
@@ -0,0 +1,30 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+#ifndef __PLANCACHE_H
+#define __PLANCACHE_H
+
+int		patch_plan_cache_lookup (const char*, uint8_t*, int, struct patch_plan*, uint8_t*);
+int		patch_plan_cache_store (const char*, uint8_t*, int, struct patch_plan*, const uint8_t*);
+int		patch_plan_cache_fetch (const char*, uint8_t*, int, struct patch_plan*);
+void	patch_plan_cache_count (const char*, uint32_t, uint32_t, uint32_t*, uint32_t*);
+
+#endif /* __PLANCACHE_H */
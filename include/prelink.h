@@ -0,0 +1,49 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+
+#ifndef __PRELINK_H
+#define __PRELINK_H
+
+/*
+ * A prelinked kext and the part of the kernelcache holding its __TEXT.
+ */
+struct prelink_kext {
+	char *bundle;
+	uint32_t vmaddr;
+	uint32_t offset;
+	uint32_t size;
+};
+
+/*
+ * Every kext listed in __PRELINK_INFO that has an executable, sorted by
+ * bundle identifier.
+ */
+struct prelink_index {
+	struct prelink_kext *kexts;
+	int count;
+};
+
+int		prelink_index_build (struct prelink_index*, const macho_map_t*, uint8_t*, size_t);
+const struct prelink_kext *prelink_find_kext (const struct prelink_index*, const char*);
+void	prelink_index_free (struct prelink_index*);
+
+#endif /* __PRELINK_H */
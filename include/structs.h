@@ -67,21 +67,25 @@ struct generic_patch
     uint8_t *original;
     uint8_t *patched;
     int size;
+    int offset;
     char* name;
 };
 
-struct patch_list
-{
-    struct patch_list *next;
-    struct generic_patch patch;
-};
+struct patch_arena_chunk;
 
-struct patch_list_root
+/*
+ * A patch plan: the patches derived for one image. Each image context owns
+ * one, nothing in the patch code is shared between plans. The patches sit
+ * in one array; their names and byte strings come out of the plan's arena
+ * and stay put when the array grows.
+ */
+struct patch_plan
 {
-    struct patch_list *next;
-    struct generic_patch patch;
+    struct generic_patch *patches;
     int total;
-    char* name;
+    int capacity;
+    struct patch_arena_chunk *arena;
+    boolean_t initialized;
 };
 
 struct mapped_image {
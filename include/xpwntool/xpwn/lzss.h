@@ -1,5 +1,14 @@
 #include <stdint.h>
 
+#define LZSS_LEVEL_FAST		1
+#define LZSS_LEVEL_DEFAULT	2
+#define LZSS_LEVEL_BEST		3
+
 uint32_t lzadler32(uint8_t *buf, int32_t len);
+uint32_t lzadler32_update(uint32_t adler, const uint8_t *buf, uint32_t len);
 int decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen);
+int decompress_lzss_adler(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint32_t srclen, uint32_t *adler);
 uint8_t *compress_lzss(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint32_t srcLen);
+uint8_t *compress_lzss_level(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint32_t srclen, int level);
+uint8_t *compress_lzss_parallel(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint32_t srclen, int level, int threads);
+uint32_t compress_lzss_bound(uint32_t srclen);
@@ -1,276 +1,275 @@
 /*
  * ARM generic subroutine patcher.
- */ 
+ *
+ * One forward pass over the image decodes every Thumb BL/BLX into a call
+ * graph, kept twice: sorted by call site (caller -> callee) and sorted by
+ * target (callee -> callers). Finding the function around an address, the
+ * calls it makes and the callers of a subroutine are then binary searches
+ * instead of repeated scans over the whole image.
+ */
 
 #include "core.h"
 
-#if 0 /* work in progress */
+typedef struct {
+    unsigned int site;          /* offset of the BL/BLX */
+    unsigned int target;        /* offset of the callee */
+} arm_call_t;
 
-static char push = 0xB5;
-static char push_r7_lr[] = { 0x80, 0xB5 };
-static char push_r4_to_r7_lr[] = { 0xF0, 0xB5 };
-static char pop_r4_to_r7_lr[] = { 0xF0, 0xBD };
+typedef struct {
+    arm_call_t *by_caller;      /* sorted by site */
+    arm_call_t *by_callee;      /* sorted by target, then site */
+    int count;
+} arm_call_graph_t;
 
-static char* functions[][3] = {
-	{ "cmd_go", "jumping into image", push_r7_lr },
-	{ "image_load", "image validation failed but untrusted images are permitted", push_r4_to_r7_lr },
-	{ NULL, NULL, NULL }
+static const unsigned int image_bases[] = {
+    0x4FF00000, 0x84000000, 0x5FF00000, 0x0FF00000, 0x22000000
 };
 
-void* find_reference(unsigned char* data, unsigned int base, unsigned int size, char* signature) {
-	unsigned int i = 0;
-	unsigned int reference = 0;
-	unsigned int reference2 = 0;
-	// First find the string
-	unsigned int address = 0;
-	for(i = 0; i < size; i++) {
-		if(!memcmp(&data[i], signature, strlen(signature))) {
-			address = base | i;
-			break;
-		}
-	}
-	if(address == 0) return NULL;
-    
-	// Next find where that string is referenced
-    
-	for(i = 0; i < size; i++) {
-		if(!memcmp(&data[i], &address, 4)) {
-			reference = base | i;
-			break;
-		}
-	}
-	if(reference == 0) return NULL;
-	reference -= 8;
-    
-	for(i = 0; i < size; i++) {
-		if(!memcmp(&data[i], &reference, 4)) {
-			reference2 = base | i;
-			break;
-		}
-	}
-	if(reference2 == 0) return NULL;
-	return (void*)reference2;
-}
+#define IMAGE_BASES (sizeof(image_bases) / sizeof(image_bases[0]))
 
+static const char image_load_string[] = "image validation failed but untrusted images are permitted";
+static const unsigned char push_r4_to_r7_lr[] = { 0xF0, 0xB5 };
+static const unsigned char cmp_r0_0[] = { 0x00, 0x28 };
+static const unsigned char return_zero[] = { 0x00, 0x20, 0x70, 0x47 };     /* mov r0, #0; bx lr */
 
-void* find_top(unsigned char* data, unsigned int base, unsigned int size, unsigned int address) {
-	// Find the top of that function
-	int i = 0;
-	unsigned int function = 0;
-	while(i > 0) {
-		i--;
-		if(data[i] == push) {
-			function = base | i;
-			break;
-		}
-	}
-	if(function == 0) return NULL;
-	
-	return (void*)function;
-}
+/*
+ * Target of the BL (or BLX, which switches to ARM and is word aligned) at
+ * offset, or -1 if the halfwords there are not one.
+ */
+static int arm_resolve_bl32(const unsigned char *p, unsigned int offset, unsigned int *target) {
+    unsigned short first = p[offset] | (p[offset + 1] << 8);
+    unsigned short second = p[offset + 2] | (p[offset + 3] << 8);
+    unsigned int s, i1, i2, imm;
+    int jump;
+
+    if((first & 0xF800) != 0xF000)
+        return -1;
+    if((second & 0xD000) != 0xD000 && (second & 0xD001) != 0xC000)
+        return -1;
 
-int find_offset(char* data, unsigned int base, unsigned int size, char** what) {
-	unsigned int i = 0;
-	char* signature = (char*)what[1];
-	unsigned int reference = 0;
-	unsigned int address = 0;
-	for(i = 0; i < size; i++) {
-		if(!memcmp((char*)(&data[i]), (char*)signature, strlen(signature))) {
-			address = base | i;
-			break;
-		}
-	}
-    
-	if(address == 0) return 0;
-    
-    
-	for(i = 0; i < size; i++) {
-
-		if(!memcmp((const char*)&data[i], (const char*)&address, 4)) {
-			reference = base | i;
-			break;
-		}
-	}
-	if(reference == 0) return 0;
-    
-	while(i > 0) {
-		i--;
-		if(!memcmp((const char*)&data[i], what[2], 2)) {
-			break;
-		}
-	}
-    
-	return i;
+    s = (first >> 10) & 1;
+    i1 = ~(((second >> 13) & 1) ^ s) & 1;
+    i2 = ~(((second >> 11) & 1) ^ s) & 1;
+    imm = (s << 24) | (i1 << 23) | (i2 << 22) | ((first & 0x3FF) << 12) | ((second & 0x7FF) << 1);
+    jump = (int)(imm << 7) >> 7;
+
+    if(second & 0x1000)
+        *target = offset + 4 + jump;
+    else
+        *target = ((offset + 4) & ~3) + jump;
+
+    return 0;
 }
 
-unsigned int find_string(unsigned char* data, unsigned int base, unsigned int size, const char* name) {
-	// First find the string
-	int i = 0;
-	unsigned int address = 0;
-	for(i = 0; i < size; i++) {
-		if(!memcmp((const char*)&data[i], (const char*)name, strlen(name))) {
-			address = (unsigned int)&data[i];
-			break;
-		}
-	}
-	return address;
+static int arm_call_compare_callee(const void *a, const void *b) {
+    const arm_call_t *x = a, *y = b;
+
+    if(x->target != y->target)
+        return x->target < y->target ? -1 : 1;
+    return (x->site > y->site) - (x->site < y->site);
 }
 
-int find_function(const char* name, unsigned char* target, unsigned char* base, int l) {
-	int i = 0;
-	int found = 0;
-	for(i = 0; i < sizeof(functions); i++) {
-		if(!strcmp(functions[i][0], name)) {
-			found = (unsigned int)find_offset((char*)target, (unsigned int)base, l, (char**)functions[i]);
-			if(found < 0) {
-				return 0;
-			}
-			break;
-		}
-	}
-    
-	return found;
+static void arm_call_graph_free(arm_call_graph_t *g) {
+    free(g->by_caller);
+    free(g->by_callee);
+    memset(g, 0, sizeof(arm_call_graph_t));
 }
 
-void* pattern_search(void* addr, int len, int pattern, int mask, int step) {
-    char *caddr = (char*)(addr);
-    int i;
-    if(len <= 0)
-        return NULL;
-    
-    if(step < 0) {
-        len = -len;
-        len &= ~-(step+1);
-    } else {
-        len &= ~(step-1);
-    }
-    
-    for(i = 0; i != len; i += step) {
-        int x = *(int*)(caddr+i);
-        if((x & mask) == pattern) {
-            return (void*)(caddr+i);
+static int arm_call_graph_build(arm_call_graph_t *g, const unsigned char *p, int len) {
+    int capacity = 0;
+    unsigned int i, target;
+
+    memset(g, 0, sizeof(arm_call_graph_t));
+
+    for(i = 0; i + 4 <= (unsigned int)len; i += 2) {
+        if(arm_resolve_bl32(p, i, &target) || target >= (unsigned int)len)
+            continue;
+
+        if(g->count == capacity) {
+            arm_call_t *calls;
+
+            capacity = capacity ? capacity * 2 : 4096;
+            calls = realloc(g->by_caller, capacity * sizeof(arm_call_t));
+            if(!calls) {
+                arm_call_graph_free(g);
+                return -1;
+            }
+            g->by_caller = calls;
         }
+
+        g->by_caller[g->count].site = i;
+        g->by_caller[g->count].target = target;
+        g->count++;
+
+        /* Don't decode the second half of this call as another one. */
+        i += 2;
+    }
+
+    g->by_callee = malloc((g->count ? g->count : 1) * sizeof(arm_call_t));
+    if(!g->by_callee) {
+        arm_call_graph_free(g);
+        return -1;
     }
-    return NULL;
+    memcpy(g->by_callee, g->by_caller, g->count * sizeof(arm_call_t));
+    qsort(g->by_callee, g->count, sizeof(arm_call_t), arm_call_compare_callee);
+
+    return 0;
 }
 
-void* bl_search_down(void* p, int l) {
-    return pattern_search(p, l, 0xD000F000, 0xD000F800, 2);
+/* Index of the first entry of calls[0..count) whose key is >= value. */
+static int arm_call_lower_bound(const arm_call_t *calls, int count, unsigned int value, int by_target) {
+    int lo = 0, hi = count;
+
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        unsigned int key = by_target ? calls[mid].target : calls[mid].site;
+
+        if(key < value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
 }
 
-void* bl_search_up(void* p, int l) {
-    return pattern_search(p, l, 0xD000F000, 0xD000F800, -2);
+static int arm_call_graph_callers(const arm_call_graph_t *g, unsigned int target) {
+    int first = arm_call_lower_bound(g->by_callee, g->count, target, 1);
+    int last = arm_call_lower_bound(g->by_callee, g->count, target + 1, 1);
+
+    return last - first;
 }
 
-void* resolve_bl32(const void* bl)
-{
-    typedef unsigned short uint16_t;
-    typedef int int32_t;
-    union {
-        uint16_t value;
-        
-        struct {
-            uint16_t immediate : 10;
-            uint16_t s : 1;
-            uint16_t : 5;
-        };
-    } bits = {*(uint16_t*)bl};
-    
-    union {
-        uint16_t value;
-        
-        struct {
-            uint16_t immediate : 11;
-            uint16_t j2 : 1;
-            uint16_t x : 1;
-            uint16_t j1 : 1;
-            uint16_t : 2;
-        };
-    } exts = {((uint16_t*)bl)[1]};
-    
-    int32_t jump = 0;
-    jump |= bits.s << 24;
-    jump |= (~(bits.s ^ exts.j1) & 0x1) << 23;
-    jump |= (~(bits.s ^ exts.j2) & 0x1) << 22;
-    jump |= bits.immediate << 12;
-    jump |= exts.immediate << 1;
-    jump |= exts.x;
-    jump <<= 7;
-    jump >>= 7;
-    return (void*)((int)jump+4);
+static int arm_is_prologue(const unsigned char *p, unsigned int offset, int len) {
+    /* PUSH {..., lr} */
+    return offset + 2 <= (unsigned int)len && p[offset + 1] == 0xB5;
 }
 
-void patch_image_load(char*p, int l) {
-    unsigned int fn_begin, fn_end, fn_size;
-    unsigned char cmp_r0_0[] = {0x00, 0x28};
-    unsigned int imagebase = 0x4FF00000;
-    unsigned char replacement[] = {0x00, 0x20, 0x70, 0x47}; /* mov r0, #0; bx lr */
-    unsigned char function_prolog[] = {0xF0, 0xB5L}; /* push {r4-r7,lr}; add r7, sp, #0xc; push {r8,r10,r11} */
-    
-    static unsigned int cachebase;
-    unsigned int candidate = find_function("image_load", (unsigned char*)&p[0], (unsigned char*)0x4FF00000, l);
-    
-    if(!candidate) {
-        candidate = find_function("image_load", (unsigned char*)&p[0], (unsigned char*)0x84000000, l);
-        imagebase = 0x84000000;
-    }
-    
-    if(!candidate) {
-        candidate = find_function("image_load", (unsigned char*)&p[0], (unsigned char*)0x5FF00000, l);
-        imagebase = 0x5FF00000;
-    }
+/*
+ * The function around offset: the nearest called PUSH {..., lr} at or
+ * below it, up to the next one above. Call targets that are not prologues
+ * are data decoded as a BL and are passed over. Returns -1 if there is no
+ * such function below offset.
+ */
+static int arm_call_graph_function(const arm_call_graph_t *g, const unsigned char *p, int len, unsigned int offset, unsigned int *begin, unsigned int *end) {
+    int i = arm_call_lower_bound(g->by_callee, g->count, offset + 1, 1);
+    int j;
+
+    while(i > 0 && !arm_is_prologue(p, g->by_callee[i - 1].target, len))
+        i--;
+    if(!i)
+        return -1;
 
-    if(!candidate) {
-        candidate = find_function("image_load", (unsigned char*)&p[0], (unsigned char*)0x0FF00000, l);
-        imagebase = 0x0FF00000;
+    *begin = g->by_callee[i - 1].target;
+    *end = (unsigned int)len;
+    for(j = i; j < g->count; j++) {
+        if(g->by_callee[j].target > *begin && arm_is_prologue(p, g->by_callee[j].target, len)) {
+            *end = g->by_callee[j].target;
+            break;
+        }
     }
-    
-    if(!candidate) {
-        candidate = find_function("image_load", (unsigned char*)&p[0], (unsigned char*)0x22000000, l);
-        imagebase = 0x22000000;
+    return 0;
+}
+
+static int arm_find_string(const unsigned char *p, int len, const char *string) {
+    int n = strlen(string), i;
+    const unsigned char *q;
+
+    for(i = 0; i + n <= len; i++) {
+        q = memchr(p + i, string[0], len - n - i + 1);
+        if(!q)
+            break;
+        i = q - p;
+        if(!memcmp(q, string, n))
+            return i;
     }
-    
-    printf("Opcode:\t\tpush\t{r4-r7,lr}\tat 0x%x\n", candidate|imagebase);
-    fn_begin = candidate;
-    
-    while(memcmp((const char*)&p[candidate], pop_r4_to_r7_lr, 2)) {
-        candidate += 2;
+
+    return -1;
+}
+
+/*
+ * Find the literal pool word pointing at the string at offset, under any
+ * of the known load addresses, in one pass. The first base in the table
+ * wins when several match.
+ */
+static int arm_find_image_base(const unsigned char *p, int len, unsigned int offset, unsigned int *base, unsigned int *literal) {
+    unsigned int found[IMAGE_BASES];
+    unsigned int i, b, word;
+
+    memset(found, 0xFF, sizeof(found));
+
+    for(i = 0; i + 4 <= (unsigned int)len; i += 4) {
+        word = p[i] | (p[i + 1] << 8) | (p[i + 2] << 16) | ((unsigned int)p[i + 3] << 24);
+        for(b = 0; b < IMAGE_BASES; b++) {
+            if(word - offset == image_bases[b] && found[b] == 0xFFFFFFFF)
+                found[b] = i;
+        }
     }
-    
-    printf("Opcode:\t\tpop\t{r4-r7,lr}\tat 0x%x\n", candidate|imagebase);
-    fn_end = candidate;
-    
-    printf("Function size: %d bytes, image base 0x%08x\n", fn_end - fn_begin, imagebase);
-    fn_size = fn_end - fn_begin;
-    
-    candidate = fn_begin;
-    while(candidate <= fn_end - 128 /* last 128 bytes are simply epilogue */) {
-        unsigned int addr = bl_search_down(&p[candidate], fn_size) - (void*)&p[0];
-        uint32_t insn;
-        unsigned int base = (unsigned int)(addr+resolve_bl32(&insn)-1);
-        
-        memcpy(&insn, &p[addr], 4);
-        
-        if(cachebase != base) {
-            if(!memcmp(&p[addr] + 4, cmp_r0_0, 2)) {
-                if(!memcmp(&p[base], function_prolog, sizeof(function_prolog))) {
-                    memcpy(&p[base], replacement, sizeof(replacement));
-                    printf("nuked sub_%08x\n", base);
-                    cachebase = base;
-                }
-              } else if(!memcmp(&p[addr] + 6, cmp_r0_0, 2)) {
-                if(!memcmp(&p[base], function_prolog, sizeof(function_prolog))) {
-                    memcpy(&p[base], replacement, sizeof(replacement));
-                    printf("nuked sub_%08x\n", base);
-                    cachebase = base;
-                }
-            }
+
+    for(b = 0; b < IMAGE_BASES; b++) {
+        if(found[b] != 0xFFFFFFFF) {
+            *base = image_bases[b];
+            *literal = found[b];
+            return 0;
         }
-        
-        fn_size -= 2;
-        candidate += 2;
     }
-    
+
+    return -1;
 }
 
-#endif
+/*
+ * Make image_load() accept what it validates: every subroutine it calls
+ * whose result is immediately tested with CMP r0, #0 and that starts with
+ * PUSH {r4-r7, lr} is replaced with "return 0". Returns the number of
+ * subroutines patched, or -1 if image_load() could not be located.
+ */
+int patch_image_load(unsigned char *p, int len) {
+    arm_call_graph_t graph;
+    unsigned int imagebase, literal, fn_begin, fn_end, target;
+    int string, i, nuked = 0;
+
+    if(!p || len < 8)
+        return -1;
+
+    string = arm_find_string(p, len, image_load_string);
+    if(string < 0)
+        return -1;
+    if(arm_find_image_base(p, len, string, &imagebase, &literal))
+        return -1;
+
+    if(arm_call_graph_build(&graph, p, len))
+        return -1;
+
+    if(arm_call_graph_function(&graph, p, len, literal, &fn_begin, &fn_end) ||
+       memcmp(&p[fn_begin], push_r4_to_r7_lr, sizeof(push_r4_to_r7_lr))) {
+        arm_call_graph_free(&graph);
+        return -1;
+    }
+
+    printf("Opcode:\t\tpush\t{r4-r7,lr}\tat 0x%x\n", fn_begin + imagebase);
+    printf("Function size: %d bytes, image base 0x%08x, %d calls indexed\n", fn_end - fn_begin, imagebase, graph.count);
+
+    for(i = arm_call_lower_bound(graph.by_caller, graph.count, fn_begin, 0);
+        i < graph.count && graph.by_caller[i].site < fn_end; i++) {
+        unsigned int site = graph.by_caller[i].site;
+
+        target = graph.by_caller[i].target;
+        if(target == fn_begin || target + sizeof(return_zero) > (unsigned int)len)
+            continue;
+        if(site + 8 > (unsigned int)len)
+            continue;
+        if(memcmp(&p[site + 4], cmp_r0_0, 2) && memcmp(&p[site + 6], cmp_r0_0, 2))
+            continue;
+
+        /* Also skips callees already patched through an earlier call. */
+        if(memcmp(&p[target], push_r4_to_r7_lr, sizeof(push_r4_to_r7_lr)))
+            continue;
+
+        memcpy(&p[target], return_zero, sizeof(return_zero));
+        printf("nuked sub_%08x (%d callers)\n", target + imagebase, arm_call_graph_callers(&graph, target));
+        nuked++;
+    }
+
+    arm_call_graph_free(&graph);
+    return nuked;
+}
@@ -86,6 +86,42 @@ config_file_entry_t * config_fatal_find_entry(config_file_entry_t * entries,
     if(s) \
         b = (int)strtol(s->vardata, (char **)NULL, 10);
 
+/*
+ * A DeviceTree patch targets a property by path and the original value is
+ * optional. It need not be as long as the patched one, since a shorter
+ * value is zero padded. String properties are stored with their
+ * terminator, so it is part of both values.
+ */
+static void config_add_devicetree(char* name, char* node, char* property,
+                                  char* orig_hex_bytes, char* patch_hex_bytes,
+                                  char* orig_string, char* patch_string)
+{
+    unsigned char *t0 = NULL, *p0 = NULL;
+    size_t t0s = 0, p0s = 0;
+
+    if(patch_string) {
+        p0 = (unsigned char*)patch_string;
+        p0s = strlen(patch_string) + 1;
+        if(orig_string) {
+            t0 = (unsigned char*)orig_string;
+            t0s = strlen(orig_string) + 1;
+        }
+    } else if(patch_hex_bytes) {
+        hexToBytes(patch_hex_bytes, &p0, &p0s);
+        if(orig_hex_bytes)
+            hexToBytes(orig_hex_bytes, &t0, &t0s);
+    }
+
+    if(!node || !property || !p0 || devicetree_patch_add(name, node, property, t0, t0s, p0, p0s))
+        printf("DeviceTree patch \"%s\" needs a Node, a Property and a patched value.\n", name);
+
+    /* The patch keeps copies. */
+    if(!patch_string) {
+        free(t0);
+        free(p0);
+    }
+}
+
 void config_parse(config_file_entry_t * entries, int level)
 {
     
@@ -94,6 +130,8 @@ void config_parse(config_file_entry_t * entries, int level)
     static char* patch_hex_bytes;
     static char* orig_string;
     static char* patch_string;
+    static char* node;
+    static char* property;
     static int architecture;
     static int global_os;
     static char* type;
@@ -113,8 +151,18 @@ void config_parse(config_file_entry_t * entries, int level)
             SAFE_FIND("OriginalString", orig_string);
             SAFE_FIND("PatchedString", patch_string);
             SAFE_FIND("Type", type);
+            SAFE_FIND("Node", node);
+            SAFE_FIND("Property", property);
             SAFE_FIND_INT("GlobalOperatingSystem", global_os);
             SAFE_FIND_INT("Architecture", architecture);
+            if((orig_string && patch_hex_bytes) || (orig_hex_bytes && patch_string)) {
+                printf("Patch \"%s\" mixes a string with hex bytes. Skipping.\n", name);
+                goto next;
+            }
+            if(type && !strcasecmp(type, "DeviceTree")) {
+                config_add_devicetree(name, node, property, orig_hex_bytes, patch_hex_bytes, orig_string, patch_string);
+                goto next;
+            }
             if(orig_string && patch_string) {
                 t0s = strlen(orig_string);
                 p0s = strlen(patch_string);
@@ -147,7 +195,8 @@ void config_parse(config_file_entry_t * entries, int level)
                 patch_node_add(name, t0, p0, t0s, architecture, global_os, patch_node_create(), kernel_patches);
             else
                 printf("Unknown patch type \"%s\".\n", name);
-            orig_hex_bytes = patch_hex_bytes = orig_string = patch_string = NULL;
+        next:
+            orig_hex_bytes = patch_hex_bytes = orig_string = patch_string = node = property = NULL;
             architecture = global_os = t0s = p0s = 0;
             t0 = p0 = type = NULL;
         }
@@ -179,5 +228,12 @@ void config_check(config_file_t * config)
     }
     
     config_parse(root, 1);
+
+    iboot_patch_matcher = patch_matcher_compile(iboot_patches);
+    kernel_patch_matcher = patch_matcher_compile(kernel_patches);
+    if(!iboot_patch_matcher || !kernel_patch_matcher) {
+        printf("Failed to compile patch list.\n");
+        exit(-1);
+    }
 }
 
@@ -10,6 +10,8 @@ int arch = 0;
 int global_version = 0;
 patch_list_t *iboot_patches;
 patch_list_t *kernel_patches;
+patch_matcher_t *iboot_patch_matcher;
+patch_matcher_t *kernel_patch_matcher;
 extern config_file_t *config;
 irecv_device_t device = NULL;
 irecv_client_t client = NULL;
@@ -0,0 +1,368 @@
+/*
+ * devicetree.c
+ *
+ * Flattened DeviceTree parser.
+ *
+ * One walk over the buffer records every node with its path and every
+ * property with the offset and length of its value. Nodes are hashed by
+ * path and properties by (node, name), so reading or rewriting a property
+ * is a lookup instead of a scan, and values are changed in place.
+ */
+
+#include "core.h"
+
+#define DT_MAX_DEPTH	64
+
+typedef struct _dt_patch {
+    char *name;
+    char *path;
+    char *property;
+    unsigned char *original;
+    int original_size;
+    unsigned char *replacement;
+    int size;
+    struct _dt_patch *next;
+} dt_patch_t;
+
+static dt_patch_t *dt_patches, **dt_patches_tail = &dt_patches;
+
+static unsigned int dt_read32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned int dt_hash_string(const char *s) {
+    unsigned int h = 2166136261U;
+
+    /* "/chosen" and "chosen" name the same node. */
+    if(*s == '/')
+        s++;
+    while(*s)
+        h = (h ^ (unsigned char)*s++) * 16777619U;
+    return h;
+}
+
+static unsigned int dt_hash_property(int node, const char *name) {
+    return dt_hash_string(name) ^ ((unsigned int)node * 2654435761U);
+}
+
+static int dt_path_equal(const char *a, const char *b) {
+    if(*a == '/')
+        a++;
+    if(*b == '/')
+        b++;
+    return !strcmp(a, b);
+}
+
+static int dt_add_node(devicetree_t *dt, int parent, unsigned int offset) {
+    dt_node_t *nodes;
+
+    if(dt->nnodes == dt->node_capacity) {
+        dt->node_capacity = dt->node_capacity ? dt->node_capacity * 2 : 64;
+        nodes = realloc(dt->nodes, dt->node_capacity * sizeof(dt_node_t));
+        if(!nodes)
+            return -1;
+        dt->nodes = nodes;
+    }
+
+    memset(&dt->nodes[dt->nnodes], 0, sizeof(dt_node_t));
+    dt->nodes[dt->nnodes].parent = parent;
+    dt->nodes[dt->nnodes].offset = offset;
+    dt->nodes[dt->nnodes].first_property = dt->nproperties;
+    return dt->nnodes++;
+}
+
+static int dt_add_property(devicetree_t *dt, int node, const unsigned char *name, unsigned int offset, unsigned int length) {
+    dt_property_t *properties;
+
+    if(dt->nproperties == dt->property_capacity) {
+        dt->property_capacity = dt->property_capacity ? dt->property_capacity * 2 : 256;
+        properties = realloc(dt->properties, dt->property_capacity * sizeof(dt_property_t));
+        if(!properties)
+            return -1;
+        dt->properties = properties;
+    }
+
+    memset(&dt->properties[dt->nproperties], 0, sizeof(dt_property_t));
+    memcpy(dt->properties[dt->nproperties].name, name, DT_PROPERTY_NAME_LENGTH);
+    dt->properties[dt->nproperties].node = node;
+    dt->properties[dt->nproperties].offset = offset;
+    dt->properties[dt->nproperties].length = length;
+    return dt->nproperties++;
+}
+
+/*
+ * Path of a node from its "name" property, which must be a string that
+ * ends inside the value.
+ */
+static int dt_set_path(devicetree_t *dt, int node, int name) {
+    const char *parent = dt->nodes[node].parent < 0 ? NULL : dt->nodes[dt->nodes[node].parent].path;
+    const char *s = "";
+    char *path;
+
+    if(!parent) {
+        dt->nodes[node].path = strdup("/");
+        return dt->nodes[node].path ? 0 : -1;
+    }
+
+    if(name >= 0 && dt->properties[name].length &&
+       memchr(dt->data + dt->properties[name].offset, 0, dt->properties[name].length))
+        s = (const char *)dt->data + dt->properties[name].offset;
+
+    path = malloc(strlen(parent) + 1 + strlen(s) + 1);
+    if(!path)
+        return -1;
+    sprintf(path, "%s%s%s", parent, strcmp(parent, "/") ? "/" : "", s);
+    dt->nodes[node].path = path;
+    return 0;
+}
+
+static int dt_parse_node(devicetree_t *dt, unsigned int *offset, int parent, int depth) {
+    unsigned int nproperties, nchildren, length, i;
+    int node, prop, name = -1;
+
+    if(depth > DT_MAX_DEPTH || dt->size - *offset < 8)
+        return -1;
+
+    nproperties = dt_read32(dt->data + *offset);
+    nchildren = dt_read32(dt->data + *offset + 4);
+    if((node = dt_add_node(dt, parent, *offset)) < 0)
+        return -1;
+    *offset += 8;
+
+    for(i = 0; i < nproperties; i++) {
+        if(dt->size - *offset < DT_PROPERTY_NAME_LENGTH + 4)
+            return -1;
+        length = dt_read32(dt->data + *offset + DT_PROPERTY_NAME_LENGTH) & ~DT_PROPERTY_PLACEHOLDER;
+        if(length > dt->size - *offset - DT_PROPERTY_NAME_LENGTH - 4)
+            return -1;
+
+        prop = dt_add_property(dt, node, dt->data + *offset, *offset + DT_PROPERTY_NAME_LENGTH + 4, length);
+        if(prop < 0)
+            return -1;
+        if(name < 0 && !strcmp(dt->properties[prop].name, "name"))
+            name = prop;
+
+        *offset += DT_PROPERTY_NAME_LENGTH + 4 + ((length + 3) & ~3);
+        if(*offset > dt->size)
+            return -1;
+    }
+
+    dt->nodes[node].nproperties = nproperties;
+    dt->nodes[node].nchildren = nchildren;
+    if(dt_set_path(dt, node, name))
+        return -1;
+
+    for(i = 0; i < nchildren; i++) {
+        if(dt_parse_node(dt, offset, node, depth + 1))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int dt_build_index(devicetree_t *dt) {
+    unsigned int buckets = 1, h;
+    int i;
+
+    while(buckets < (unsigned int)(dt->nnodes > dt->nproperties ? dt->nnodes : dt->nproperties) * 2)
+        buckets <<= 1;
+
+    dt->node_buckets = malloc(buckets * sizeof(int));
+    dt->property_buckets = malloc(buckets * sizeof(int));
+    if(!dt->node_buckets || !dt->property_buckets)
+        return -1;
+    memset(dt->node_buckets, 0xFF, buckets * sizeof(int));
+    memset(dt->property_buckets, 0xFF, buckets * sizeof(int));
+    dt->mask = buckets - 1;
+
+    /* Push in reverse so the first of any duplicates is found first. */
+    for(i = dt->nnodes; i-- > 0;) {
+        h = dt_hash_string(dt->nodes[i].path) & dt->mask;
+        dt->nodes[i].next = dt->node_buckets[h];
+        dt->node_buckets[h] = i;
+    }
+    for(i = dt->nproperties; i-- > 0;) {
+        h = dt_hash_property(dt->properties[i].node, dt->properties[i].name) & dt->mask;
+        dt->properties[i].next = dt->property_buckets[h];
+        dt->property_buckets[h] = i;
+    }
+
+    return 0;
+}
+
+devicetree_t *devicetree_parse(unsigned char *data, unsigned int size) {
+    devicetree_t *dt;
+    unsigned int offset = 0;
+
+    if(!data || size < 8)
+        return NULL;
+
+    dt = malloc(sizeof(devicetree_t));
+    if(!dt)
+        return NULL;
+    memset(dt, 0, sizeof(devicetree_t));
+    dt->data = data;
+    dt->size = size;
+
+    /* Anything after the root node is padding. */
+    if(dt_parse_node(dt, &offset, -1, 0) || dt_build_index(dt)) {
+        devicetree_free(dt);
+        return NULL;
+    }
+
+    DPRINT("DeviceTree: %d nodes, %d properties in %u bytes\n", dt->nnodes, dt->nproperties, offset);
+    return dt;
+}
+
+void devicetree_free(devicetree_t *dt) {
+    int i;
+
+    if(!dt)
+        return;
+
+    for(i = 0; i < dt->nnodes; i++)
+        free(dt->nodes[i].path);
+    free(dt->nodes);
+    free(dt->properties);
+    free(dt->node_buckets);
+    free(dt->property_buckets);
+    free(dt);
+}
+
+dt_node_t *devicetree_find_node(devicetree_t *dt, const char *path) {
+    int i;
+
+    if(!dt || !path || !dt->node_buckets)
+        return NULL;
+
+    for(i = dt->node_buckets[dt_hash_string(path) & dt->mask]; i >= 0; i = dt->nodes[i].next) {
+        if(dt_path_equal(dt->nodes[i].path, path))
+            return &dt->nodes[i];
+    }
+
+    return NULL;
+}
+
+dt_property_t *devicetree_find_property(devicetree_t *dt, const char *path, const char *name) {
+    dt_node_t *n = devicetree_find_node(dt, path);
+    int node, i;
+
+    if(!n || !name)
+        return NULL;
+
+    node = n - dt->nodes;
+    for(i = dt->property_buckets[dt_hash_property(node, name) & dt->mask]; i >= 0; i = dt->properties[i].next) {
+        if(dt->properties[i].node == node && !strcmp(dt->properties[i].name, name))
+            return &dt->properties[i];
+    }
+
+    return NULL;
+}
+
+void *devicetree_property_value(devicetree_t *dt, dt_property_t *prop) {
+    if(!dt || !prop)
+        return NULL;
+
+    return dt->data + prop->offset;
+}
+
+int devicetree_get_u32(devicetree_t *dt, const char *path, const char *name, unsigned int *value) {
+    dt_property_t *prop = devicetree_find_property(dt, path, name);
+
+    if(!prop || prop->length < 4)
+        return -1;
+
+    *value = dt_read32(dt->data + prop->offset);
+    return 0;
+}
+
+/*
+ * Rewrite a property value in place. The value cannot grow; a shorter one
+ * is zero padded to the old length.
+ */
+int devicetree_set_property(devicetree_t *dt, const char *path, const char *name, const void *value, unsigned int length) {
+    dt_property_t *prop = devicetree_find_property(dt, path, name);
+
+    if(!prop || length > prop->length)
+        return -1;
+
+    memcpy(dt->data + prop->offset, value, length);
+    memset(dt->data + prop->offset + length, 0, prop->length - length);
+    return 0;
+}
+
+/*
+ * Register a patch for the property "property" of the node at "path".
+ * original may be NULL; when it is given, the patch only applies if the
+ * value starts with those original_size bytes.
+ */
+int devicetree_patch_add(const char *name, const char *path, const char *property, const unsigned char *original, int original_size, const unsigned char *replacement, int size) {
+    dt_patch_t *patch;
+
+    if(!name || !path || !property || !replacement || size <= 0 || (original && original_size <= 0))
+        return -1;
+
+    patch = malloc(sizeof(dt_patch_t));
+    if(!patch)
+        return -1;
+    memset(patch, 0, sizeof(dt_patch_t));
+
+    patch->name = strdup(name);
+    patch->path = strdup(path);
+    patch->property = strdup(property);
+    patch->replacement = malloc(size);
+    if(original)
+        patch->original = malloc(original_size);
+    if(!patch->name || !patch->path || !patch->property || !patch->replacement || (original && !patch->original)) {
+        free(patch->name);
+        free(patch->path);
+        free(patch->property);
+        free(patch->replacement);
+        free(patch->original);
+        free(patch);
+        return -1;
+    }
+    memcpy(patch->replacement, replacement, size);
+    if(original)
+        memcpy(patch->original, original, original_size);
+    patch->original_size = original_size;
+    patch->size = size;
+
+    printf("Registering DeviceTree patch \"%s\" for %s:%s with size %d\n", name, path, property, size);
+
+    *dt_patches_tail = patch;
+    dt_patches_tail = &patch->next;
+    return 0;
+}
+
+/*
+ * Apply every registered DeviceTree patch. Returns the number applied.
+ */
+int devicetree_patch_apply(devicetree_t *dt) {
+    dt_patch_t *patch;
+    dt_property_t *prop;
+    int applied = 0;
+
+    for(patch = dt_patches; patch; patch = patch->next) {
+        prop = devicetree_find_property(dt, patch->path, patch->property);
+        if(!prop) {
+            printf("Patch \"%s\": %s:%s not found\n", patch->name, patch->path, patch->property);
+            continue;
+        }
+        if((unsigned int)patch->size > prop->length) {
+            printf("Patch \"%s\": value is %d bytes, %s:%s holds %u\n", patch->name, patch->size, patch->path, patch->property, prop->length);
+            continue;
+        }
+        if(patch->original && ((unsigned int)patch->original_size > prop->length ||
+                               memcmp(dt->data + prop->offset, patch->original, patch->original_size))) {
+            printf("Patch \"%s\": %s:%s does not hold the original value\n", patch->name, patch->path, patch->property);
+            continue;
+        }
+
+        devicetree_set_property(dt, patch->path, patch->property, patch->replacement, patch->size);
+        printf("Patch \"%s\" applied to %s:%s\n", patch->name, patch->path, patch->property);
+        applied++;
+    }
+
+    return applied;
+}
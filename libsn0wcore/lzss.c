@@ -22,6 +22,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <xpwn/lzss.h>
 
 #ifdef MSVC_VER
@@ -55,11 +57,11 @@
 #define DO8(buf,i)  DO4(buf,i); DO4(buf,i+4);
 #define DO16(buf)   DO8(buf,0); DO8(buf,8);
 
-uint32_t lzadler32(uint8_t * buf, int32_t len)
+uint32_t lzadler32_update(uint32_t adler, const uint8_t * buf, uint32_t len)
 {
-	unsigned long s1 = 1;	// adler & 0xffff;
-	unsigned long s2 = 0;	// (adler >> 16) & 0xffff;
-	int k;
+	unsigned long s1 = adler & 0xffff;
+	unsigned long s2 = (adler >> 16) & 0xffff;
+	uint32_t k;
 
 	while (len > 0) {
 		k = len < NMAX ? len : NMAX;
@@ -81,6 +83,11 @@ uint32_t lzadler32(uint8_t * buf, int32_t len)
 	return (s2 << 16) | s1;
 }
 
+uint32_t lzadler32(uint8_t * buf, int32_t len)
+{
+	return lzadler32_update(1, buf, len > 0 ? len : 0);
+}
+
 /**************************************************************
  LZSS.C -- A Data Compression Program
 ***************************************************************
@@ -115,58 +122,122 @@ struct encode_state {
 	int match_position, match_length;
 };
 
-int decompress_lzss(uint8_t * dst, uint8_t * src, uint32_t srclen)
+/*
+ * Output is summed in chunks of this size while it is still in cache,
+ * instead of in a second pass over the whole image.
+ */
+#define ADLER_CHUNK	16384
+
+/*
+ * Byte at pos < 0 of the output, as the encoder's ring holds it before
+ * anything is written: spaces, then the zeroed slots the first F bytes
+ * of text will occupy.
+ */
+static uint8_t lzss_prefill(int pos)
+{
+	return ((N - F + pos) & (N - 1)) < N - F ? ' ' : 0;
+}
+
+/*
+ * Decode srclen bytes of src into at most dstlen bytes of dst and return
+ * the number written. The ring buffer of the encoder is the last N bytes
+ * of dst itself, so matches are copied straight from the output; only
+ * the first N bytes can reach back into the pre-filled ring. If adler is
+ * not NULL it receives the Adler-32 of the output. overrun allows match
+ * copies to write past the match, still within dstlen, so it must only
+ * be set when dstlen is the real size of dst.
+ */
+static int lzss_decode(uint8_t * dst, uint32_t dstlen, uint8_t * src,
+		       uint32_t srclen, uint32_t * adler, int overrun)
 {
-	/* ring buffer of size N, with extra F-1 bytes to aid string comparison */
-	uint8_t text_buf[N + F - 1];
-	uint8_t *dststart = dst;
 	uint8_t *srcend = src + srclen;
-	int i, j, k, r, c;
-	unsigned int flags;
+	uint32_t o = 0, summed = 0, sum = 1;
+	unsigned int flags, i, j, k, bit, dist;
 
-	dst = dststart;
-	srcend = src + srclen;
-	for (i = 0; i < N - F; i++)
-		text_buf[i] = ' ';
-	r = N - F;
-	flags = 0;
-	for (;;) {
-		if (((flags >>= 1) & 0x100) == 0) {
-			if (src < srcend)
-				c = *src++;
-			else
-				break;
-			flags = c | 0xFF00;	/* uses higher byte cleverly */
-		}		/* to count eight */
-		if (flags & 1) {
-			if (src < srcend)
-				c = *src++;
-			else
-				break;
-			*dst++ = c;
-			text_buf[r++] = c;
-			r &= (N - 1);
+	while (src < srcend) {
+		flags = *src++;
+
+		if (flags == 0xFF && srcend - src >= 8 && dstlen - o >= 8) {
+			/* Eight literals in a row. */
+			memcpy(dst + o, src, 8);
+			src += 8;
+			o += 8;
 		} else {
-			if (src < srcend)
-				i = *src++;
-			else
-				break;
-			if (src < srcend)
-				j = *src++;
-			else
-				break;
-			i |= ((j & 0xF0) << 4);
-			j = (j & 0x0F) + THRESHOLD;
-			for (k = 0; k <= j; k++) {
-				c = text_buf[(i + k) & (N - 1)];
-				*dst++ = c;
-				text_buf[r++] = c;
-				r &= (N - 1);
+			for (bit = 0; bit < 8; bit++, flags >>= 1) {
+				if (flags & 1) {
+					if (src >= srcend || o >= dstlen)
+						goto done;
+					dst[o++] = *src++;
+					continue;
+				}
+
+				if (srcend - src < 2)
+					goto done;
+				i = src[0] | ((src[1] & 0xF0) << 4);
+				j = (src[1] & 0x0F) + THRESHOLD + 1;
+				src += 2;
+
+				/* Distance back to ring slot i, 1 to N. */
+				dist = ((N - F + o - i - 1) & (N - 1)) + 1;
+				if (j > dstlen - o)
+					j = dstlen - o;
+
+				if (dist <= o) {
+					uint8_t *from = dst + o - dist;
+
+					if (overrun && dist >= 8 && dstlen - o >= F + 6) {
+						/*
+						 * Eight bytes at a time, overrunning into
+						 * bytes the next token rewrites; dist >= 8
+						 * keeps each source word clear of its copy.
+						 */
+						memcpy(dst + o, from, 8);
+						memcpy(dst + o + 8, from + 8, 8);
+						if (j > 16)
+							memcpy(dst + o + 16, from + 16, 8);
+					} else if (dist >= j)
+						memcpy(dst + o, from, j);
+					else
+						for (k = 0; k < j; k++)
+							dst[o + k] = from[k];
+				} else {
+					for (k = 0; k < j; k++) {
+						int pos = (int)(o + k) - (int)dist;
+
+						dst[o + k] = pos < 0 ? lzss_prefill(pos) : dst[pos];
+					}
+				}
+				o += j;
+				if (o == dstlen)
+					goto done;
 			}
 		}
+
+		if (adler && o - summed >= ADLER_CHUNK) {
+			sum = lzadler32_update(sum, dst + summed, o - summed);
+			summed = o;
+		}
 	}
 
-	return dst - dststart;
+ done:
+	if (adler)
+		*adler = lzadler32_update(sum, dst + summed, o - summed);
+	return o;
+}
+
+int decompress_lzss_adler(uint8_t * dst, uint32_t dstlen, uint8_t * src,
+			  uint32_t srclen, uint32_t * adler)
+{
+	return lzss_decode(dst, dstlen, src, srclen, adler, 1);
+}
+
+/*
+ * The size of dst is not known here, so nothing is written past the
+ * end of the output. Prefer decompress_lzss_adler().
+ */
+int decompress_lzss(uint8_t * dst, uint8_t * src, uint32_t srclen)
+{
+	return lzss_decode(dst, UINT32_MAX, src, srclen, NULL, 0);
 }
 
 /*
@@ -405,3 +476,420 @@ uint8_t *compress_lzss(uint8_t * dst, uint32_t dstlen, uint8_t * src,
 	free(sp);
 	return dst;
 }
+
+/*
+ * Hash chain encoder.
+ *
+ * Produces the same stream format as compress_lzss(), but finds matches by
+ * walking chains of earlier positions that share their first three bytes
+ * instead of maintaining binary trees. How far down a chain to look and
+ * whether to defer a match by one byte when the next position has a longer
+ * one is set by the level.
+ */
+
+#define HASH_BITS	15
+#define HASH_SIZE	(1 << HASH_BITS)
+#define WINDOW		(N - F)	/* furthest back the tree encoder reaches */
+
+struct lzss_level {
+	int chain;		/* candidates examined per position */
+	int lazy;		/* try the next position before taking a match */
+	int insert_all;		/* index positions inside matches too */
+};
+
+static const struct lzss_level lzss_levels[] = {
+	{4, 0, 0},		/* LZSS_LEVEL_FAST */
+	{32, 0, 1},		/* LZSS_LEVEL_DEFAULT */
+	{1024, 1, 1},		/* LZSS_LEVEL_BEST */
+};
+
+struct hash_state {
+	int head[HASH_SIZE];	/* latest position per hash */
+	int prev[N];		/* older position with the same hash, by pos & (N - 1) */
+	int inserted;		/* positions below this are indexed */
+};
+
+/*
+ * Token sink. Normally tokens are written as groups of a flag byte and up
+ * to eight codes. With bits set, the flags of a segment are collected
+ * apart from its codes instead, to be laid out into groups once the
+ * segments before it are known.
+ */
+struct lzss_out {
+	uint8_t *dst, *end;
+	uint8_t *flags;		/* flag byte of the current group */
+	int bit;
+	uint8_t *bits;		/* one flag bit per token, segment mode */
+	uint32_t ntokens;
+};
+
+uint32_t compress_lzss_bound(uint32_t srclen)
+{
+	/* Nothing but literals, plus one flag byte per eight of them. */
+	return srclen + (srclen + 7) / 8;
+}
+
+static uint32_t lzss_hash(const uint8_t * p)
+{
+	return (((uint32_t) p[0] << 16 | p[1] << 8 | p[2]) * 2654435761U) >>
+	    (32 - HASH_BITS);
+}
+
+static void lzss_insert(struct hash_state *hs, const uint8_t * src,
+			uint32_t end, int upto)
+{
+	uint32_t h;
+
+	for (; hs->inserted < upto; hs->inserted++) {
+		if ((uint32_t) hs->inserted + 3 > end)
+			continue;
+		h = lzss_hash(src + hs->inserted);
+		hs->prev[hs->inserted & (N - 1)] = hs->head[h];
+		hs->head[h] = hs->inserted;
+	}
+}
+
+/*
+ * Longest match for pos that ends by end, among indexed positions no more
+ * than WINDOW back. Returns its length, 0 if it is under THRESHOLD + 1.
+ */
+static int lzss_longest(const struct hash_state *hs, const uint8_t * src,
+			uint32_t end, int pos, int chain, int *dist)
+{
+	const uint8_t *p = src + pos;
+	int limit = end - pos < F ? (int)(end - pos) : F;
+	int best = THRESHOLD, c, k;
+
+	if (limit <= THRESHOLD)
+		return 0;
+
+	for (c = hs->head[lzss_hash(p)]; c >= 0 && pos - c <= WINDOW && chain--;
+	     c = hs->prev[c & (N - 1)]) {
+		const uint8_t *q = src + c;
+
+		if (q[best] != p[best] || q[0] != p[0])
+			continue;
+		for (k = 1; k < limit && q[k] == p[k]; k++) ;
+		if (k > best) {
+			best = k;
+			*dist = pos - c;
+			if (k == limit)
+				break;
+		}
+	}
+
+	return best > THRESHOLD ? best : 0;
+}
+
+static int lzss_put(struct lzss_out *out, int literal, const uint8_t * code,
+		    int n)
+{
+	if (out->bits) {
+		if (literal)
+			out->bits[out->ntokens >> 3] |= 1 << (out->ntokens & 7);
+		out->ntokens++;
+	} else {
+		if (out->bit == 8) {
+			if (out->dst >= out->end)
+				return -1;
+			out->flags = out->dst++;
+			*out->flags = 0;
+			out->bit = 0;
+		}
+		if (literal)
+			*out->flags |= 1 << out->bit;
+		out->bit++;
+	}
+
+	if (out->end - out->dst < n)
+		return -1;
+	memcpy(out->dst, code, n);
+	out->dst += n;
+	return 0;
+}
+
+static int lzss_put_match(struct lzss_out *out, int pos, int dist, int len)
+{
+	/* Ring slot of the source as the decoder numbers it. */
+	int i = (N - F + pos - dist) & (N - 1);
+	uint8_t code[2];
+
+	code[0] = (uint8_t) i;
+	code[1] = (uint8_t) (((i >> 4) & 0xF0) | (len - (THRESHOLD + 1)));
+	return lzss_put(out, 0, code, 2);
+}
+
+static const struct lzss_level *lzss_get_level(int level)
+{
+	if (level < LZSS_LEVEL_FAST)
+		level = LZSS_LEVEL_FAST;
+	if (level > LZSS_LEVEL_BEST)
+		level = LZSS_LEVEL_BEST;
+	return &lzss_levels[level - LZSS_LEVEL_FAST];
+}
+
+/*
+ * Encode src[begin..end). Matches may reach back up to WINDOW bytes before
+ * begin, which the decoder will already have written, but never past end.
+ */
+static int lzss_encode(struct lzss_out *out, const struct lzss_level *lv,
+		       const uint8_t * src, uint32_t begin, uint32_t end)
+{
+	struct hash_state *hs;
+	int pos, len, dist, next_len, next_dist, i;
+
+	hs = (struct hash_state *)malloc(sizeof(*hs));
+	if (!hs)
+		return -1;
+	for (i = 0; i < HASH_SIZE; i++)
+		hs->head[i] = -1;
+	hs->inserted = begin > N ? begin - N : 0;
+
+	for (pos = begin; (uint32_t) pos < end;) {
+		lzss_insert(hs, src, end, pos);
+		len = lzss_longest(hs, src, end, pos, lv->chain, &dist);
+
+		/* Emit a literal instead if the next byte starts a longer match. */
+		while (lv->lazy && len && len < F) {
+			lzss_insert(hs, src, end, pos + 1);
+			next_len = lzss_longest(hs, src, end, pos + 1, lv->chain,
+						&next_dist);
+			if (next_len <= len)
+				break;
+			if (lzss_put(out, 1, &src[pos], 1))
+				goto overflow;
+			pos++;
+			len = next_len;
+			dist = next_dist;
+		}
+
+		if (!len) {
+			if (lzss_put(out, 1, &src[pos], 1))
+				goto overflow;
+			pos++;
+			continue;
+		}
+
+		if (lzss_put_match(out, pos, dist, len))
+			goto overflow;
+		if (!lv->insert_all)
+			hs->inserted = pos + len;
+		pos += len;
+	}
+
+	free(hs);
+	return 0;
+
+ overflow:
+	free(hs);
+	return -1;
+}
+
+/*
+ * Compress srclen bytes of src into dst at the given level. Returns the end
+ * of the output, or NULL if it does not fit in dstlen bytes; a dstlen of
+ * compress_lzss_bound(srclen) always fits.
+ */
+uint8_t *compress_lzss_level(uint8_t * dst, uint32_t dstlen, uint8_t * src,
+			     uint32_t srclen, int level)
+{
+	struct lzss_out out;
+
+	memset(&out, 0, sizeof(out));
+	out.dst = dst;
+	out.end = dst + dstlen;
+	out.bit = 8;
+
+	if (lzss_encode(&out, lzss_get_level(level), src, 0, srclen))
+		return (void *)0;
+	return out.dst;
+}
+
+/*
+ * Segmented encoder.
+ *
+ * The window is only N bytes, so segments of the input can be encoded
+ * independently once each one's match finder is seeded with the N bytes
+ * before it. Workers encode segments into codes and flag bits, then,
+ * knowing how many tokens and code bytes precede each segment, lay their
+ * tokens out in the final stream in place. A group that straddles two
+ * segments takes its flag bits from both.
+ */
+
+#define SEGMENT_MIN	(1 << 20)	/* smaller pieces are not worth a thread */
+#define MAX_THREADS	16
+
+struct lzss_segment {
+	uint32_t begin, end;
+	uint8_t *codes;
+	uint8_t *bits;
+	uint32_t ncodes;
+	uint32_t ntokens;
+	uint32_t token_base;	/* tokens in all earlier segments */
+	uint32_t code_base;	/* code bytes in all earlier segments */
+	int failed;
+};
+
+struct lzss_pool {
+	const struct lzss_level *lv;
+	uint8_t *src;
+	uint8_t *dst;
+	struct lzss_segment *segs;
+	int nsegs;
+	int next;
+	void (*work) (struct lzss_pool *, struct lzss_segment *);
+};
+
+static void lzss_segment_encode(struct lzss_pool *pool, struct lzss_segment *seg)
+{
+	uint32_t len = seg->end - seg->begin;
+	struct lzss_out out;
+
+	seg->codes = malloc(len);
+	seg->bits = calloc(len / 8 + 1, 1);
+	if (!seg->codes || !seg->bits) {
+		seg->failed = 1;
+		return;
+	}
+
+	memset(&out, 0, sizeof(out));
+	out.dst = seg->codes;
+	out.end = seg->codes + len;
+	out.bits = seg->bits;
+
+	/* Codes never outgrow the bytes they stand for. */
+	seg->failed = lzss_encode(&out, pool->lv, pool->src, seg->begin, seg->end);
+	seg->ncodes = out.dst - seg->codes;
+	seg->ntokens = out.ntokens;
+}
+
+static int lzss_token_bit(const struct lzss_segment *seg, uint32_t token)
+{
+	token -= seg->token_base;
+	return (seg->bits[token >> 3] >> (token & 7)) & 1;
+}
+
+static void lzss_segment_place(struct lzss_pool *pool, struct lzss_segment *seg)
+{
+	uint8_t *out = pool->dst + seg->code_base + (seg->token_base + 7) / 8;
+	const uint8_t *code = seg->codes;
+	uint32_t t, k;
+	int s, literal;
+
+	for (t = seg->token_base; t < seg->token_base + seg->ntokens; t++) {
+		if (!(t & 7)) {
+			/* This segment owns the groups that start in it. */
+			*out = 0;
+			for (k = 0, s = seg - pool->segs; k < 8 && s < pool->nsegs; k++) {
+				while (s < pool->nsegs && t + k >= pool->segs[s].token_base + pool->segs[s].ntokens)
+					s++;
+				if (s < pool->nsegs)
+					*out |= lzss_token_bit(&pool->segs[s], t + k) << k;
+			}
+			out++;
+		}
+
+		literal = lzss_token_bit(seg, t);
+		*out++ = *code++;
+		if (!literal)
+			*out++ = *code++;
+	}
+}
+
+static void *lzss_pool_worker(void *arg)
+{
+	struct lzss_pool *pool = arg;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->nsegs)
+		pool->work(pool, &pool->segs[i]);
+	return NULL;
+}
+
+static void lzss_pool_run(struct lzss_pool *pool, int nthreads,
+			  void (*work) (struct lzss_pool *, struct lzss_segment *))
+{
+	pthread_t threads[MAX_THREADS];
+	int i, started = 0;
+
+	pool->work = work;
+	pool->next = 0;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, lzss_pool_worker, pool))
+			break;
+		started++;
+	}
+
+	lzss_pool_worker(pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * compress_lzss_level() split across threads, one segment each; threads
+ * of 0 or less uses every online processor. The stream is the same format
+ * and fits in compress_lzss_bound(srclen), but is not identical to the
+ * single threaded one since matches do not cross segment boundaries.
+ */
+uint8_t *compress_lzss_parallel(uint8_t * dst, uint32_t dstlen, uint8_t * src,
+				uint32_t srclen, int level, int threads)
+{
+	struct lzss_pool pool;
+	uint32_t tokens = 0, codes = 0, seglen;
+	uint8_t *end = (void *)0;
+	int i;
+
+	if (threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+		threads = 1;
+#endif
+	}
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	if (threads > (int)(srclen / SEGMENT_MIN))
+		threads = srclen / SEGMENT_MIN;
+	if (threads <= 1)
+		return compress_lzss_level(dst, dstlen, src, srclen, level);
+
+	memset(&pool, 0, sizeof(pool));
+	pool.lv = lzss_get_level(level);
+	pool.src = src;
+	pool.dst = dst;
+	pool.nsegs = threads;
+	pool.segs = calloc(threads, sizeof(struct lzss_segment));
+	if (!pool.segs)
+		return (void *)0;
+
+	seglen = srclen / threads;
+	for (i = 0; i < threads; i++) {
+		pool.segs[i].begin = i * seglen;
+		pool.segs[i].end = i == threads - 1 ? srclen : (i + 1) * seglen;
+	}
+
+	lzss_pool_run(&pool, threads, lzss_segment_encode);
+
+	for (i = 0; i < pool.nsegs; i++) {
+		if (pool.segs[i].failed)
+			goto out;
+		pool.segs[i].token_base = tokens;
+		pool.segs[i].code_base = codes;
+		tokens += pool.segs[i].ntokens;
+		codes += pool.segs[i].ncodes;
+	}
+	if ((uint64_t) codes + (tokens + 7) / 8 > dstlen)
+		goto out;
+
+	lzss_pool_run(&pool, threads, lzss_segment_place);
+	end = dst + codes + (tokens + 7) / 8;
+
+ out:
+	for (i = 0; i < pool.nsegs; i++) {
+		free(pool.segs[i].codes);
+		free(pool.segs[i].bits);
+	}
+	free(pool.segs);
+	return end;
+}
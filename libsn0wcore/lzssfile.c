@@ -88,20 +88,34 @@ off_t getLengthComp(AbstractFile * file)
 void closeComp(AbstractFile * file)
 {
 	InfoComp *info = (InfoComp *) (file->data);
-	uint8_t *compressed;
+	uint8_t *compressed, *end;
+	uint32_t bound;
 	if (info->dirty) {
 		info->header.checksum =
 		    lzadler32((uint8_t *) info->buffer,
 			      info->header.length_uncompressed);
 
-		compressed = malloc(info->header.length_uncompressed * 2);
-		info->header.length_compressed =
-		    (uint32_t) (compress_lzss
-				(compressed,
-				 info->header.length_uncompressed * 2,
-				 info->buffer,
-				 info->header.length_uncompressed) -
-				compressed);
+		bound = compress_lzss_bound(info->header.length_uncompressed);
+		compressed = malloc(bound);
+		end = compressed ? compress_lzss_parallel(compressed, bound,
+							  info->buffer,
+							  info->header.
+							  length_uncompressed,
+							  LZSS_LEVEL_DEFAULT,
+							  0) : NULL;
+		/* The segmented encoder needs memory of its own, retry without it. */
+		if (compressed && !end)
+			end = compress_lzss_level(compressed, bound,
+						  info->buffer,
+						  info->header.
+						  length_uncompressed,
+						  LZSS_LEVEL_DEFAULT);
+		if (!end) {
+			printf("closeComp: cannot compress, file left unchanged\n");
+			free(compressed);
+			goto out;
+		}
+		info->header.length_compressed = (uint32_t) (end - compressed);
 
 		info->file->seek(info->file, sizeof(info->header));
 		info->file->write(info->file, compressed,
@@ -115,6 +129,7 @@ void closeComp(AbstractFile * file)
 				  sizeof(info->header));
 	}
 
+ out:
 	free(info->buffer);
 	info->file->close(info->file);
 	free(info);
@@ -151,9 +166,12 @@ AbstractFile *createAbstractFileFromComp(AbstractFile * file)
 	compressed = malloc(info->header.length_compressed);
 	file->read(file, compressed, info->header.length_compressed);
 
-	real_uncompressed = decompress_lzss(info->buffer, compressed,
-						     info->header.
-						     length_compressed);
+	real_uncompressed = decompress_lzss_adler(info->buffer,
+						  info->header.
+						  length_uncompressed,
+						  compressed,
+						  info->header.
+						  length_compressed, NULL);
 	real_uncompressed = info->header.length_uncompressed;
 	if (real_uncompressed != info->header.length_uncompressed) {
 		ERR("mismatch: %d %d %d %x %x\n",
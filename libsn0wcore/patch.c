@@ -104,27 +104,222 @@ patch_list_t* patch_list_create(void) {
     return out;
 }
 
+/*
+ * Multi-pattern matcher.
+ *
+ * A patch list is compiled into an Aho-Corasick automaton (a full DFA over
+ * bytes) so every patch site in an image is found in one linear pass, no
+ * matter how many patches are registered.
+ */
+struct _patch_matcher {
+    int nstates;
+    int npatches;
+    int *delta;                 /* nstates * 256 transition table */
+    int *output;                /* patch completed at a state, or -1 */
+    int *dict_link;             /* next suffix state completing a patch, or -1 */
+    patch_node_t **patches;
+    int *hits;                  /* per-patch hit counts of the last pass */
+};
+
+void patch_matcher_free(patch_matcher_t *m) {
+    if(!m)
+        return;
+
+    free(m->delta);
+    free(m->output);
+    free(m->dict_link);
+    free(m->patches);
+    free(m->hits);
+    free(m);
+}
+
+patch_matcher_t* patch_matcher_compile(patch_list_t *l) {
+    patch_matcher_t *m;
+    patch_node_t *n;
+    int *fail, *queue;
+    int i, c, s, r, head, tail, max_states = 1;
+
+    if(!l)
+        return NULL;
+
+    LIST_FOREACH(n, l->head) {
+        if(n->size > 0)
+            max_states += n->size;
+    }
+
+    m = malloc(sizeof(patch_matcher_t));
+    if(!m)
+        return NULL;
+
+    memset(m, 0, sizeof(patch_matcher_t));
+    m->npatches = l->count;
+    m->delta = malloc(max_states * 256 * sizeof(int));
+    m->output = malloc(max_states * sizeof(int));
+    m->dict_link = malloc(max_states * sizeof(int));
+    m->patches = malloc((m->npatches + 1) * sizeof(patch_node_t*));
+    m->hits = malloc((m->npatches + 1) * sizeof(int));
+    fail = malloc(max_states * sizeof(int));
+    queue = malloc(max_states * sizeof(int));
+
+    if(!m->delta || !m->output || !m->dict_link || !m->patches || !m->hits || !fail || !queue) {
+        patch_matcher_free(m);
+        free(fail);
+        free(queue);
+        return NULL;
+    }
+
+    memset(m->delta, 0xff, max_states * 256 * sizeof(int));
+    memset(m->hits, 0, (m->npatches + 1) * sizeof(int));
+    for(s = 0; s < max_states; s++)
+        m->output[s] = m->dict_link[s] = -1;
+    m->nstates = 1;
+
+    /* Build the trie of original byte patterns. */
+    i = 0;
+    LIST_FOREACH(n, l->head) {
+        m->patches[i] = n;
+        if(n->size <= 0) {
+            i++;
+            continue;
+        }
+
+        s = 0;
+        for(c = 0; c < n->size; c++) {
+            int *next = &m->delta[s * 256 + n->original_bytes[c]];
+            if(*next < 0)
+                *next = m->nstates++;
+            s = *next;
+        }
+
+        if(m->output[s] < 0)
+            m->output[s] = i;
+        else
+            printf("Patch \"%s\" has the same pattern as \"%s\" and will never apply\n", n->name, m->patches[m->output[s]]->name);
+        i++;
+    }
+
+    /*
+     * Breadth-first pass: compute failure links and fill in the missing
+     * transitions, turning the trie into a DFA.
+     */
+    head = tail = 0;
+    for(c = 0; c < 256; c++) {
+        s = m->delta[c];
+        if(s < 0) {
+            m->delta[c] = 0;
+        } else {
+            fail[s] = 0;
+            queue[tail++] = s;
+        }
+    }
+
+    while(head < tail) {
+        r = queue[head++];
+        m->dict_link[r] = (m->output[fail[r]] >= 0) ? fail[r] : m->dict_link[fail[r]];
+        for(c = 0; c < 256; c++) {
+            s = m->delta[r * 256 + c];
+            if(s < 0) {
+                m->delta[r * 256 + c] = m->delta[fail[r] * 256 + c];
+            } else {
+                fail[s] = m->delta[fail[r] * 256 + c];
+                queue[tail++] = s;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    DPRINT("Compiled %d patches into %d matcher states\n", m->npatches, m->nstates);
+
+    return m;
+}
+
+/*
+ * Apply every patch in one pass over p. Matching always runs on the
+ * original bytes since a site is only rewritten once it has been consumed.
+ * Where sites overlap, the one ending first wins; sites ending at the same
+ * byte go to the patch registered first that does not overlap an earlier
+ * site, as with the old per-patch scans.
+ */
+int patch_matcher_replace(patch_matcher_t *m, unsigned char *p, int len) {
+    patch_node_t *n;
+    int i, k, best, start, s = 0, applied = 0, patched_until = 0;
+
+    if(!m)
+        return 0;
+    if(!p)
+        return 0;
+
+    memset(m->hits, 0, (m->npatches + 1) * sizeof(int));
+
+    for(i = 0; i < len; i++) {
+        s = m->delta[s * 256 + p[i]];
+
+        /* Patches overlapping the last site are out, even if registered first. */
+        best = -1;
+        for(k = (m->output[s] >= 0) ? s : m->dict_link[s]; k >= 0; k = m->dict_link[k]) {
+            if(i - m->patches[m->output[k]]->size + 1 < patched_until)
+                continue;
+            if(best < 0 || m->output[k] < best)
+                best = m->output[k];
+        }
+        if(best < 0)
+            continue;
+
+        n = m->patches[best];
+        start = i - n->size + 1;
+
+        DPRINT("Patching %s check at 0x%08x\n", n->name, start);
+        memcpy(&p[start], n->patch_bytes, n->size);
+        patched_until = i + 1;
+        m->hits[best]++;
+        applied++;
+    }
+
+    return applied;
+}
+
+int patch_matcher_hits(patch_matcher_t *m, int index) {
+    if(!m)
+        return 0;
+    if(index < 0 || index >= m->npatches)
+        return 0;
+
+    return m->hits[index];
+}
+
+/*
+ * Report the last pass. Each matcher holds the patches of one image type,
+ * so a patch that did not match is worth a warning; hit counts are debug
+ * output.
+ */
+void patch_matcher_report(patch_matcher_t *m) {
+    int i;
+
+    if(!m)
+        return;
+
+    for(i = 0; i < m->npatches; i++) {
+        if(m->hits[i])
+            DPRINT("Patch \"%s\" applied %d time(s)\n", m->patches[i]->name, m->hits[i]);
+        else
+            WARN("Patch \"%s\" did not match\n", m->patches[i]->name);
+    }
+}
+
 void patch_replace(patch_list_t *l, unsigned char *p, int len) {
-    patch_node_t *n, *tn;
+    patch_matcher_t *m;
 
     if(!l)
         return;
     if(!p)
         return;
 
-    LIST_FOREACH_SAFE(n, tn, l->head) {
-        int i;
-        for(i = 0; i < len; i++) {
-            unsigned char *c = &p[i];
-            /*if(arch == n->architecture || n->architecture == 0)*/ {
-                /*if(global_version == n->version || n->version == 0)*/ {
-                    if(!memcmp(c, n->original_bytes, n->size)) {
-                        DPRINT("Patching %s check at 0x%08x\n", n->name, i);
-                        memcpy(c, n->patch_bytes, n->size);
-                        continue;
-                    }
-                }
-            }
-        }
-    }
+    m = patch_matcher_compile(l);
+    if(!m)
+        return;
+
+    patch_matcher_replace(m, p, len);
+    patch_matcher_free(m);
 }
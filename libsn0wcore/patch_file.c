@@ -40,7 +40,6 @@ Dictionary *get_key_dictionary_from_bundle(char *member)
  * 
  * \param filename Filename to decrypt and patch.
  */
- void patch_image_load(char*p, int l);
 int patch_file(char *filename)
 {
 	AbstractFile *template = NULL, *inFile, *certificate =
@@ -54,6 +53,7 @@ int patch_file(char *filename)
 	char *buf;
 	char *dup;
 	char *tokenizedname;
+	int nuked;
 	StringValue *keyValue;
 	StringValue *ivValue;
 
@@ -161,10 +161,24 @@ int patch_file(char *filename)
 	if (strcasestr(filename, "iBEC") || 
 	    strcasestr(filename, "iBSS") ||
 	    strcasestr(filename, "iBoot")) {
-	        patch_replace(iboot_patches, (unsigned char*)inData, inDataSize - 128);
-		//patch_image_load(inData, inDataSize);
+		patch_matcher_replace(iboot_patch_matcher, (unsigned char*)inData, inDataSize - 128);
+		patch_matcher_report(iboot_patch_matcher);
+		nuked = patch_image_load((unsigned char*)inData, inDataSize - 128);
+		if (nuked < 0)
+			WARN("cannot locate image_load() in %s, its checks are not patched\n", filename);
+		else if (!nuked)
+			WARN("no image_load() subroutines patched in %s\n", filename);
+	} else if (strcasestr(filename, "DeviceTree")) {
+		devicetree_t *dt = devicetree_parse((unsigned char*)inData, inDataSize);
+		if (dt) {
+			devicetree_patch_apply(dt);
+			devicetree_free(dt);
+		} else {
+			DPRINT("Cannot parse %s as a DeviceTree\n", filename);
+		}
 	} else if (strcasestr(filename, "kernelcache")) {
-       	 	patch_replace(kernel_patches, (unsigned char*)inData, inDataSize - 128);
+		patch_matcher_replace(kernel_patch_matcher, (unsigned char*)inData, inDataSize - 128);
+		patch_matcher_report(kernel_patch_matcher);
 	}
     
 	/* write patched contents */
@@ -0,0 +1,332 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Batch driver shared by the patcher tools.
+ *
+ *   tool -b [-j jobs] <manifest|directory> <outdir>
+ *
+ * A manifest lists one input per line, optionally followed by the output
+ * path; '#' starts a comment. A directory stands for every regular file
+ * in it. Outputs default to <outdir>/<basename of input>.
+ *
+ * Every image is patched in a child process of its own, at most <jobs> at
+ * a time (one per online CPU by default), so a crash or exit() in one
+ * image cannot take the batch down. A child's output goes to
+ * <output>.log. The parent reports each image as it completes and prints
+ * a summary at the end.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include "util.h"
+#include "batch.h"
+
+/* Statuses past the job results: the child died, or never started. */
+#define BATCH_CRASHED		(BATCH_JOB_WRITE_FAILED + 1)
+#define BATCH_FORK_FAILED	(BATCH_JOB_WRITE_FAILED + 2)
+#define BATCH_STATUSES		(BATCH_JOB_WRITE_FAILED + 3)
+
+static const char *batch_status_names[BATCH_STATUSES] = { "ok", "load", "patch", "write", "crash", "fork" };
+
+struct batch_item {
+	char *in;
+	char *out;
+	pid_t pid;
+	int status;
+	struct timeval begin;
+	double elapsed_ms;
+};
+
+struct batch {
+	struct batch_item *items;
+	int count;
+	int capacity;
+};
+
+static double
+batch_elapsed_ms (struct timeval *begin)
+{
+	struct timeval end;
+
+	gettimeofday (&end, NULL);
+	return (end.tv_sec - begin->tv_sec) * 1000.0 + (end.tv_usec - begin->tv_usec) / 1000.0;
+}
+
+static void
+batch_add (struct batch *batch, const char *in, const char *out, const char *outdir)
+{
+	struct batch_item *item;
+	const char *base;
+
+	if (batch->count == batch->capacity) {
+		batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+		batch->items = realloc (batch->items, batch->capacity * sizeof (struct batch_item));
+		if (!batch->items)
+			err (-1, "cannot allocate chunk");
+	}
+
+	item = &batch->items[batch->count++];
+	bzero (item, sizeof (*item));
+	item->in = strdup (in);
+	if (out) {
+		item->out = strdup (out);
+	}
+	else {
+		base = strrchr (in, '/');
+		base = base ? base + 1 : in;
+		item->out = _xmalloc (strlen (outdir) + 1 + strlen (base) + 1);
+		sprintf (item->out, "%s/%s", outdir, base);
+	}
+}
+
+static int
+batch_read_manifest (struct batch *batch, const char *manifest, const char *outdir)
+{
+	char line[2048], in[1024], out[1024];
+	FILE *fp = fopen (manifest, "r");
+	char *comment;
+
+	if (!fp)
+		return -ENOENT;
+
+	while (fgets (line, sizeof (line), fp)) {
+		if ((comment = strchr (line, '#')) != NULL)
+			*comment = '\0';
+		switch (sscanf (line, "%1023s %1023s", in, out)) {
+		case 1:
+			batch_add (batch, in, NULL, outdir);
+			break;
+		case 2:
+			batch_add (batch, in, out, outdir);
+			break;
+		default:
+			break;
+		}
+	}
+
+	fclose (fp);
+	return 0;
+}
+
+static int
+batch_name_compare (const void *a, const void *b)
+{
+	return strcmp (((const struct batch_item *) a)->in, ((const struct batch_item *) b)->in);
+}
+
+static int
+batch_read_directory (struct batch *batch, const char *dir, const char *outdir)
+{
+	struct dirent *dirent;
+	struct stat st;
+	char *path;
+	DIR *dp = opendir (dir);
+
+	if (!dp)
+		return -ENOENT;
+
+	while ((dirent = readdir (dp)) != NULL) {
+		path = _xmalloc (strlen (dir) + 1 + strlen (dirent->d_name) + 1);
+		sprintf (path, "%s/%s", dir, dirent->d_name);
+		if (!stat (path, &st) && S_ISREG (st.st_mode))
+			batch_add (batch, path, NULL, outdir);
+		free (path);
+	}
+	closedir (dp);
+
+	/* Directory order is arbitrary, keep the report stable. */
+	qsort (batch->items, batch->count, sizeof (struct batch_item), batch_name_compare);
+	return 0;
+}
+
+static pid_t
+batch_spawn (struct batch_item *item, batch_job_t job)
+{
+	char *log;
+	pid_t pid;
+	int fd;
+
+	fflush (stdout);
+	fflush (stderr);
+
+	gettimeofday (&item->begin, NULL);
+	pid = fork ();
+	if (pid != 0)
+		return pid;
+
+	log = _xmalloc (strlen (item->out) + sizeof (".log"));
+	sprintf (log, "%s.log", item->out);
+	fd = open (log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		dup2 (fd, STDOUT_FILENO);
+		dup2 (fd, STDERR_FILENO);
+		close (fd);
+	}
+
+	_exit (job (item->in, item->out));
+}
+
+/*
+ * Exit status of a child as a batch status.
+ */
+static int
+batch_child_status (int status)
+{
+	if (!WIFEXITED (status) || WEXITSTATUS (status) >= BATCH_CRASHED)
+		return BATCH_CRASHED;
+	return WEXITSTATUS (status);
+}
+
+static void
+batch_report (struct batch *batch, int failed, double wall_ms)
+{
+	int counts[BATCH_STATUSES] = { 0 };
+	double total_ms = 0.0;
+	int i;
+
+	printf ("\n%-48s %-6s %12s\n", "image", "status", "time (ms)");
+	for (i = 0; i < batch->count; i++) {
+		struct batch_item *item = &batch->items[i];
+		printf ("%-48.48s %-6s %12.1f\n", item->in, batch_status_names[item->status], item->elapsed_ms);
+		total_ms += item->elapsed_ms;
+		counts[item->status]++;
+	}
+	if (failed) {
+		printf ("%-48s", "failed");
+		for (i = BATCH_JOB_OK + 1; i < BATCH_STATUSES; i++) {
+			if (counts[i])
+				printf (" %d %s", counts[i], batch_status_names[i]);
+		}
+		printf ("\n");
+	}
+	printf ("%d images, %d failed, %.1f ms of work in %.1f ms wall (%.2fx)\n", batch->count, failed, total_ms, wall_ms,
+			wall_ms > 0 ? total_ms / wall_ms : 0.0);
+}
+
+static void
+batch_usage (const char *tool)
+{
+	printf ("usage: %s -b [-j jobs] [manifest|directory] [outdir]\n", tool);
+}
+
+/*
+ * Entry point for "-b". argv[0] is the tool name, argv[1] is "-b".
+ */
+int
+batch_main (const char *tool, int argc, char *argv[], batch_job_t job)
+{
+	struct batch batch = { NULL, 0, 0 };
+	struct timeval begin;
+	struct stat st;
+	long jobs = sysconf (_SC_NPROCESSORS_ONLN);
+	int next = 0, running = 0, failed = 0, i, status;
+	pid_t pid;
+
+	argc -= 2;
+	argv += 2;
+	if (argc >= 2 && !strcmp (argv[0], "-j")) {
+		jobs = atoi (argv[1]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc != 2 || jobs <= 0) {
+		batch_usage (tool);
+		return -1;
+	}
+
+	if (stat (argv[0], &st)) {
+		warn ("%s", argv[0]);
+		return -1;
+	}
+	if (S_ISDIR (st.st_mode) ? batch_read_directory (&batch, argv[0], argv[1]) : batch_read_manifest (&batch, argv[0], argv[1])) {
+		warnx ("cannot read inputs from %s", argv[0]);
+		return -1;
+	}
+	mkdir (argv[1], 0755);
+
+	printf ("%s: %d images, %ld jobs\n", tool, batch.count, jobs);
+	gettimeofday (&begin, NULL);
+
+	while (next < batch.count || running) {
+		while (running < jobs && next < batch.count) {
+			batch.items[next].pid = batch_spawn (&batch.items[next], job);
+			if (batch.items[next].pid < 0) {
+				warn ("fork");
+				batch.items[next].status = BATCH_FORK_FAILED;
+				failed++;
+			}
+			else {
+				running++;
+			}
+			next++;
+		}
+		if (!running)
+			break;
+
+		pid = wait (&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < next; i++) {
+			struct batch_item *item = &batch.items[i];
+			if (item->pid != pid)
+				continue;
+			item->pid = 0;
+			item->elapsed_ms = batch_elapsed_ms (&item->begin);
+			item->status = batch_child_status (status);
+			failed += item->status != BATCH_JOB_OK;
+			if (item->status)
+				printf ("[FAIL] %s -> %s (%.1f ms, %s, see %s.log)\n", item->in, item->out, item->elapsed_ms,
+						batch_status_names[item->status], item->out);
+			else
+				printf ("[ ok ] %s -> %s (%.1f ms)\n", item->in, item->out, item->elapsed_ms);
+			running--;
+			break;
+		}
+	}
+
+	batch_report (&batch, failed, batch_elapsed_ms (&begin));
+
+	for (i = 0; i < batch.count; i++) {
+		free (batch.items[i].in);
+		free (batch.items[i].out);
+	}
+	free (batch.items);
+
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,244 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Function boundary table for Thumb-2 images.
+ *
+ * One forward decode over the code ranges collects function starts from
+ * PUSH {..., LR} prologues and BL targets. Targets of PC-relative literal
+ * loads mark literal pool words; candidates landing in a pool are data
+ * that happened to decode as a prologue and are dropped. The starts are
+ * sorted once, so finding the function around an offset is a binary
+ * search instead of a backwards walk.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "util.h"
+#include "functab.h"
+
+#define BITMAP_TEST(map, bit)	(((map)[(bit) >> 5] >> ((bit) & 31)) & 1)
+#define BITMAP_SET(map, bit)	((map)[(bit) >> 5] |= 1U << ((bit) & 31))
+
+struct function_candidates {
+	uint32_t *offsets;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+static void
+function_candidates_add (struct function_candidates *c, uint32_t offset)
+{
+	if (c->count == c->capacity) {
+		c->capacity = c->capacity ? c->capacity * 2 : 4096;
+		c->offsets = (uint32_t *) realloc (c->offsets, c->capacity * sizeof (uint32_t));
+		if (!c->offsets)
+			err (-1, "cannot allocate chunk");
+	}
+	c->offsets[c->count++] = offset;
+}
+
+static int
+function_offset_compare (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int
+thumb_is_32bit (uint16_t insn)
+{
+	return (insn & 0xe000) == 0xe000 && (insn & 0x1800) != 0x0;
+}
+
+static int
+thumb_is_prologue (uint16_t first, uint16_t second)
+{
+	/* PUSH {..., LR} */
+	if ((first & 0xFF00) == 0xB500)
+		return 1;
+	/* STMDB SP!, {..., LR} */
+	if (first == 0xE92D && (second & 0x4000))
+		return 1;
+	return 0;
+}
+
+static int32_t
+thumb_bl_imm32 (uint16_t first, uint16_t second)
+{
+	uint32_t s = (first >> 10) & 1;
+	uint32_t i1 = ~(((second >> 13) & 1) ^ s) & 1;
+	uint32_t i2 = ~(((second >> 11) & 1) ^ s) & 1;
+	uint32_t imm = (s << 24) | (i1 << 23) | (i2 << 22) | ((first & 0x3FF) << 12) | ((second & 0x7FF) << 1);
+
+	return (int32_t) (imm << 7) >> 7;
+}
+
+static int
+function_table_in_ranges (const struct code_range *ranges, int nranges, uint32_t offset)
+{
+	int r;
+
+	for (r = 0; r < nranges; r++) {
+		if (offset >= ranges[r].offset && offset - ranges[r].offset < ranges[r].size)
+			return r;
+	}
+	return -1;
+}
+
+int
+function_table_build (struct function_table *table, uint8_t * image, size_t size, const struct code_range *ranges, int nranges)
+{
+	struct function_candidates found = { NULL, 0, 0 };
+	uint32_t *literals;
+	uint32_t i, n;
+	int r;
+
+	bzero (table, sizeof (*table));
+	if (!image || !size || !ranges || nranges <= 0)
+		return -EINVAL;
+
+	table->ranges = (struct code_range *) _xmalloc (nranges * sizeof (struct code_range));
+	for (r = 0; r < nranges; r++) {
+		if (ranges[r].offset >= size)
+			continue;
+		table->ranges[table->nranges] = ranges[r];
+		if (ranges[r].size > size - ranges[r].offset)
+			table->ranges[table->nranges].size = size - ranges[r].offset;
+		table->nranges++;
+	}
+
+	/* One bit per 32-bit word, set for every literal load target. */
+	literals = (uint32_t *) _xmalloc (((size / 4 + 31) / 32) * sizeof (uint32_t));
+
+	for (r = 0; r < table->nranges; r++) {
+		uint32_t offset = (table->ranges[r].offset + 1) & ~1;
+		uint32_t end = table->ranges[r].offset + table->ranges[r].size;
+
+		while (offset + 2 <= end) {
+			uint16_t first = *(uint16_t *) (image + offset);
+			uint16_t second = offset + 4 <= end ? *(uint16_t *) (image + offset + 2) : 0;
+			uint32_t target = 0;
+			int have_literal = 0;
+
+			if (thumb_is_prologue (first, second))
+				function_candidates_add (&found, offset);
+
+			if (!thumb_is_32bit (first)) {
+				/* LDR Rt, [PC, #imm8] */
+				if ((first & 0xF800) == 0x4800) {
+					target = ((offset + 4) & ~3) + ((first & 0xFF) << 2);
+					have_literal = 1;
+				}
+				offset += 2;
+			}
+			else {
+				/* BL, not BLX, stays in Thumb. */
+				if ((first & 0xF800) == 0xF000 && (second & 0xD000) == 0xD000)
+					function_candidates_add (&found, offset + 4 + thumb_bl_imm32 (first, second));
+				/* LDR.W Rt, [PC, #+/-imm12] */
+				else if ((first & 0xFF7F) == 0xF85F) {
+					target = (offset + 4) & ~3;
+					target = (first & 0x80) ? target + (second & 0xFFF) : target - (second & 0xFFF);
+					have_literal = 1;
+				}
+				offset += 4;
+			}
+
+			if (have_literal && size >= 4 && target <= size - 4)
+				BITMAP_SET (literals, target / 4);
+		}
+	}
+
+	qsort (found.offsets, found.count, sizeof (uint32_t), function_offset_compare);
+
+	/* Drop duplicates, starts outside the code, and starts inside literal pools. */
+	table->starts = (uint32_t *) _xmalloc ((found.count ? found.count : 1) * sizeof (uint32_t));
+	for (i = 0, n = 0; i < found.count; i++) {
+		uint32_t offset = found.offsets[i];
+
+		if (n && table->starts[n - 1] == offset)
+			continue;
+		if (offset & 1 || function_table_in_ranges (table->ranges, table->nranges, offset) < 0)
+			continue;
+		if (BITMAP_TEST (literals, offset / 4))
+			continue;
+		table->starts[n++] = offset;
+	}
+	table->count = n;
+
+	free (found.offsets);
+	free (literals);
+
+	return 0;
+}
+
+/*
+ * Find the function whose interval holds offset. The interval ends at the
+ * next function start or at the end of the code range, whichever is first.
+ */
+int
+function_containing (const struct function_table *table, uint32_t offset, uint32_t * start, uint32_t * end)
+{
+	uint32_t lo = 0, hi = table->count;
+	int r;
+
+	if (!table->starts || (r = function_table_in_ranges (table->ranges, table->nranges, offset)) < 0)
+		return -ENOENT;
+
+	/* Last start <= offset. */
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (table->starts[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || table->starts[lo - 1] < table->ranges[r].offset)
+		return -ENOENT;
+
+	if (start)
+		*start = table->starts[lo - 1];
+	if (end) {
+		*end = table->ranges[r].offset + table->ranges[r].size;
+		if (lo < table->count && table->starts[lo] < *end)
+			*end = table->starts[lo];
+	}
+
+	return 0;
+}
+
+void
+function_table_free (struct function_table *table)
+{
+	free (table->starts);
+	free (table->ranges);
+	bzero (table, sizeof (*table));
+}
@@ -38,17 +38,36 @@
 #include "structs.h"
 #include "patch.h"
 #include "util.h"
+#include "batch.h"
+
+static int
+iboot_patcher_job (const char *in, const char *out)
+{
+	iboot_ctx_t *ctx;
+	int ret;
+
+	if (ibootsup_map_file (&ctx, in))
+		return BATCH_JOB_LOAD_FAILED;
+	if (ibootsup_dynapatch (ctx))
+		ret = BATCH_JOB_PATCH_FAILED;
+	else
+		ret = ibootsup_write_file (ctx, out) ? BATCH_JOB_WRITE_FAILED : BATCH_JOB_OK;
+	ibootsup_close (ctx);
+	return ret;
+}
 
 int
 main (int argc, char *argv[])
 {
+	if (argc >= 2 && !strcmp (argv[1], "-b"))
+		return batch_main (argv[0], argc, argv, iboot_patcher_job);
+
 	if(argc != 3) {
 		printf("usage: %s [in] [out] (input must be unencrypted image3)\n", argv[0]);
+		printf("       %s -b [-j jobs] [manifest|directory] [outdir]\n", argv[0]);
 		return -1;
 	}
 
-	assert (ibootsup_map_file (argv[1]) == 0);
-	assert (ibootsup_dynapatch () == 0);
-	assert (ibootsup_write_file (argv[2]) == 0);
+	assert (iboot_patcher_job (argv[1], argv[2]) == 0);
 	return 0;
 }
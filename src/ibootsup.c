@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -34,9 +35,17 @@
 #include <err.h>
 
 #include <assert.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "structs.h"
 #include "patch.h"
 #include "util.h"
+#include "functab.h"
+#include "plancache.h"
+#include "imagefile.h"
+#include "patchseed.h"
+#include "ibootsup.h"
 
 #define IBOOT_DEFAULT_BOOTARGS	"rd=md0 nand-enable-reformat=1 -progress"
 #define IBOOT_DEFAULT_PWNARGS	"-v amfi=0xff cs_enforcement_disable=1  "
@@ -68,6 +77,10 @@ C_ASSERT (sizeof (IBOOT_DEFAULT_PWNARGS) == sizeof (IBOOT_DEFAULT_BOOTARGS));
 #define OPCODE_LENGTH			4
 #define IBOOT_IMAGE_VERSION		0x280
 
+/* Patch plan cache tags, bump them whenever the matching patcher changes. */
+#define IBOOT_IOS_LEGACY_PLAN_TAG	"iboot-legacy-1"
+#define IBOOT_IOS7_PLAN_TAG			"iboot-ios7-1"
+
 static struct iboot_interval intervals[] = {
 	{320, 590, 2},
 	{594, 817, 3},
@@ -82,21 +95,65 @@ static uint32_t ibootsup_image3_tags[9] = { 'SDOM', 'PROD', 'CHIP', 'TYPE', 'SEP
 	'OVRD'
 };
 
-static struct mapped_image current_image;
+/*
+ * LDR literal index. One forward pass over every halfword of the image
+ * decodes each PC-relative LDR and records the literal it loads, hashed by
+ * target. Chains are kept in instruction order, so the LDR nearest in
+ * front of a literal is the last matching entry before it. Built on the
+ * first lookup.
+ */
+#define LDR_LITERAL_NONE	0xFFFFFFFF
+
+enum {
+	LDR_LITERAL_NARROW,			/* LDR Rt, [PC, #imm8] */
+	LDR_LITERAL_WIDE,			/* LDR.W Rt, [PC, #+imm12] */
+	LDR_LITERAL_WIDE_SUB		/* LDR.W Rt, [PC, #-imm12] */
+};
+
+struct ldr_literal {
+	uint32_t target;
+	uint32_t insn;
+	uint32_t next;
+	int kind;
+};
+
+struct ldr_literal_index {
+	struct ldr_literal *refs;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t *buckets;
+	uint32_t mask;
+};
+
+/*
+ * One iBoot image and everything derived from it. A buffer handed to
+ * ibootsup_map_buffer() stays the caller's and is patched in place.
+ */
+struct iboot_ctx {
+	struct image_file file;
+	struct mapped_image image;
+	struct function_table functions;
+	struct ldr_literal_index literals;
+	struct patch_plan plan;
+	uint8_t digest[20];
+	struct patch_seed *seed;
+};
 
 static void *pattern_search (void *addr, int len, int pattern, int mask, int step);
-static void *ldr_search_up (const void *start_addr, int len);
-static void *ldr32_search_up (const void *start_addr, int len);
 static void *bl_search_down (void *p, int l);
 static void *bl_search_up (void *p, int l);
 static void *resolve_bl32 (const void *bl);
-static void *locate_ldr (const void *startAddr);
-static boolean_t ibootsup_verify_arm_image (void);
-static int ibootsup_get_version (void);
-static int ibootsup_get_ios_version (void);
-static void ibootsup_patch_ios_old_iboot (void);
-static void ibootsup_patch_ios7_iboot (void);
-static void ibootsup_patch_iboot (void);
+static void *ibootsup_locate_ldr (struct iboot_ctx *ctx, uint32_t target);
+static int ibootsup_function_remaining (struct iboot_ctx *ctx, const void *p, int len);
+static void ibootsup_build_function_table (struct iboot_ctx *ctx);
+static void ibootsup_build_ldr_index (struct iboot_ctx *ctx);
+static void ibootsup_free_ldr_index (struct ldr_literal_index *index);
+static boolean_t ibootsup_verify_arm_image (struct iboot_ctx *ctx);
+static int ibootsup_get_version (struct iboot_ctx *ctx);
+static int ibootsup_get_ios_version (struct iboot_ctx *ctx);
+static int ibootsup_patch_ios_old_iboot (struct iboot_ctx *ctx);
+static int ibootsup_patch_ios7_iboot (struct iboot_ctx *ctx);
+static int ibootsup_patch_iboot (struct iboot_ctx *ctx);
 
 static void *
 pattern_search (void *addr, int len, int pattern, int mask, int step)
@@ -123,20 +180,6 @@ pattern_search (void *addr, int len, int pattern, int mask, int step)
 	return NULL;
 }
 
-static void *
-ldr_search_up (const void *start_addr, int len)
-{
-	// LDR pattern is xx xx 48 xx ( 00 00 f8 00 )
-	return pattern_search (start_addr, len, 0x00004800, 0x0000F800, -2);
-}
-
-static void *
-ldr32_search_up (const void *start_addr, int len)
-{
-	// LDR32 pattern is DF F8 xx xx
-	return pattern_search (start_addr, len, 0x0000F8DF, 0x0000FFFF, -2);
-}
-
 static void *
 bl_search_down (void *p, int l)
 {
@@ -194,60 +237,172 @@ resolve_bl32 (const void *bl)
 	return (void *) ((int) bl + 4 + jump);
 }
 
-static void *
-locate_ldr (const void *startAddr)
+static uint32_t
+ldr_literal_hash (const struct ldr_literal_index *index, uint32_t target)
 {
-	int xref_target = (int) startAddr;
-	int i = xref_target;
-	int min_addr = xref_target - 0x1000;
-	while (1) {
-		i = (int) ldr32_search_up ((void *) i, i - min_addr);
-		if (i == 0) {
-			break;
-		}
-		int dw = *(int *) i;
-		int ldr_target = ((i + 4) & ~3) + ((dw >> 16) & 0xfff);
-		if (ldr_target == xref_target) {
-			return (void *) i;
-		}
-		i -= 4;
+	return (target * 2654435761U) & index->mask;
+}
+
+static void
+ldr_literal_record (struct ldr_literal_index *index, uint32_t target, uint32_t insn, int kind)
+{
+	if (index->count == index->capacity) {
+		index->capacity = index->capacity ? index->capacity * 2 : 4096;
+		index->refs = (struct ldr_literal *) realloc (index->refs, index->capacity * sizeof (struct ldr_literal));
+		if (!index->refs)
+			err (-1, "cannot allocate chunk");
 	}
-	i = xref_target;
-	min_addr = xref_target - 0x420;
-	while (1) {
-		i = (int) ldr_search_up ((void *) i, i - min_addr);
-		if (i == 0) {
-			break;
+
+	index->refs[index->count].target = target;
+	index->refs[index->count].insn = insn;
+	index->refs[index->count].kind = kind;
+	index->refs[index->count].next = LDR_LITERAL_NONE;
+	index->count++;
+}
+
+static void
+ibootsup_free_ldr_index (struct ldr_literal_index *index)
+{
+	free (index->refs);
+	free (index->buckets);
+	bzero (index, sizeof (*index));
+}
+
+/*
+ * Every halfword is decoded, not just instruction starts, which is what
+ * the old backwards pattern search matched against as well.
+ */
+static void
+ibootsup_build_ldr_index (struct iboot_ctx *ctx)
+{
+	struct ldr_literal_index *index = &ctx->literals;
+	uint8_t *image = ctx->image.image;
+	uint32_t size = ctx->image.size;
+	uint32_t i, buckets = 1;
+
+	ibootsup_free_ldr_index (index);
+
+	for (i = 0; i + 2 <= size; i += 2) {
+		uint16_t first = *(uint16_t *) (image + i);
+		uint32_t base = (i + 4) & ~3;
+		uint32_t imm;
+
+		if ((first & 0xF800) == 0x4800) {
+			imm = (first & 0xFF) << 2;
+			if (base + imm < size)
+				ldr_literal_record (index, base + imm, i, LDR_LITERAL_NARROW);
 		}
-		int dw = *(int *) i;
-		int ldr_target = ((i + 4) & ~3) + ((dw & 0xff) << 2);
-		if (ldr_target == xref_target) {
-			return (void *) i;
+		else if ((first & 0xFF7F) == 0xF85F && i + 4 <= size) {
+			imm = *(uint16_t *) (image + i + 2) & 0xFFF;
+			if (first & 0x80) {
+				if (base + imm < size)
+					ldr_literal_record (index, base + imm, i, LDR_LITERAL_WIDE);
+			}
+			else if (imm <= base) {
+				ldr_literal_record (index, base - imm, i, LDR_LITERAL_WIDE_SUB);
+			}
 		}
-		i -= 2;
 	}
-	return 0;
+
+	while (buckets < index->count * 2)
+		buckets <<= 1;
+	index->buckets = (uint32_t *) _xmalloc (buckets * sizeof (uint32_t));
+	memset (index->buckets, 0xFF, buckets * sizeof (uint32_t));
+	index->mask = buckets - 1;
+
+	/*
+	 * Push in reverse so every chain comes out in instruction order.
+	 */
+	for (i = index->count; i-- > 0;) {
+		uint32_t h = ldr_literal_hash (index, index->refs[i].target);
+		index->refs[i].next = index->buckets[h];
+		index->buckets[h] = i;
+	}
+}
+
+/*
+ * The LDR loading the literal at target (relative to the image): the
+ * nearest LDR.W in front of it, else the nearest 16-bit LDR.
+ */
+static void *
+ibootsup_locate_ldr (struct iboot_ctx *ctx, uint32_t target)
+{
+	const struct ldr_literal_index *index = &ctx->literals;
+	uint32_t wide = LDR_LITERAL_NONE, narrow = LDR_LITERAL_NONE;
+	uint32_t i;
+
+	if (!index->buckets)
+		ibootsup_build_ldr_index (ctx);
+
+	for (i = index->buckets[ldr_literal_hash (index, target)]; i != LDR_LITERAL_NONE; i = index->refs[i].next) {
+		const struct ldr_literal *ref = &index->refs[i];
+
+		if (ref->target != target || ref->insn > target)
+			continue;
+		if (ref->kind == LDR_LITERAL_WIDE)
+			wide = ref->insn;
+		else if (ref->kind == LDR_LITERAL_NARROW)
+			narrow = ref->insn;
+	}
+
+	if (wide != LDR_LITERAL_NONE)
+		return ctx->image.image + wide;
+	if (narrow != LDR_LITERAL_NONE)
+		return ctx->image.image + narrow;
+	return NULL;
+}
+
+/*
+ * Clamp a forward search from p to the end of the function holding it, so
+ * it cannot run on into the next one.
+ */
+static int
+ibootsup_function_remaining (struct iboot_ctx *ctx, const void *p, int len)
+{
+	uint32_t offset = (uint8_t *) p - ctx->image.image;
+	uint32_t end;
+
+	if (!ctx->functions.ranges)
+		ibootsup_build_function_table (ctx);
+	if (function_containing (&ctx->functions, offset, NULL, &end))
+		return len;
+	if (end - offset < len)
+		return end - offset;
+	return len;
+}
+
+/*
+ * iBoot is a flat image, treat all of it as code. Built on first use, a
+ * plan cache hit never needs it.
+ */
+static void
+ibootsup_build_function_table (struct iboot_ctx *ctx)
+{
+	struct code_range range = { 0, ctx->image.size };
+
+	function_table_free (&ctx->functions);
+	function_table_build (&ctx->functions, ctx->image.image, ctx->image.size, &range, 1);
 }
 
 static boolean_t
-ibootsup_verify_arm_image (void)
+ibootsup_verify_arm_image (struct iboot_ctx *ctx)
 {
-	if (!memcmp (current_image.image, ARM_BRANCH_OPCODE, OPCODE_LENGTH))
+	if (ctx->image.size > IBOOT_IMAGE_VERSION + 16 && !memcmp (ctx->image.image, ARM_BRANCH_OPCODE, OPCODE_LENGTH))
 		return TRUE;
 	return FALSE;
 }
 
 static int
-ibootsup_get_version (void)
+ibootsup_get_version (struct iboot_ctx *ctx)
 {
 	int off = IBOOT_IMAGE_VERSION + sizeof ("iBoot-") - 1;	/* Accomodate for '\0' */
-	return atoi ((char *) current_image.image + off);
+	return atoi ((char *) ctx->image.image + off);
 }
 
 static int
-ibootsup_get_ios_version (void)
+ibootsup_get_ios_version (struct iboot_ctx *ctx)
 {
-	int current_version = ibootsup_get_version ();
+	int current_version = ibootsup_get_version (ctx);
 	struct iboot_interval *interval = &intervals[0];
 	while (interval->os_version != -1) {
 		if (current_version >= interval->low_bound && current_version <= interval->high_bound)
@@ -259,97 +414,321 @@ ibootsup_get_ios_version (void)
 }
 
 int
-ibootsup_map_buffer (uint8_t * buf, int size)
+ibootsup_map_buffer (struct iboot_ctx **ctxp, uint8_t * buf, int size)
 {
-	current_image.image = buf;
-	current_image.size = size;
+	struct iboot_ctx *ctx = (struct iboot_ctx *) _xmalloc (sizeof (struct iboot_ctx));
+
+	image_file_from_buffer (&ctx->file, buf, size, FALSE);
+	ctx->image.image = buf;
+	ctx->image.size = size;
 
-	if (!ibootsup_verify_arm_image ()) {
+	if (!ibootsup_verify_arm_image (ctx)) {
+		ibootsup_close (ctx);
 		return -EBADF;
 	}
 
+	*ctxp = ctx;
 	return 0;
 }
 
 int
-ibootsup_map_file (const char *filename)
+ibootsup_map_file (struct iboot_ctx **ctxp, const char *filename)
 {
-	struct stat buf;
-	FILE *fp = fopen (filename, "rb");
+	struct iboot_ctx *ctx = (struct iboot_ctx *) _xmalloc (sizeof (struct iboot_ctx));
+	int error;
 
-	if (!fp)
-		return -ENOENT;
-	if (stat (filename, &buf) > 0)
-		return -ENOENT;
-
-	current_image.image = (uint8_t *) _xmalloc (buf.st_size);
-	current_image.size = buf.st_size;
-	fread ((void *) current_image.image, buf.st_size, 1, fp);
-	fclose (fp);
+	if ((error = image_file_open (&ctx->file, filename)) != 0) {
+		free (ctx);
+		return error;
+	}
+	ctx->image.image = ctx->file.data;
+	ctx->image.size = ctx->file.size;
 
-	if (!ibootsup_verify_arm_image ()) {
-		free (current_image.image);
+	if (!ibootsup_verify_arm_image (ctx)) {
+		ibootsup_close (ctx);
 		return -EBADF;
 	}
 
+	*ctxp = ctx;
 	return 0;
 }
 
-static inline uint8_t *
-ibootsup_off2pat_patch (int offset, uint8_t * patch, int bufsize, int patchsize)
+/*
+ * Byte signatures a patcher looks for. All of them are found in one pass:
+ * a prefilter on the first two bytes of every signature picks candidate
+ * offsets, and only those are compared in full. The prefilter compares 16
+ * or 32 offsets at a time where the CPU allows; IBOOT_SCALAR_SEARCH in the
+ * environment forces the plain one.
+ */
+struct ibootsup_signature {
+	const void *bytes;
+	int length;
+};
+
+typedef void (*ibootsup_signature_hit_t) (struct iboot_ctx *ctx, int which, int offset, void *arg);
+
+#define IBOOTSUP_MAX_SIGNATURES		16
+
+enum {
+	SIGNATURE_SCAN_SCALAR,
+	SIGNATURE_SCAN_SSE2,
+	SIGNATURE_SCAN_AVX2,
+};
+
+static const char *ibootsup_signature_scan_names[] = { "scalar", "sse2", "avx2" };
+
+static int
+ibootsup_signature_scan_level (void)
+{
+	if (getenv ("IBOOT_SCALAR_SEARCH"))
+		return SIGNATURE_SCAN_SCALAR;
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		return SIGNATURE_SCAN_AVX2;
+	if (__builtin_cpu_supports ("sse2"))
+		return SIGNATURE_SCAN_SSE2;
+#endif
+	return SIGNATURE_SCAN_SCALAR;
+}
+
+/*
+ * Report every signature that matches at offset, in table order.
+ */
+static inline void
+ibootsup_signature_verify (struct iboot_ctx *ctx, const struct ibootsup_signature *sigs, int count, int offset,
+						   ibootsup_signature_hit_t hit, void *arg)
 {
-	uint8_t *buffer = (uint8_t *) _xmalloc (bufsize);
-	memcpy (buffer, current_image.image + offset, bufsize);
-	memcpy (buffer, patch, patchsize);
-	return buffer;
+	int j;
+
+	for (j = 0; j < count; j++) {
+		if (sigs[j].length <= ctx->image.size - offset && !memcmp (ctx->image.image + offset, sigs[j].bytes, sigs[j].length))
+			hit (ctx, j, offset, arg);
+	}
 }
 
+/*
+ * Scan offsets [lo, hi) with a bitmap of leading byte pairs.
+ */
 static void
-ibootsup_patch_ios_old_iboot (void)
+ibootsup_signature_scan_scalar (struct iboot_ctx *ctx, const struct ibootsup_signature *sigs, int count, int lo, int hi,
+								ibootsup_signature_hit_t hit, void *arg)
 {
-	int i = 0, tag = 0, rsaoff = 0, bootargoff = 0, bacondoff = 0;
+	uint32_t pairs[65536 / 32];
+	const uint8_t *image = ctx->image.image;
+	int i, j;
+
+	bzero (pairs, sizeof (pairs));
+	for (j = 0; j < count; j++) {
+		const uint8_t *bytes = sigs[j].bytes;
+		int pair = bytes[0] | bytes[1] << 8;
+		pairs[pair >> 5] |= 1U << (pair & 31);
+	}
 
-	/*
-	 * Initialize patch list. 
-	 */
-	patch_list_initialize ();
+	if (hi > ctx->image.size - 1)
+		hi = ctx->image.size - 1;
+	for (i = lo; i < hi; i++) {
+		int pair = image[i] | image[i + 1] << 8;
+		if (pairs[pair >> 5] & (1U << (pair & 31)))
+			ibootsup_signature_verify (ctx, sigs, count, i, hit, arg);
+	}
+}
 
-	/*
-	 * Pass zero, scan file for image3 tags. 
-	 */
-	for (i = 0; i < current_image.size; i++) {
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__ ((target ("sse2")))
+static void
+ibootsup_signature_scan_sse2 (struct iboot_ctx *ctx, const struct ibootsup_signature *sigs, int count, int lo, int hi,
+							  ibootsup_signature_hit_t hit, void *arg)
+{
+	__m128i first[IBOOTSUP_MAX_SIGNATURES], second[IBOOTSUP_MAX_SIGNATURES];
+	const uint8_t *image = ctx->image.image;
+	int i, j;
+
+	for (j = 0; j < count; j++) {
+		first[j] = _mm_set1_epi8 (((const char *) sigs[j].bytes)[0]);
+		second[j] = _mm_set1_epi8 (((const char *) sigs[j].bytes)[1]);
+	}
+
+	// Offset i + k is a candidate when byte k of a and of b start some signature.
+	for (i = lo; i + 16 <= hi && i + 17 <= ctx->image.size; i += 16) {
+		__m128i a = _mm_loadu_si128 ((const __m128i *) (image + i));
+		__m128i b = _mm_loadu_si128 ((const __m128i *) (image + i + 1));
+		__m128i any = _mm_setzero_si128 ();
+		uint32_t hits;
+
+		for (j = 0; j < count; j++)
+			any = _mm_or_si128 (any, _mm_and_si128 (_mm_cmpeq_epi8 (a, first[j]), _mm_cmpeq_epi8 (b, second[j])));
+		hits = (uint32_t) _mm_movemask_epi8 (any);
+		while (hits) {
+			ibootsup_signature_verify (ctx, sigs, count, i + __builtin_ctz (hits), hit, arg);
+			hits &= hits - 1;
+		}
+	}
+
+	ibootsup_signature_scan_scalar (ctx, sigs, count, i, hi, hit, arg);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+ibootsup_signature_scan_avx2 (struct iboot_ctx *ctx, const struct ibootsup_signature *sigs, int count, int lo, int hi,
+							  ibootsup_signature_hit_t hit, void *arg)
+{
+	__m256i first[IBOOTSUP_MAX_SIGNATURES], second[IBOOTSUP_MAX_SIGNATURES];
+	const uint8_t *image = ctx->image.image;
+	int i, j;
+
+	for (j = 0; j < count; j++) {
+		first[j] = _mm256_set1_epi8 (((const char *) sigs[j].bytes)[0]);
+		second[j] = _mm256_set1_epi8 (((const char *) sigs[j].bytes)[1]);
+	}
+
+	for (i = lo; i + 32 <= hi && i + 33 <= ctx->image.size; i += 32) {
+		__m256i a = _mm256_loadu_si256 ((const __m256i *) (image + i));
+		__m256i b = _mm256_loadu_si256 ((const __m256i *) (image + i + 1));
+		__m256i any = _mm256_setzero_si256 ();
+		uint32_t hits;
+
+		for (j = 0; j < count; j++)
+			any = _mm256_or_si256 (any, _mm256_and_si256 (_mm256_cmpeq_epi8 (a, first[j]), _mm256_cmpeq_epi8 (b, second[j])));
+		hits = (uint32_t) _mm256_movemask_epi8 (any);
+		while (hits) {
+			ibootsup_signature_verify (ctx, sigs, count, i + __builtin_ctz (hits), hit, arg);
+			hits &= hits - 1;
+		}
+	}
+
+	ibootsup_signature_scan_scalar (ctx, sigs, count, i, hi, hit, arg);
+}
+#endif
+
+/*
+ * Call hit for every signature matching at an offset in [lo, hi), in
+ * offset order and table order within an offset. With a name, the time
+ * the scan took is printed under it.
+ */
+static void
+ibootsup_scan_signatures (struct iboot_ctx *ctx, const struct ibootsup_signature *sigs, int count, int lo, int hi,
+						  ibootsup_signature_hit_t hit, void *arg, const char *name)
+{
+	struct timeval begin, end;
+	int level = ibootsup_signature_scan_level ();
+
+	assert (count <= IBOOTSUP_MAX_SIGNATURES);
+	if (lo < 0)
+		lo = 0;
+	if (hi > ctx->image.size)
+		hi = ctx->image.size;
+
+	gettimeofday (&begin, NULL);
+	switch (level) {
+#if defined(__i386__) || defined(__x86_64__)
+	case SIGNATURE_SCAN_AVX2:
+		ibootsup_signature_scan_avx2 (ctx, sigs, count, lo, hi, hit, arg);
+		break;
+	case SIGNATURE_SCAN_SSE2:
+		ibootsup_signature_scan_sse2 (ctx, sigs, count, lo, hi, hit, arg);
+		break;
+#endif
+	default:
+		ibootsup_signature_scan_scalar (ctx, sigs, count, lo, hi, hit, arg);
+		break;
+	}
+	gettimeofday (&end, NULL);
+
+	if (name)
+		printf ("%s: %d signatures over %d bytes in %.2f ms (%s)\n", name, count, hi - lo,
+				(end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_usec - begin.tv_usec) / 1000.0, ibootsup_signature_scan_names[level]);
+}
+
+enum {
+	LEGACY_BA_COND,
+	LEGACY_BOOTARGS,
+	LEGACY_IMAGE3_TAG,
+	LEGACY_RSA = LEGACY_IMAGE3_TAG + 9,
+	LEGACY_SIGNATURES
+};
+
+/* In the order the old per-byte loop compared them. */
+static const struct ibootsup_signature ibootsup_legacy_signatures[LEGACY_SIGNATURES] = {
+	{IBOOT_IOS_BA_COND, IBOOT_IOS_BA_LEN},
+	{IBOOT_DEFAULT_BOOTARGS, sizeof (IBOOT_DEFAULT_BOOTARGS)},
+	{&ibootsup_image3_tags[0], 4},
+	{&ibootsup_image3_tags[1], 4},
+	{&ibootsup_image3_tags[2], 4},
+	{&ibootsup_image3_tags[3], 4},
+	{&ibootsup_image3_tags[4], 4},
+	{&ibootsup_image3_tags[5], 4},
+	{&ibootsup_image3_tags[6], 4},
+	{&ibootsup_image3_tags[7], 4},
+	{&ibootsup_image3_tags[8], 4},
+	{IBOOT_IOS_RSA_PATTERN, IBOOT_IOS_RSA_LEN},
+};
+
+struct ibootsup_legacy_offsets {
+	int rsaoff, bootargoff, bacondoff;
+};
+
+static void
+ibootsup_legacy_hit (struct iboot_ctx *ctx, int which, int i, void *arg)
+{
+	struct ibootsup_legacy_offsets *offsets = (struct ibootsup_legacy_offsets *) arg;
+	void *ldr, *bl;
+	uint32_t off;
+
+	switch (which) {
+	case LEGACY_BA_COND:
 		/*
 		 * Overwrite conditional
 		 */
-		if (!memcmp (current_image.image + i, IBOOT_IOS_BA_COND, IBOOT_IOS_BA_LEN))
-			bacondoff = i;
-
+		offsets->bacondoff = i;
+		break;
+	case LEGACY_BOOTARGS:
 		/*
 		 * Overwrite with boot-arguments. 
 		 */
-		if (!memcmp (current_image.image + i, IBOOT_DEFAULT_BOOTARGS, sizeof (IBOOT_DEFAULT_BOOTARGS)))
-			bootargoff = i;
-
-		for (tag = 0; tag < (sizeof (ibootsup_image3_tags) / sizeof (uint32_t)); tag++) {
-			if (!memcmp (current_image.image + i, &ibootsup_image3_tags[tag], 4)) {
-				void *ldr = locate_ldr (current_image.image + i);
-				void *bl = bl_search_down (ldr, 0x200);
-				uint32_t off = (uint32_t) bl - (uint32_t) current_image.image;
-				printf ("%x tag check: %x\n", ibootsup_image3_tags[tag], off);
-				patch_list_add_patch ("Image3 Tag Check", current_image.image + off, ibootsup_off2pat_patch (off, (uint8_t *) IBOOT_IOS_LEGACY_PATCH, 16, IBOOT_IOS_LEGACY_PLEN), 16);
-			}
-		}
-
+		offsets->bootargoff = i;
+		break;
+	case LEGACY_RSA:
 		/*
 		 * RSA offset. 
 		 */
-		if (!memcmp (current_image.image + i, IBOOT_IOS_RSA_PATTERN, IBOOT_IOS_RSA_LEN))
-			rsaoff = i + 0x10;
+		offsets->rsaoff = i + 0x10;
+		break;
+	default:
+		ldr = ibootsup_locate_ldr (ctx, i);
+		bl = ldr ? bl_search_down (ldr, ibootsup_function_remaining (ctx, ldr, 0x200)) : NULL;
+		if (!bl)
+			break;
+		off = (uint8_t *) bl - ctx->image.image;
+		printf ("%x tag check: %x\n", ibootsup_image3_tags[which - LEGACY_IMAGE3_TAG], off);
+		patch_list_add_patch (&ctx->plan, "Image3 Tag Check", off, ctx->image.image + off, (uint8_t *) IBOOT_IOS_LEGACY_PATCH, IBOOT_IOS_LEGACY_PLEN);
+		break;
 	}
+}
+
+static int
+ibootsup_patch_ios_old_iboot (struct iboot_ctx *ctx)
+{
+	struct ibootsup_legacy_offsets offsets = { 0, 0, 0 };
+	int rsaoff, bootargoff, bacondoff;
+
+	/*
+	 * Initialize patch list. 
+	 */
+	patch_list_initialize (&ctx->plan);
+
+	/*
+	 * Pass zero, scan file for image3 tags. 
+	 */
+	ibootsup_scan_signatures (ctx, ibootsup_legacy_signatures, LEGACY_SIGNATURES, 0, ctx->image.size, ibootsup_legacy_hit, &offsets,
+							  "iBoot signature scan");
+	rsaoff = offsets.rsaoff;
+	bootargoff = offsets.bootargoff;
+	bacondoff = offsets.bacondoff;
 
 	if (!rsaoff) {
 		warn ("RSA check missing???");
-		return;
+		return -1;
 	}
 
 	if (!bootargoff || !bacondoff) {
@@ -360,53 +739,119 @@ ibootsup_patch_ios_old_iboot (void)
 	 * RSA check.
 	 */
 	printf ("RSA check at %x.\n", rsaoff);
-	patch_list_add_patch ("RSA patch", current_image.image + rsaoff, ibootsup_off2pat_patch (rsaoff, (uint8_t *) IBOOT_IOS_LEGACY_PATCH, 16, IBOOT_IOS_LEGACY_PLEN), 16);
+	patch_list_add_patch (&ctx->plan, "RSA patch", rsaoff, ctx->image.image + rsaoff, (uint8_t *) IBOOT_IOS_LEGACY_PATCH, IBOOT_IOS_LEGACY_PLEN);
 	printf ("Boot-arg conditional at %x.\n", bacondoff);
 	if (bootargoff) {
-		patch_list_add_patch ("BootArgs", current_image.image + bootargoff, ibootsup_off2pat_patch (bootargoff, (uint8_t *) IBOOT_DEFAULT_PWNARGS, sizeof (IBOOT_DEFAULT_BOOTARGS), sizeof (IBOOT_DEFAULT_BOOTARGS)), sizeof (IBOOT_DEFAULT_BOOTARGS));
+		patch_list_add_patch (&ctx->plan, "BootArgs", bootargoff, ctx->image.image + bootargoff, (uint8_t *) IBOOT_DEFAULT_PWNARGS, sizeof (IBOOT_DEFAULT_BOOTARGS));
 	}
 	if (bacondoff) {
-		patch_list_add_patch ("BootArgs Conditional", current_image.image + bacondoff, ibootsup_off2pat_patch (bacondoff, (uint8_t *) IBOOT_IOS_BA_PATCH, 16, IBOOT_IOS_BA_PLEN), 16);
+		patch_list_add_patch (&ctx->plan, "BootArgs Conditional", bacondoff, ctx->image.image + bacondoff, (uint8_t *) IBOOT_IOS_BA_PATCH, IBOOT_IOS_BA_PLEN);
 	}
 
 	/*
 	 * Dump listing. 
 	 */
-	patch_list_iterate ();
+	patch_list_iterate (&ctx->plan);
+	return 0;
 }
 
-static void
-ibootsup_patch_ios7_iboot (void)
-{
-	int i = 0, sigoff = 0, bootargoff = 0, bacondoff = 0, img3off = 0;
+enum {
+	IOS7_SIGNATURE,
+	IOS7_BOOTARGS,
+	IOS7_BA_COND,
+	IOS7_IMAGE3,
+	IOS7_SIGNATURES
+};
 
+static const struct ibootsup_signature ibootsup_ios7_signatures[IOS7_SIGNATURES] = {
 	/*
-	 * Pass zero, scan file for signature check. 
+	 * Patch to 00 20 18 60 
 	 */
-	for (i = 0; i < current_image.size; i++) {
-		/*
-		 * Patch to 00 20 18 60 
-		 */
-		if (!memcmp (current_image.image + i, IBOOT_IOS7_SIGPATTERN, IBOOT_IOS7_SIGLEN))
-			sigoff = i + IBOOT_IOS7_SIGLEN;
+	{IBOOT_IOS7_SIGPATTERN, IBOOT_IOS7_SIGLEN},
+	/*
+	 * Overwrite with boot-arguments. 
+	 */
+	{IBOOT_DEFAULT_BOOTARGS, sizeof (IBOOT_DEFAULT_BOOTARGS)},
+	/*
+	 * Conditional to allow injection of boot-args with/without RAM disk. 
+	 */
+	{IBOOT_IOS7_BA_COND, IBOOT_IOS7_BA_LEN},
+	/*
+	 * Allow stock image3 files. 
+	 */
+	{IBOOT_IOS7_IMG3PATCH, IBOOT_IOS7_IMG3PATCH_LEN},
+};
 
-		/*
-		 * Overwrite with boot-arguments. 
-		 */
-		if (!memcmp (current_image.image + i, IBOOT_DEFAULT_BOOTARGS, sizeof (IBOOT_DEFAULT_BOOTARGS)))
-			bootargoff = i;
+/* Distance from each signature to the bytes it patches. */
+static const int ibootsup_ios7_adjust[IOS7_SIGNATURES] = { IBOOT_IOS7_SIGLEN, 0, 0, 0x18 };
 
-		/*
-		 * Conditional to allow injection of boot-args with/without RAM disk. 
-		 */
-		if (!memcmp (current_image.image + i, IBOOT_IOS7_BA_COND, IBOOT_IOS7_BA_LEN))
-			bacondoff = i;
+/*
+ * Keep the last offset of each signature, as the old per-byte loops did.
+ */
+static void
+ibootsup_last_hit (struct iboot_ctx *ctx, int which, int i, void *arg)
+{
+	int *offsets = (int *) arg;
 
-		/*
-		 * Allow stock image3 files. 
-		 */
-		if (!memcmp (current_image.image + i, IBOOT_IOS7_IMG3PATCH, IBOOT_IOS7_IMG3PATCH_LEN))
-			img3off = i + 0x18;
+	offsets[which] = i;
+}
+
+/*
+ * Look for one signature only in the seeded window of the named patch.
+ * Returns the patch offset, or 0 when there is no window or nothing that
+ * matches the previous build's patch in it.
+ */
+static int
+ibootsup_seeded_find (struct iboot_ctx *ctx, const char *name, int which)
+{
+	uint32_t start, size;
+	int adjust = ibootsup_ios7_adjust[which];
+	int offset = -1, found = 0;
+
+	if (patch_seed_window (ctx->seed, name, &start, &size)) {
+		patch_seed_count (ctx->seed, FALSE);
+		return 0;
+	}
+
+	ibootsup_scan_signatures (ctx, &ibootsup_ios7_signatures[which], 1, (int) start - adjust,
+							  (int) (start + size) - adjust - ibootsup_ios7_signatures[which].length + 1, ibootsup_last_hit, &offset, NULL);
+	if (offset >= 0)
+		found = offset + adjust;
+
+	if (found && patch_seed_check (ctx->seed, name, ctx->image.image, ctx->image.size, found))
+		found = 0;
+	patch_seed_count (ctx->seed, found != 0);
+	return found;
+}
+
+static int
+ibootsup_patch_ios7_iboot (struct iboot_ctx *ctx)
+{
+	int sigoff = 0, bootargoff = 0, bacondoff = 0, img3off = 0;
+	int offsets[IOS7_SIGNATURES] = { -1, -1, -1, -1 };
+
+	/*
+	 * With a seed, try each pattern around where the previous build had it.
+	 */
+	if (ctx->seed) {
+		sigoff = ibootsup_seeded_find (ctx, "Signature", IOS7_SIGNATURE);
+		bootargoff = ibootsup_seeded_find (ctx, "BootArgs", IOS7_BOOTARGS);
+		bacondoff = ibootsup_seeded_find (ctx, "BootArgs Conditional", IOS7_BA_COND);
+		img3off = ibootsup_seeded_find (ctx, "Image3 Stock Image Load", IOS7_IMAGE3);
+		patch_seed_report (ctx->seed);
+	}
+
+	/*
+	 * Pass zero, scan file for signature check. Skipped when every pattern
+	 * was found in its window.
+	 */
+	if (!sigoff || !bootargoff || !bacondoff || !img3off) {
+		ibootsup_scan_signatures (ctx, ibootsup_ios7_signatures, IOS7_SIGNATURES, 0, ctx->image.size, ibootsup_last_hit, offsets,
+								  "iBoot signature scan");
+		sigoff = offsets[IOS7_SIGNATURE] < 0 ? 0 : offsets[IOS7_SIGNATURE] + ibootsup_ios7_adjust[IOS7_SIGNATURE];
+		bootargoff = offsets[IOS7_BOOTARGS] < 0 ? 0 : offsets[IOS7_BOOTARGS] + ibootsup_ios7_adjust[IOS7_BOOTARGS];
+		bacondoff = offsets[IOS7_BA_COND] < 0 ? 0 : offsets[IOS7_BA_COND] + ibootsup_ios7_adjust[IOS7_BA_COND];
+		img3off = offsets[IOS7_IMAGE3] < 0 ? 0 : offsets[IOS7_IMAGE3] + ibootsup_ios7_adjust[IOS7_IMAGE3];
 	}
 
 	printf ("Signature offset at %x.\n", sigoff);
@@ -416,93 +861,94 @@ ibootsup_patch_ios7_iboot (void)
 
 	if (!sigoff || !img3off) {
 		warn ("finding one of the core patches FAILED\n");
-		return;
+		return -1;
 	}
 
 	/*
 	 * (Re)initialize patch list and add patches. Convert the offsets into bytepatterns. 
 	 */
-	patch_list_initialize ();
-	patch_list_add_patch ("Image3 Stock Image Load", current_image.image + img3off, ibootsup_off2pat_patch (img3off, (uint8_t *) IBOOT_IOS7_IMG3PATCH_PATCH, 16, IBOOT_IOS7_IMG3PATCH_PLEN), 16);
-	patch_list_add_patch ("Signature", current_image.image + sigoff, ibootsup_off2pat_patch (sigoff, (uint8_t *) IBOOT_IOS7_SIGPATCH, 16, IBOOT_IOS7_SIGPATCH_LEN), 16);
+	patch_list_initialize (&ctx->plan);
+	patch_list_add_patch (&ctx->plan, "Image3 Stock Image Load", img3off, ctx->image.image + img3off, (uint8_t *) IBOOT_IOS7_IMG3PATCH_PATCH, IBOOT_IOS7_IMG3PATCH_PLEN);
+	patch_list_add_patch (&ctx->plan, "Signature", sigoff, ctx->image.image + sigoff, (uint8_t *) IBOOT_IOS7_SIGPATCH, IBOOT_IOS7_SIGPATCH_LEN);
 	if (bootargoff) {
-		patch_list_add_patch ("BootArgs", current_image.image + bootargoff, ibootsup_off2pat_patch (bootargoff, (uint8_t *) IBOOT_DEFAULT_PWNARGS, sizeof (IBOOT_DEFAULT_BOOTARGS), sizeof (IBOOT_DEFAULT_BOOTARGS)), sizeof (IBOOT_DEFAULT_BOOTARGS));
+		patch_list_add_patch (&ctx->plan, "BootArgs", bootargoff, ctx->image.image + bootargoff, (uint8_t *) IBOOT_DEFAULT_PWNARGS, sizeof (IBOOT_DEFAULT_BOOTARGS));
 	}
 	if (bacondoff) {
-		patch_list_add_patch ("BootArgs Conditional", current_image.image + bacondoff, ibootsup_off2pat_patch (bacondoff, (uint8_t *) IBOOT_IOS7_BA_COND_PATCH, 16, IBOOT_IOS7_BA_COND_LEN), 16);
+		patch_list_add_patch (&ctx->plan, "BootArgs Conditional", bacondoff, ctx->image.image + bacondoff, (uint8_t *) IBOOT_IOS7_BA_COND_PATCH, IBOOT_IOS7_BA_COND_LEN);
 	}
 
-	patch_list_iterate ();
+	patch_list_iterate (&ctx->plan);
+	return 0;
 }
 
-static void
-ibootsup_patch_iboot (void)
+static int
+ibootsup_patch_iboot (struct iboot_ctx *ctx)
 {
-	struct patch_list *head, *iter;
-	int total_patches, i = 0, j = 0;
-	double progress = 0.0;
-	printf ("Patching iBoot *NOW*...\n");
+	int error;
 
-	if (patch_list_get_head (&head, &total_patches)) {
-		warn ("failed to get patch list head\n");
-		return;
-	}
+	printf ("Patching iBoot *NOW*...\n");
 
-	/*
-	 * Patch it!
-	 */
-	for (iter = head, i = 0; i < total_patches; iter = iter->next, i++) {
-		for (j = 0; j < current_image.size; j++) {
-			if (!memcmp (current_image.image + j, iter->patch.original, iter->patch.size)) {
-				memcpy (current_image.image + j, iter->patch.patched, iter->patch.size);
-				progress = ((i + 1) / (double) total_patches) * 100.0;
-				printf ("%4.1f%% done. [(%d/%d) %-32.32s]\r", progress, i + 1, total_patches, iter->patch.name);
-				fflush (stdout);
-			}
-		}
-	}
-	printf ("\n");
+	if ((error = image_file_patch (&ctx->file, &ctx->plan)) < 0)
+		warnx ("failed to apply patch list");
+	return error < 0 ? error : 0;
 }
 
 int
-ibootsup_dynapatch (void)
+ibootsup_dynapatch (struct iboot_ctx *ctx)
 {
+	int error;
+
 	printf ("starting dynapatch...\n");
 
-	switch (ibootsup_get_ios_version ()) {
+	switch (ibootsup_get_ios_version (ctx)) {
 	case 4:					/* iOS 4. */
-		ibootsup_patch_ios_old_iboot ();
+		if (!patch_plan_cache_lookup (IBOOT_IOS_LEGACY_PLAN_TAG, ctx->image.image, ctx->image.size, &ctx->plan, ctx->digest)) {
+			patch_list_iterate (&ctx->plan);
+			break;
+		}
+		if ((error = ibootsup_patch_ios_old_iboot (ctx))) {
+			warnx ("iBoot patch finders failed, not patching");
+			return error;
+		}
+		patch_plan_cache_store (IBOOT_IOS_LEGACY_PLAN_TAG, ctx->image.image, ctx->image.size, &ctx->plan, ctx->digest);
 		break;
 	case 7:					/* iOS 7. */
-		ibootsup_patch_ios7_iboot ();
+		if (!patch_plan_cache_lookup (IBOOT_IOS7_PLAN_TAG, ctx->image.image, ctx->image.size, &ctx->plan, ctx->digest)) {
+			patch_list_iterate (&ctx->plan);
+			break;
+		}
+		if (getenv ("PATCH_SEED"))
+			ctx->seed = patch_seed_load (IBOOT_IOS7_PLAN_TAG, getenv ("PATCH_SEED"), ctx->image.image, ctx->image.size);
+		if ((error = ibootsup_patch_ios7_iboot (ctx))) {
+			warnx ("iBoot patch finders failed, not patching");
+			return error;
+		}
+		patch_plan_cache_store (IBOOT_IOS7_PLAN_TAG, ctx->image.image, ctx->image.size, &ctx->plan, ctx->digest);
 		break;
 	default:
-		warn ("iOS %d not supported yet for iBoot patcher", ibootsup_get_ios_version ());
+		warn ("iOS %d not supported yet for iBoot patcher", ibootsup_get_ios_version (ctx));
 		return -1;
 	}
 
-	ibootsup_patch_iboot ();
-
-	return 0;
+	return ibootsup_patch_iboot (ctx);
 }
 
 int
-ibootsup_write_file (const char *filename)
+ibootsup_write_file (struct iboot_ctx *ctx, const char *filename)
 {
-	struct stat buf;
-	FILE *fp = fopen (filename, "wb");
-
-	if (!fp)
-		return -ENOENT;
-	if (stat (filename, &buf) > 0)
-		return -ENOENT;
-
-	fwrite ((void *) current_image.image, current_image.size, 1, fp);
-	fclose (fp);
+	return image_file_write (&ctx->file, filename);
+}
 
-	free (current_image.image);
-	current_image.image = NULL;
-	current_image.size = 0;
+void
+ibootsup_close (struct iboot_ctx *ctx)
+{
+	if (!ctx)
+		return;
 
-	return 0;
+	image_file_close (&ctx->file);
+	function_table_free (&ctx->functions);
+	ibootsup_free_ldr_index (&ctx->literals);
+	patch_list_free (&ctx->plan);
+	patch_seed_free (ctx->seed);
+	free (ctx);
 }
@@ -0,0 +1,267 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Input images and their output.
+ *
+ * A file is mapped read-only, so pages nobody looks at are never read and
+ * nothing is copied up front. Verified patches stay in the plan, which
+ * acts as an overlay over the mapping. The output starts as a clone of the
+ * source (a reflink or an in-kernel copy where the platform has one, plain
+ * writes otherwise) and only the patched bytes are written on top. Images
+ * that live in memory, such as a decompressed kernelcache or a caller's
+ * buffer, are patched in place and written out whole.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+#include "structs.h"
+#include "patch.h"
+#include "util.h"
+#include "imagefile.h"
+
+int
+image_file_open (struct image_file *file, const char *filename)
+{
+	struct stat st;
+	void *data;
+	size_t done;
+	ssize_t n;
+
+	bzero (file, sizeof (*file));
+	file->fd = open (filename, O_RDONLY);
+	if (file->fd < 0)
+		return -ENOENT;
+	if (fstat (file->fd, &st) || st.st_size <= 0 || st.st_size > INT_MAX) {
+		image_file_close (file);
+		return -EBADF;
+	}
+	file->size = st.st_size;
+
+	data = mmap (NULL, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (data != MAP_FAILED) {
+		file->data = (uint8_t *) data;
+		file->flags = IMAGE_FILE_MAPPED;
+		return 0;
+	}
+
+	/*
+	 * Not mappable, read it in. The copy gets patched in place, so it is
+	 * no longer a clone source for the output.
+	 */
+	file->data = (uint8_t *) _xmalloc (file->size);
+	file->flags = IMAGE_FILE_OWNED;
+	for (done = 0; done < file->size; done += n) {
+		n = pread (file->fd, file->data + done, file->size - done, done);
+		if (n <= 0 && !(n < 0 && errno == EINTR)) {
+			image_file_close (file);
+			return -EIO;
+		}
+		if (n < 0)
+			n = 0;
+	}
+	close (file->fd);
+	file->fd = -1;
+
+	return 0;
+}
+
+/*
+ * Wrap an image that already lives in memory. An owned buffer is freed on
+ * close, a borrowed one is left to the caller.
+ */
+void
+image_file_from_buffer (struct image_file *file, uint8_t * buf, size_t size, boolean_t owned)
+{
+	bzero (file, sizeof (*file));
+	file->fd = -1;
+	file->data = buf;
+	file->size = size;
+	file->flags = owned ? IMAGE_FILE_OWNED : 0;
+}
+
+/*
+ * Verify a plan against the image and apply it: into the overlay for a
+ * mapped file, in place otherwise.
+ */
+int
+image_file_patch (struct image_file *file, struct patch_plan *plan)
+{
+	int error;
+
+	if (!(file->flags & IMAGE_FILE_MAPPED))
+		return patch_list_apply (plan, file->data, file->size);
+
+	if ((error = patch_list_verify (plan, file->data, file->size)) < 0)
+		return error;
+	file->overlay = plan;
+
+	return error;
+}
+
+/*
+ * Fill out with an unpatched copy of the image.
+ */
+static int
+image_file_copy (struct image_file *file, int out)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	if (file->fd >= 0) {
+#ifdef FICLONE
+		/* Share the source's extents, the filesystem copies patched blocks on write. */
+		if (!ioctl (out, FICLONE, file->fd))
+			return 0;
+#endif
+#ifdef SYS_copy_file_range
+		while (done < file->size) {
+			loff_t in_offset = done, out_offset = done;
+
+			n = syscall (SYS_copy_file_range, file->fd, &in_offset, out, &out_offset, file->size - done, 0);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+#endif
+	}
+
+	/* Plain writes for whatever the kernel would not copy for us. */
+	while (done < file->size) {
+		n = pwrite (out, file->data + done, file->size - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -EIO;
+		done += n;
+	}
+
+	return 0;
+}
+
+/*
+ * For outputs that cannot seek, such as pipes and devices: write the image
+ * front to back with the overlay laid over each chunk.
+ */
+static int
+image_file_stream (struct image_file *file, int out)
+{
+	uint8_t buffer[65536];
+	struct generic_patch *patches = NULL;
+	size_t offset, length, done, from, to;
+	int i, total = 0;
+	ssize_t n;
+
+	if (file->overlay)
+		patch_list_get_patches (file->overlay, &patches, &total);
+
+	for (offset = 0; offset < file->size; offset += length) {
+		length = file->size - offset < sizeof (buffer) ? file->size - offset : sizeof (buffer);
+		memcpy (buffer, file->data + offset, length);
+
+		for (i = 0; i < total; i++) {
+			from = patches[i].offset > offset ? patches[i].offset : offset;
+			to = patches[i].offset + patches[i].size < offset + length ? patches[i].offset + patches[i].size : offset + length;
+			if (from < to)
+				memcpy (buffer + from - offset, patches[i].patched + from - patches[i].offset, to - from);
+		}
+
+		for (done = 0; done < length; done += n) {
+			n = write (out, buffer + done, length - done);
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n <= 0)
+				return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+int
+image_file_write (struct image_file *file, const char *filename)
+{
+	struct stat source, target;
+	int out, error = 0;
+
+	out = open (filename, O_WRONLY | O_CREAT, 0644);
+	if (out < 0)
+		return -ENOENT;
+
+	if (fstat (out, &target)) {
+		close (out);
+		return -EIO;
+	}
+
+	/*
+	 * Writing back over the source: it already holds the unpatched image,
+	 * and truncating it would pull the mapping out from under us.
+	 */
+	if (file->fd >= 0 && !fstat (file->fd, &source) && source.st_dev == target.st_dev && source.st_ino == target.st_ino) {
+		if (file->overlay && patch_list_write (file->overlay, out) < 0)
+			error = -EIO;
+	}
+	else if (!S_ISREG (target.st_mode)) {
+		error = image_file_stream (file, out);
+	}
+	else if (ftruncate (out, 0) || image_file_copy (file, out) < 0) {
+		error = -EIO;
+	}
+	else if (file->overlay && patch_list_write (file->overlay, out) < 0) {
+		error = -EIO;
+	}
+
+	if (close (out) && !error)
+		error = -EIO;
+
+	return error;
+}
+
+void
+image_file_close (struct image_file *file)
+{
+	if (file->flags & IMAGE_FILE_MAPPED)
+		munmap (file->data, file->size);
+	else if (file->flags & IMAGE_FILE_OWNED)
+		free (file->data);
+	if (file->fd >= 0)
+		close (file->fd);
+
+	bzero (file, sizeof (*file));
+	file->fd = -1;
+}
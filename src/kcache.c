@@ -24,22 +24,38 @@
 #include <sys/types.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <err.h>
 
 #include <assert.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <xpwn/lzss.h>
 #include "structs.h"
 #include "patch.h"
 #include "util.h"
 #include "macho_loader.h"
+#include "prelink.h"
 #include "kcache.h"
+#include "kcache_scan.h"
+#include "functab.h"
+#include "plancache.h"
+#include "imagefile.h"
+#include "patchseed.h"
 
 #define KERNEL_VMADDR		0x80001000
 
+/* Patch plan cache tag, bump it whenever the iOS 7 finders change. */
+#define KCACHE_IOS7_PLAN_TAG	"kcache-ios7-1"
+
 static struct kernel_interval intervals[] = {
 	{1357, 1358, 3.0f},
 	{1504, 1505, 4.0f},
@@ -49,7 +65,6 @@ static struct kernel_interval intervals[] = {
 	{2423, 2424, 7.0f},
 };
 
-static struct mapped_image current_image;
 
 struct compressed_kernel_header
 {
@@ -485,6 +500,18 @@ insn_is_preamble_push (uint16_t * i)
 	return insn_is_push (i) && (insn_push_registers (i) & (1 << 14)) != 0;
 }
 
+// PUSH {..., LR}, or PUSH {R0, R1} to detect an already patched sandbox hook.
+static int
+insn_is_sb_entry_push (uint16_t * i)
+{
+	uint16_t registers;
+
+	if (!insn_is_push (i))
+		return 0;
+	registers = insn_push_registers (i);
+	return (registers & (1 << 14)) != 0 || (registers & (1 << 0 | 1 << 1)) == (1 << 0 | 1 << 1);
+}
+
 static int
 insn_is_str_imm (uint16_t * i)
 {
@@ -576,17 +603,227 @@ insn_str_imm_rn (uint16_t * i)
 }
 
 
-// Given an instruction, search backwards until an instruction is found matching the specified criterion.
-static uint16_t *
-find_last_insn_matching (uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * current_instruction, int (*match_func) (uint16_t *))
+/*
+ * Instruction boundary map. One forward decode over the executable ranges
+ * of the image marks every halfword an instruction starts at, and which of
+ * those instructions are 32-bit, so stepping to the previous instruction is
+ * a bit test instead of a guess from the halfwords in front of it.
+ */
+struct insn_boundary_map
+{
+	uint8_t *base;
+	size_t size;
+	uint32_t *starts;
+	uint32_t *wide;
+	struct code_range *ranges;
+	int nranges;
+};
+
+/*
+ * Literal xref index. One run of the find_literal_ref() machine over the
+ * whole image records every PC-relative address it resolves along with the
+ * ADD Rx, PC that produced it, hashed by address. Chains are kept in
+ * instruction order, so the first xref at or after a point is a short walk.
+ */
+#define LITERAL_XREF_NONE	0xFFFFFFFF
+
+struct literal_xref
 {
-	while ((uintptr_t) current_instruction > (uintptr_t) kdata) {
-		if (insn_is_32bit (current_instruction - 2) && !insn_is_32bit (current_instruction - 3)) {
-			current_instruction -= 2;
+	uint32_t address;
+	uint32_t insn;
+	uint32_t next;
+};
+
+struct literal_xref_index
+{
+	uint8_t *base;
+	size_t size;
+	struct literal_xref *xrefs;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t *buckets;
+	uint32_t mask;
+};
+
+/*
+ * Optional inverted index over the mapped image: for every 16-bit value, the
+ * sorted list of halfword positions holding it. Stored as one bucket table
+ * (65537 offsets) plus one position array, filled by a counting sort.
+ */
+struct halfword_index
+{
+	uint8_t *base;
+	size_t size;
+	uint32_t *start;
+	uint32_t *positions;
+};
+
+/*
+ * Everything known about one kernel image: the image itself, the indexes
+ * built over it and the patch plan derived for it. Nothing in here is
+ * shared, so separate contexts can be worked on from separate threads.
+ */
+struct kcache_ctx
+{
+	struct image_file file;
+	struct mapped_image image;
+	struct insn_boundary_map insn_map;
+	struct function_table functions;
+	struct literal_xref_index xrefs;
+	struct halfword_index index;
+	macho_map_t macho;
+	struct prelink_index kexts;
+	struct patch_plan plan;
+	uint8_t digest[20];
+	struct patch_seed *seed;
+};
+
+#define BITMAP_TEST(map, bit)	(((map)[(bit) >> 5] >> ((bit) & 31)) & 1)
+#define BITMAP_SET(map, bit)	((map)[(bit) >> 5] |= 1U << ((bit) & 31))
+
+static void
+insn_boundary_map_free (struct insn_boundary_map *map)
+{
+	free (map->starts);
+	free (map->wide);
+	free (map->ranges);
+	bzero (map, sizeof (*map));
+}
+
+static void
+insn_boundary_map_decode (struct insn_boundary_map *map, uint32_t offset, uint32_t size)
+{
+	uint16_t *image = (uint16_t *) map->base;
+	uint32_t i, end;
+
+	if (offset >= map->size)
+		return;
+	if (size > map->size - offset)
+		size = map->size - offset;
+
+	map->ranges = (struct code_range *) realloc (map->ranges, (map->nranges + 1) * sizeof (struct code_range));
+	if (!map->ranges)
+		err (-1, "cannot allocate chunk");
+	map->ranges[map->nranges].offset = offset;
+	map->ranges[map->nranges].size = size;
+	map->nranges++;
+
+	i = (offset + 1) / sizeof (uint16_t);
+	end = (offset + size) / sizeof (uint16_t);
+	while (i < end) {
+		BITMAP_SET (map->starts, i);
+		if (insn_is_32bit (image + i) && i + 1 < end) {
+			BITMAP_SET (map->wide, i);
+			i += 2;
 		}
 		else {
-			--current_instruction;
+			i++;
+		}
+	}
+}
+
+// Decode the sections holding instructions, or whole executable segments when they have none (__PRELINK_TEXT).
+static int
+insn_boundary_map_build (struct kcache_ctx *ctx)
+{
+	struct insn_boundary_map *map = &ctx->insn_map;
+	mach_header_t *mh = (mach_header_t *) ctx->image.image;
+	uint8_t *end = ctx->image.image + ctx->image.size;
+	struct load_command *lc;
+	uint32_t n, j, words, decoded;
+
+	insn_boundary_map_free (map);
+
+	if (ctx->image.size < sizeof (mach_header_t) || mh->magic != kMachMagic)
+		return -EBADF;
+
+	words = (ctx->image.size / sizeof (uint16_t) + 31) / 32;
+	map->base = ctx->image.image;
+	map->size = ctx->image.size;
+	map->starts = (uint32_t *) _xmalloc (words * sizeof (uint32_t));
+	map->wide = (uint32_t *) _xmalloc (words * sizeof (uint32_t));
+
+	lc = (struct load_command *) (mh + 1);
+	for (n = 0; n < mh->ncmds; n++, lc = (struct load_command *) ((uint8_t *) lc + lc->cmdsize)) {
+		struct segment_command *sc = (struct segment_command *) lc;
+		struct section *sect = (struct section *) (sc + 1);
+
+		if ((uint8_t *) (lc + 1) > end || lc->cmdsize < sizeof (struct load_command))
+			break;
+		if (lc->cmd != kLoadCommandSegment || !(sc->initprot & VM_PROT_EXECUTE))
+			continue;
+
+		decoded = 0;
+		for (j = 0; j < sc->nsects && (uint8_t *) (sect + 1) <= end; j++, sect++) {
+			if (!(sect->flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS)) || !sect->offset)
+				continue;
+			insn_boundary_map_decode (map, sect->offset, sect->size);
+			decoded++;
 		}
+		if (!decoded)
+			insn_boundary_map_decode (map, sc->fileoff, sc->filesize);
+	}
+
+	return 0;
+}
+
+static int
+insn_boundary_map_index (const struct insn_boundary_map *map, uint16_t * insn, uint32_t * index)
+{
+	uint8_t *p = (uint8_t *) insn;
+
+	if (!map->starts || p < map->base || p >= map->base + map->size)
+		return 0;
+	if ((p - map->base) & 1)
+		return 0;
+
+	*index = (p - map->base) / sizeof (uint16_t);
+	return 1;
+}
+
+// Step to the instruction before insn. Outside the decoded ranges, guess from the preceding halfwords as before.
+static uint16_t *
+insn_prev (const struct insn_boundary_map *map, uint16_t * insn)
+{
+	uint32_t i;
+
+	if (insn_boundary_map_index (map, insn, &i) && i >= 1) {
+		if (BITMAP_TEST (map->starts, i - 1))
+			return insn - 1;
+		if (i >= 2 && BITMAP_TEST (map->wide, i - 2))
+			return insn - 2;
+	}
+
+	if (insn_is_32bit (insn - 2) && !insn_is_32bit (insn - 3))
+		return insn - 2;
+	return insn - 1;
+}
+
+static uint16_t *
+insn_next (const struct insn_boundary_map *map, uint16_t * insn)
+{
+	uint32_t i;
+
+	if (insn_boundary_map_index (map, insn, &i) && BITMAP_TEST (map->starts, i))
+		return insn + (BITMAP_TEST (map->wide, i) ? 2 : 1);
+
+	return insn + (insn_is_32bit (insn) ? 2 : 1);
+}
+
+// Build the function table from the ranges the boundary map decoded.
+static int
+function_table_build_current (struct kcache_ctx *ctx)
+{
+	function_table_free (&ctx->functions);
+	return function_table_build (&ctx->functions, ctx->image.image, ctx->image.size, ctx->insn_map.ranges, ctx->insn_map.nranges);
+}
+
+// Given an instruction, search backwards until an instruction is found matching the specified criterion.
+static uint16_t *
+find_last_insn_matching (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * current_instruction, int (*match_func) (uint16_t *))
+{
+	while ((uintptr_t) current_instruction > (uintptr_t) kdata) {
+		current_instruction = insn_prev (&ctx->insn_map, current_instruction);
 
 		if (match_func (current_instruction)) {
 			return current_instruction;
@@ -596,20 +833,36 @@ find_last_insn_matching (uint32_t region, uint8_t * kdata, size_t ksize, uint16_
 	return NULL;
 }
 
+// True if kdata..kdata+ksize lies inside the mapped image, so image-wide tables can answer for it.
+static int
+kcache_in_image (struct kcache_ctx *ctx, uint8_t * kdata, size_t ksize)
+{
+	return kdata >= ctx->image.image && ksize <= ctx->image.size && (size_t) (kdata - ctx->image.image) <= ctx->image.size - ksize;
+}
+
+// Find the start of the function holding insn, checked against match_func. Falls back to walking backwards when the table has no answer inside kdata.
+static uint16_t *
+find_function_start (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * insn, int (*match_func) (uint16_t *))
+{
+	uint32_t start;
+
+	if (kcache_in_image (ctx, kdata, ksize)
+		&& !function_containing (&ctx->functions, (uint8_t *) insn - ctx->image.image, &start, NULL)
+		&& ctx->image.image + start >= kdata && match_func ((uint16_t *) (ctx->image.image + start)))
+		return (uint16_t *) (ctx->image.image + start);
+
+	return find_last_insn_matching (ctx, region, kdata, ksize, insn, match_func);
+}
+
 // Given an instruction and a register, find the PC-relative address that was stored inside the register by the time the instruction was reached.
 static uint32_t
-find_pc_rel_value (uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * insn, int reg)
+find_pc_rel_value (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * insn, int reg)
 {
 	// Find the last instruction that completely wiped out this register
 	int found = 0;
 	uint16_t *current_instruction = insn;
 	while ((uintptr_t) current_instruction > (uintptr_t) kdata) {
-		if (insn_is_32bit (current_instruction - 2)) {
-			current_instruction -= 2;
-		}
-		else {
-			--current_instruction;
-		}
+		current_instruction = insn_prev (&ctx->insn_map, current_instruction);
 
 		if (insn_is_mov_imm (current_instruction) && insn_mov_imm_rd (current_instruction) == reg) {
 			found = 1;
@@ -646,15 +899,46 @@ find_pc_rel_value (uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * in
 			value += ((uintptr_t) current_instruction - (uintptr_t) kdata) + 4;
 		}
 
-		current_instruction += insn_is_32bit (current_instruction) ? 2 : 1;
+		current_instruction = insn_next (&ctx->insn_map, current_instruction);
 	}
 
 	return value;
 }
 
-// Find PC-relative references to a certain address (relative to kdata). This is basically a virtual machine that only cares about instructions used in PC-relative addressing, so no branches, etc.
+
+static void
+literal_xref_index_free (struct literal_xref_index *index)
+{
+	free (index->xrefs);
+	free (index->buckets);
+	bzero (index, sizeof (*index));
+}
+
+static uint32_t
+literal_xref_hash (const struct literal_xref_index *index, uint32_t address)
+{
+	return (address * 2654435761U) & index->mask;
+}
+
+static void
+literal_xref_record (struct literal_xref_index *index, uint32_t address, uint32_t insn)
+{
+	if (index->count == index->capacity) {
+		index->capacity = index->capacity ? index->capacity * 2 : 4096;
+		index->xrefs = (struct literal_xref *) realloc (index->xrefs, index->capacity * sizeof (struct literal_xref));
+		if (!index->xrefs)
+			err (-1, "cannot allocate chunk");
+	}
+
+	index->xrefs[index->count].address = address;
+	index->xrefs[index->count].insn = insn;
+	index->xrefs[index->count].next = LITERAL_XREF_NONE;
+	index->count++;
+}
+
+// This is basically a virtual machine that only cares about instructions used in PC-relative addressing, so no branches, etc. It stops at the first reference to address, or records every reference when building the index.
 static uint16_t *
-find_literal_ref (uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * insn, uint32_t address)
+literal_ref_machine (struct kcache_ctx *ctx, uint8_t * kdata, size_t ksize, uint16_t * insn, uint32_t address, int record)
 {
 	uint16_t *current_instruction = insn;
 	uint32_t value[16];
@@ -677,30 +961,100 @@ find_literal_ref (uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * ins
 			int reg = insn_add_reg_rd (current_instruction);
 			if (insn_add_reg_rm (current_instruction) == 15 && insn_add_reg_rn (current_instruction) == reg) {
 				value[reg] += ((uintptr_t) current_instruction - (uintptr_t) kdata) + 4;
-				if (value[reg] == address) {
+				if (record)
+					literal_xref_record (&ctx->xrefs, value[reg], (uintptr_t) current_instruction - (uintptr_t) kdata);
+				else if (value[reg] == address)
 					return current_instruction;
-				}
 			}
 		}
 
-		current_instruction += insn_is_32bit (current_instruction) ? 2 : 1;
+		current_instruction = insn_next (&ctx->insn_map, current_instruction);
 	}
 
 	return NULL;
 }
 
-struct find_search_mask
+static void
+literal_xref_index_build (struct kcache_ctx *ctx)
 {
-	uint16_t mask;
-	uint16_t value;
-};
+	struct literal_xref_index *index = &ctx->xrefs;
+	uint32_t i, buckets = 1;
 
-// Search the range of kdata for a series of 16-bit values that match the search mask.
+	literal_xref_index_free (index);
+	literal_ref_machine (ctx, ctx->image.image, ctx->image.size, (uint16_t *) ctx->image.image, 0, 1);
+
+	while (buckets < index->count * 2)
+		buckets <<= 1;
+	index->buckets = (uint32_t *) _xmalloc (buckets * sizeof (uint32_t));
+	memset (index->buckets, 0xFF, buckets * sizeof (uint32_t));
+	index->mask = buckets - 1;
+
+	/*
+	 * Push in reverse so every chain comes out in instruction order.
+	 */
+	for (i = index->count; i-- > 0;) {
+		uint32_t h = literal_xref_hash (index, index->xrefs[i].address);
+		index->xrefs[i].next = index->buckets[h];
+		index->buckets[h] = i;
+	}
+
+	index->base = ctx->image.image;
+	index->size = ctx->image.size;
+}
+
+// First recorded reference to address (relative to the image) made at or after insn.
 static uint16_t *
-find_with_search_mask (uint32_t region, uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
+literal_xref_lookup (const struct literal_xref_index *index, uint32_t address, uint16_t * insn)
+{
+	uint32_t from = (uintptr_t) insn - (uintptr_t) index->base;
+	uint32_t i;
+
+	for (i = index->buckets[literal_xref_hash (index, address)]; i != LITERAL_XREF_NONE; i = index->xrefs[i].next) {
+		if (index->xrefs[i].address == address && index->xrefs[i].insn >= from)
+			return (uint16_t *) (index->base + index->xrefs[i].insn);
+	}
+
+	return NULL;
+}
+
+// Find PC-relative references to a certain address (relative to kdata). Served from the image-wide xref index, keeping only hits inside kdata.
+static uint16_t *
+find_literal_ref (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize, uint16_t * insn, uint32_t address)
+{
+	uint16_t *ref;
+
+	if (ctx->xrefs.buckets && ctx->xrefs.base == ctx->image.image && kcache_in_image (ctx, kdata, ksize)) {
+		ref = literal_xref_lookup (&ctx->xrefs, address + (uint32_t) (kdata - ctx->image.image), insn);
+		return ref && (uint8_t *) ref < kdata + ksize ? ref : NULL;
+	}
+
+	return literal_ref_machine (ctx, kdata, ksize, insn, address, 0);
+}
+
+/* Picked once per process from the CPU and environment, read-only afterwards. */
+static pthread_once_t search_mask_once = PTHREAD_ONCE_INIT;
+static search_mask_scanner_t search_mask_scanner;
+static int search_mask_level;
+static int search_mask_interpret;
+
+/*
+ * The scanners are written once as always-inline templates. The exported
+ * variants take a runtime table; the matchers generated from
+ * kcache_masks.def instantiate them with a constant one, letting the
+ * compiler unroll the verify loop and fold the masks into immediates.
+ */
+#define SEARCH_MASK_INLINE	static inline __attribute__ ((always_inline))
+
+// Search the range of kdata for a series of 16-bit values that match the search mask. This is the reference implementation the vector scanners are checked against.
+SEARCH_MASK_INLINE uint16_t *
+search_mask_scan_scalar (uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
 {
 	uint16_t *end = (uint16_t *) (kdata + ksize - (num_masks * sizeof (uint16_t)));
 	uint16_t *cur;
+
+	if (ksize < num_masks * sizeof (uint16_t))
+		return NULL;
+
 	for (cur = (uint16_t *) kdata; cur <= end; ++cur) {
 		int matched = 1;
 		int i;
@@ -718,111 +1072,487 @@ find_with_search_mask (uint32_t region, uint8_t * kdata, size_t ksize, int num_m
 	return NULL;
 }
 
-unsigned long
-Adler32 (unsigned char *buffer, long length)
+static uint16_t *
+find_with_search_mask_scalar (uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
 {
-	long cnt;
-	unsigned long result, lowHalf, highHalf;
+	return search_mask_scan_scalar (kdata, ksize, num_masks, masks);
+}
 
-	lowHalf = 1;
-	highHalf = 0;
+// The vector and generated scanners test every position against one key mask, the one with the most bits set, and only verify the survivors.
+SEARCH_MASK_INLINE int
+search_mask_key (int num_masks, const struct find_search_mask *masks)
+{
+	int i, key = 0;
+	for (i = 1; i < num_masks; i++) {
+		if (__builtin_popcount (masks[i].mask) > __builtin_popcount (masks[key].mask))
+			key = i;
+	}
+	return key;
+}
+
+SEARCH_MASK_INLINE int
+search_mask_verify (uint16_t * cur, int num_masks, const struct find_search_mask *masks)
+{
+	int i;
+	for (i = 0; i < num_masks; ++i) {
+		if ((*(cur + i) & masks[i].mask) != masks[i].value)
+			return 0;
+	}
+	return 1;
+}
 
-	for (cnt = 0; cnt < length; cnt++) {
-		if ((cnt % 5000) == 0) {
-			lowHalf %= 65521L;
-			highHalf %= 65521L;
+// Same as the reference scan, but tests the key mask first. Only worth it when the table is a constant and the key folds away.
+SEARCH_MASK_INLINE uint16_t *
+search_mask_scan_keyed (uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
+{
+	uint16_t *base = (uint16_t *) kdata;
+	size_t i, positions;
+	int key;
+
+	if (num_masks <= 0 || ksize < num_masks * sizeof (uint16_t))
+		return NULL;
+
+	positions = (ksize - num_masks * sizeof (uint16_t)) / sizeof (uint16_t) + 1;
+	key = search_mask_key (num_masks, masks);
+	for (i = 0; i < positions; i++) {
+		if ((base[i + key] & masks[key].mask) == masks[key].value && search_mask_verify (base + i, num_masks, masks))
+			return base + i;
+	}
+
+	return NULL;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__ ((target ("sse2")))
+SEARCH_MASK_INLINE uint16_t *
+search_mask_scan_sse2 (uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
+{
+	uint16_t *base = (uint16_t *) kdata;
+	size_t i, positions;
+	int key;
+	__m128i mask, value;
+
+	if (num_masks <= 0 || ksize < num_masks * sizeof (uint16_t))
+		return NULL;
+
+	positions = (ksize - num_masks * sizeof (uint16_t)) / sizeof (uint16_t) + 1;
+	key = search_mask_key (num_masks, masks);
+	mask = _mm_set1_epi16 ((short) masks[key].mask);
+	value = _mm_set1_epi16 ((short) masks[key].value);
+
+	// 16 positions per iteration, each halfword yields two bits in the byte mask.
+	for (i = 0; i + 16 <= positions; i += 16) {
+		__m128i lo = _mm_loadu_si128 ((const __m128i *) (base + i + key));
+		__m128i hi = _mm_loadu_si128 ((const __m128i *) (base + i + key + 8));
+		uint32_t hits = (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_and_si128 (lo, mask), value));
+		hits |= (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_and_si128 (hi, mask), value)) << 16;
+		hits &= 0x55555555;
+		while (hits) {
+			uint16_t *cur = base + i + (__builtin_ctz (hits) >> 1);
+			if (search_mask_verify (cur, num_masks, masks))
+				return cur;
+			hits &= hits - 1;
 		}
-		lowHalf += buffer[cnt];
-		highHalf += lowHalf;
 	}
 
-	lowHalf %= 65521L;
-	highHalf %= 65521L;
+	for (; i < positions; i++) {
+		if (search_mask_verify (base + i, num_masks, masks))
+			return base + i;
+	}
+
+	return NULL;
+}
+
+__attribute__ ((target ("avx2")))
+SEARCH_MASK_INLINE uint16_t *
+search_mask_scan_avx2 (uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
+{
+	uint16_t *base = (uint16_t *) kdata;
+	size_t i, positions;
+	int key;
+	__m256i mask, value;
+
+	if (num_masks <= 0 || ksize < num_masks * sizeof (uint16_t))
+		return NULL;
+
+	positions = (ksize - num_masks * sizeof (uint16_t)) / sizeof (uint16_t) + 1;
+	key = search_mask_key (num_masks, masks);
+	mask = _mm256_set1_epi16 ((short) masks[key].mask);
+	value = _mm256_set1_epi16 ((short) masks[key].value);
+
+	// 32 positions per iteration.
+	for (i = 0; i + 32 <= positions; i += 32) {
+		__m256i lo = _mm256_loadu_si256 ((const __m256i *) (base + i + key));
+		__m256i hi = _mm256_loadu_si256 ((const __m256i *) (base + i + key + 16));
+		uint64_t hits = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi16 (_mm256_and_si256 (lo, mask), value));
+		hits |= (uint64_t) (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi16 (_mm256_and_si256 (hi, mask), value)) << 32;
+		hits &= 0x5555555555555555ULL;
+		while (hits) {
+			uint16_t *cur = base + i + (__builtin_ctzll (hits) >> 1);
+			if (search_mask_verify (cur, num_masks, masks))
+				return cur;
+			hits &= hits - 1;
+		}
+	}
+
+	for (; i < positions; i++) {
+		if (search_mask_verify (base + i, num_masks, masks))
+			return base + i;
+	}
+
+	return NULL;
+}
+
+__attribute__ ((target ("sse2")))
+static uint16_t *
+find_with_search_mask_sse2 (uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
+{
+	return search_mask_scan_sse2 (kdata, ksize, num_masks, masks);
+}
+
+__attribute__ ((target ("avx2")))
+static uint16_t *
+find_with_search_mask_avx2 (uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
+{
+	return search_mask_scan_avx2 (kdata, ksize, num_masks, masks);
+}
+#endif
+
+const search_mask_scanner_t search_mask_scanners[SEARCH_MASK_LEVELS] = {
+	find_with_search_mask_scalar,
+#if defined(__i386__) || defined(__x86_64__)
+	find_with_search_mask_sse2,
+	find_with_search_mask_avx2,
+#endif
+};
 
-	result = (highHalf << 16) | lowHalf;
-	return result;
+// The widest scanner level this CPU can run.
+int
+search_mask_cpu_level (void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		return SEARCH_MASK_AVX2;
+	if (__builtin_cpu_supports ("sse2"))
+		return SEARCH_MASK_SSE2;
+#endif
+	return SEARCH_MASK_SCALAR;
 }
 
-/**************************************************************
- LZSS.C -- A Data Compression Program
-***************************************************************
-	4/6/1989 Haruhiko Okumura
-	Use, distribute, and modify this program freely.
-	Please send me your improved versions.
-		PC-VAN	  SCIENCE
-		NIFTY-Serve PAF01022
-		CompuServe  74050,1022
+// Pick the widest scanner this CPU can run. Setting KCACHE_SCALAR_SEARCH in the environment forces the reference one, KCACHE_INTERPRET_MASKS bypasses the generated matchers.
+static void
+find_with_search_mask_select (void)
+{
+	search_mask_interpret = getenv ("KCACHE_INTERPRET_MASKS") != NULL;
+	search_mask_level = getenv ("KCACHE_SCALAR_SEARCH") ? SEARCH_MASK_SCALAR : search_mask_cpu_level ();
+	search_mask_scanner = search_mask_scanners[search_mask_level];
+}
 
-**************************************************************/
-#define N		 4096			/* size of ring buffer - must be power of 2 */
-#define F		 18				/* upper limit for match_length */
-#define THRESHOLD 2				/* encode string into position and length
-								 * if match_length is greater than this */
-#define NIL	   N				/* index for root of binary search trees */
+
+static void
+halfword_index_free (struct halfword_index *index)
+{
+	free (index->start);
+	free (index->positions);
+	bzero (index, sizeof (*index));
+}
 
 int
-decompress_lzss (uint8_t * dst, uint8_t * src, uint32_t srclen)
+kcache_build_halfword_index (struct kcache_ctx *ctx)
 {
+	struct halfword_index *index = &ctx->index;
+	uint16_t *image = (uint16_t *) ctx->image.image;
+	uint32_t i, count = ctx->image.size / sizeof (uint16_t);
+	uint32_t *fill;
+	struct timeval begin, end;
+
+	if (!ctx->image.image)
+		return -EINVAL;
+
+	gettimeofday (&begin, NULL);
+	halfword_index_free (index);
+
+	index->start = (uint32_t *) _xmalloc ((65536 + 1) * sizeof (uint32_t));
+	index->positions = (uint32_t *) _xmalloc ((count ? count : 1) * sizeof (uint32_t));
+	fill = (uint32_t *) _xmalloc (65536 * sizeof (uint32_t));
+
+	for (i = 0; i < count; i++)
+		index->start[image[i] + 1]++;
+	for (i = 1; i <= 65536; i++)
+		index->start[i] += index->start[i - 1];
+	memcpy (fill, index->start, 65536 * sizeof (uint32_t));
+	for (i = 0; i < count; i++)
+		index->positions[fill[image[i]]++] = i;
+	free (fill);
+
+	index->base = ctx->image.image;
+	index->size = ctx->image.size;
+
+	gettimeofday (&end, NULL);
+	printf ("halfword index: %u positions, %lu KiB, built in %.2f ms\n", count,
+			(unsigned long) (((65536 + 1) + count) * sizeof (uint32_t) / 1024),
+			(end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_usec - begin.tv_usec) / 1000.0);
+
+	return 0;
+}
+
+static uint32_t
+halfword_index_lower_bound (const struct halfword_index *index, uint32_t lo, uint32_t hi, uint32_t position)
+{
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (index->positions[mid] < position)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Answer a masked query from the index. Candidates come from the bucket of
+ * the rarest fully-masked halfword, clipped to the searched range; they are
+ * in address order, so the first one that verifies is what a linear scan
+ * would have returned. Returns -1 if the index cannot serve the query.
+ */
+static int
+halfword_index_search (const struct halfword_index *index, uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks, uint16_t ** result)
+{
+	uint32_t first, last, lo, hi, bucket_lo = 0, bucket_hi = 0;
+	int i, j, key = -1;
+
+	if (!index->start || num_masks <= 0)
+		return -1;
+	if (kdata < index->base || kdata + ksize > index->base + index->size)
+		return -1;
+	if ((kdata - index->base) & 1)
+		return -1;
+	if (ksize < num_masks * sizeof (uint16_t))
+		return -1;
+
+	for (i = 0; i < num_masks; i++) {
+		if (masks[i].mask != 0xFFFF)
+			continue;
+		lo = index->start[masks[i].value];
+		hi = index->start[masks[i].value + 1];
+		if (key < 0 || hi - lo < bucket_hi - bucket_lo) {
+			key = i;
+			bucket_lo = lo;
+			bucket_hi = hi;
+		}
+	}
+	if (key < 0)
+		return -1;
+
+	first = (kdata - index->base) / sizeof (uint16_t);
+	last = first + (ksize - num_masks * sizeof (uint16_t)) / sizeof (uint16_t);
+	lo = halfword_index_lower_bound (index, bucket_lo, bucket_hi, first + key);
+	hi = halfword_index_lower_bound (index, lo, bucket_hi, last + key + 1);
+
 	/*
-	 * ring buffer of size N, with extra F-1 bytes to aid string comparison 
+	 * A vector scan of the range is cheaper than chasing a dense bucket.
 	 */
-	uint8_t text_buf[N + F - 1];
-	uint8_t *dststart = dst;
-	uint8_t *srcend = src + srclen;
-	int i, j, k, r, c;
-	unsigned int flags;
-
-	dst = dststart;
-	srcend = src + srclen;
-	for (i = 0; i < N - F; i++)
-		text_buf[i] = ' ';
-	r = N - F;
-	flags = 0;
-	for (;;) {
-		if (((flags >>= 1) & 0x100) == 0) {
-			if (src < srcend)
-				c = *src++;
-			else
-				break;
-			flags = c | 0xFF00;	/* uses higher byte cleverly */
-		}						/* to count eight */
-		if (flags & 1) {
-			if (src < srcend)
-				c = *src++;
-			else
+	if (hi - lo > (last - first + 1) / 8 + 16)
+		return -1;
+
+	*result = NULL;
+	for (; lo < hi; lo++) {
+		uint16_t *cur = (uint16_t *) index->base + index->positions[lo] - key;
+		for (j = 0; j < num_masks; j++) {
+			if ((cur[j] & masks[j].mask) != masks[j].value)
 				break;
-			*dst++ = c;
-			text_buf[r++] = c;
-			r &= (N - 1);
 		}
-		else {
-			if (src < srcend)
-				i = *src++;
-			else
-				break;
-			if (src < srcend)
-				j = *src++;
+		if (j == num_masks) {
+			*result = cur;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static uint16_t *
+find_with_search_mask (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize, int num_masks, const struct find_search_mask *masks)
+{
+	uint16_t *result;
+
+	if (!halfword_index_search (&ctx->index, kdata, ksize, num_masks, masks, &result))
+		return result;
+
+	pthread_once (&search_mask_once, find_with_search_mask_select);
+
+	return search_mask_scanner (kdata, ksize, num_masks, masks);
+}
+
+#define SEARCH_MASK_COUNT(table)	((int) (sizeof (table##_masks) / sizeof (*table##_masks)))
+
+#if defined(__i386__) || defined(__x86_64__)
+#define SEARCH_MASK_TABLE(table, ...) \
+	static const struct find_search_mask table##_masks[] = { __VA_ARGS__ }; \
+	static uint16_t *table##_scalar (uint8_t * kdata, size_t ksize) \
+	{ \
+		return search_mask_scan_keyed (kdata, ksize, SEARCH_MASK_COUNT (table), table##_masks); \
+	} \
+	__attribute__ ((target ("sse2"))) \
+	static uint16_t *table##_sse2 (uint8_t * kdata, size_t ksize) \
+	{ \
+		return search_mask_scan_sse2 (kdata, ksize, SEARCH_MASK_COUNT (table), table##_masks); \
+	} \
+	__attribute__ ((target ("avx2"))) \
+	static uint16_t *table##_avx2 (uint8_t * kdata, size_t ksize) \
+	{ \
+		return search_mask_scan_avx2 (kdata, ksize, SEARCH_MASK_COUNT (table), table##_masks); \
+	} \
+	static const struct search_mask_matcher table = { \
+		#table, table##_masks, SEARCH_MASK_COUNT (table), \
+		{ table##_scalar, table##_sse2, table##_avx2 } \
+	};
+#else
+#define SEARCH_MASK_TABLE(table, ...) \
+	static const struct find_search_mask table##_masks[] = { __VA_ARGS__ }; \
+	static uint16_t *table##_scalar (uint8_t * kdata, size_t ksize) \
+	{ \
+		return search_mask_scan_keyed (kdata, ksize, SEARCH_MASK_COUNT (table), table##_masks); \
+	} \
+	static const struct search_mask_matcher table = { \
+		#table, table##_masks, SEARCH_MASK_COUNT (table), \
+		{ table##_scalar, table##_scalar, table##_scalar } \
+	};
+#endif
+
+#include "kcache_masks.def"
+#undef SEARCH_MASK_TABLE
+
+const struct search_mask_matcher *const search_mask_matchers[] = {
+#define SEARCH_MASK_TABLE(table, ...)	&table,
+#include "kcache_masks.def"
+#undef SEARCH_MASK_TABLE
+};
+
+const int search_mask_matcher_count = sizeof (search_mask_matchers) / sizeof (*search_mask_matchers);
+
+static uint16_t *
+find_with_search_mask_matcher (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize, const struct search_mask_matcher *matcher)
+{
+	uint16_t *result;
+
+	pthread_once (&search_mask_once, find_with_search_mask_select);
+	if (search_mask_interpret)
+		return find_with_search_mask (ctx, region, kdata, ksize, matcher->num_masks, matcher->masks);
+
+	if (!halfword_index_search (&ctx->index, kdata, ksize, matcher->num_masks, matcher->masks, &result))
+		return result;
+
+	return matcher->scan[search_mask_level] (kdata, ksize);
+}
+
+static double
+search_mask_elapsed_ms (struct timeval *begin)
+{
+	struct timeval end;
+
+	gettimeofday (&end, NULL);
+	return (end.tv_sec - begin->tv_sec) * 1000.0 + (end.tv_usec - begin->tv_usec) / 1000.0;
+}
+
+/*
+ * Time every table over the whole image, interpreted and generated, at the
+ * selected scanner level. The halfword index is bypassed on both sides.
+ */
+int
+kcache_benchmark_search_masks (struct kcache_ctx *ctx, int iterations)
+{
+	int i, j;
+
+	if (!ctx->image.image)
+		return -EINVAL;
+	if (iterations <= 0)
+		iterations = 1;
+	pthread_once (&search_mask_once, find_with_search_mask_select);
+
+	printf ("%-28s %12s %12s %8s\n", "search table", "interp (ms)", "gen (ms)", "speedup");
+	for (i = 0; i < search_mask_matcher_count; i++) {
+		const struct search_mask_matcher *matcher = search_mask_matchers[i];
+		uint16_t *interpreted = NULL, *generated = NULL;
+		struct timeval begin;
+		double interp_ms, gen_ms;
+
+		gettimeofday (&begin, NULL);
+		for (j = 0; j < iterations; j++)
+			interpreted = search_mask_scanner (ctx->image.image, ctx->image.size, matcher->num_masks, matcher->masks);
+		interp_ms = search_mask_elapsed_ms (&begin) / iterations;
+
+		gettimeofday (&begin, NULL);
+		for (j = 0; j < iterations; j++)
+			generated = matcher->scan[search_mask_level] (ctx->image.image, ctx->image.size);
+		gen_ms = search_mask_elapsed_ms (&begin) / iterations;
+
+		if (interpreted != generated)
+			warnx ("%s: generated matcher disagrees with the interpreter", matcher->name);
+		printf ("%-28s %12.3f %12.3f %7.2fx\n", matcher->name, interp_ms, gen_ms, gen_ms > 0 ? interp_ms / gen_ms : 0.0);
+	}
+
+	return 0;
+}
+
+static const char *lzss_encoder_names[] = { "tree", "fast", "default", "best", "parallel" };
+
+/*
+ * Recompress the image with the tree encoder, at every hash chain level
+ * and at the default level on every processor, reporting ratio and
+ * throughput. Each stream is decoded again and compared against the image.
+ */
+int
+kcache_benchmark_lzss (struct kcache_ctx *ctx, int iterations)
+{
+	uint32_t bound, size = ctx->image.size;
+	uint8_t *compressed, *decoded, *end = NULL;
+	struct timeval begin;
+	double ms;
+	int level, j;
+
+	if (!ctx->image.image || !size)
+		return -EINVAL;
+	if (iterations <= 0)
+		iterations = 1;
+
+	bound = compress_lzss_bound (size);
+	compressed = _xmalloc (size * 2);
+	decoded = _xmalloc (size);
+
+	printf ("%-12s %12s %8s %10s %10s\n", "encoder", "compressed", "ratio", "time (ms)", "MB/s");
+	for (level = 0; level <= LZSS_LEVEL_BEST + 1; level++) {
+		gettimeofday (&begin, NULL);
+		for (j = 0; j < iterations; j++) {
+			if (!level)
+				end = compress_lzss (compressed, size * 2, ctx->image.image, size);
+			else if (level > LZSS_LEVEL_BEST)
+				end = compress_lzss_parallel (compressed, bound, ctx->image.image, size, LZSS_LEVEL_DEFAULT, 0);
 			else
-				break;
-			i |= ((j & 0xF0) << 4);
-			j = (j & 0x0F) + THRESHOLD;
-			for (k = 0; k <= j; k++) {
-				c = text_buf[(i + k) & (N - 1)];
-				*dst++ = c;
-				text_buf[r++] = c;
-				r &= (N - 1);
-			}
+				end = compress_lzss_level (compressed, bound, ctx->image.image, size, level);
+		}
+		ms = search_mask_elapsed_ms (&begin) / iterations;
+
+		if (!end || decompress_lzss_adler (decoded, size, compressed, end - compressed, NULL) != (int) size ||
+		    memcmp (decoded, ctx->image.image, size)) {
+			warnx ("lzss: %s encoder does not round trip", lzss_encoder_names[level]);
+			continue;
 		}
+		printf ("%-12s %12u %8.4f %10.1f %10.1f\n", lzss_encoder_names[level], (uint32_t) (end - compressed),
+		    (double) (end - compressed) / size, ms, ms > 0 ? size / ms / 1000.0 : 0.0);
 	}
 
-	return dst - dststart;
+	free (compressed);
+	free (decoded);
+	return 0;
 }
 
 int
 kcache_decompress_kernel (void *compressedKernel, void *decompressedKernel, int *decompressed_size)
 {
 	struct compressed_kernel_header *kernel_header = (struct compressed_kernel_header *) compressedKernel;
-	u_int32_t uncompressed_size, size;
+	u_int32_t uncompressed_size, size, adler;
 
 	if (kernel_header->signature != __builtin_bswap32 ('comp')) {
 		printf ("decompress_kernel: bad file magic\n");
@@ -842,14 +1572,14 @@ kcache_decompress_kernel (void *compressedKernel, void *decompressedKernel, int
 		return 0;
 	}
 
-	size = decompress_lzss ((u_int8_t *) (decompressedKernel), &kernel_header->data[0], __builtin_bswap32 (kernel_header->compressed_size));
+	size = decompress_lzss_adler ((u_int8_t *) (decompressedKernel), uncompressed_size, &kernel_header->data[0], __builtin_bswap32 (kernel_header->compressed_size), &adler);
 
 	if (uncompressed_size != size) {
 		printf ("decompress_kernel: size mismatch from lzss: %x\n", size);
 		return -1;
 	}
 
-	if (__builtin_bswap32 (kernel_header->adler32) != Adler32 (decompressedKernel, uncompressed_size)) {
+	if (__builtin_bswap32 (kernel_header->adler32) != adler) {
 		printf ("decompress_kernel: adler mismatch\n");
 		return -1;
 	}
@@ -861,9 +1591,10 @@ kcache_decompress_kernel (void *compressedKernel, void *decompressedKernel, int
 }
 
 float
-kcache_get_ios_version (void)
+kcache_get_ios_version (struct kcache_ctx *ctx)
 {
-	float current_version = atof (kcache_get_darwin_version ());
+	char *darwin_version = kcache_get_darwin_version (ctx);
+	float current_version = darwin_version ? atof (darwin_version) : 0;
 	struct kernel_interval *interval = &intervals[0];
 	while (interval->os_version != -1) {
 		if (current_version >= interval->low_bound && current_version <= interval->high_bound)
@@ -875,12 +1606,12 @@ kcache_get_ios_version (void)
 }
 
 char *
-kcache_get_darwin_version (void)
+kcache_get_darwin_version (struct kcache_ctx *ctx)
 {
 	int i, len;
 	char versbuf[20];
 	char *versionpos;
-	char *version_str = (char *) memmem (current_image.image, current_image.size,
+	char *version_str = (char *) memmem (ctx->image.image, ctx->image.size,
 										 "Darwin Kernel Version",
 										 sizeof ("Darwin Kernel Version") - 1);
 	if (!version_str)
@@ -919,59 +1650,38 @@ kcache_get_darwin_version (void)
 /*
  * Fix MobileSubstrate entitlements.
  */
-static int
-kcache_ios7_mspatch (uint32_t region, uint8_t * kdata, size_t ksize)
+static uint32_t
+kcache_ios7_mspatch (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize)
 {
-	// 00 2F 15 D1 BA 69
-	const struct find_search_mask search_masks[] = {
-		{0xFFFF, 0x2F00},
-		{0xFF00, 0xD100},
-		{0xFFFF, 0x69BA},
-	};
-
-	uint16_t *insn = find_with_search_mask (region, kdata, ksize, sizeof (search_masks) / sizeof (*search_masks), search_masks);
+	uint16_t *insn = find_with_search_mask_matcher (ctx, region, kdata, ksize, &ios7_mspatch_search);
 	if (!insn)
 		return 0;
 
 	return (int) ((uintptr_t) insn - (uintptr_t) kdata) + 2;
 }
 
-static int
-kcache_ios7_i_can_has_debugger (uint32_t region, uint8_t * kdata, size_t ksize)
+static uint32_t
+kcache_ios7_i_can_has_debugger (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize)
 {
-	const struct find_search_mask search_masks[] = {
-		{0xFFFF, 0x4478},		/* ADD r0, PC */
-		{0xFFFF, 0xF8D0},		/* LDR r0, [r0, #val] */
-		{0xFFF0, 0x0F20},		/* LDR r0, [r0, #val] cont */
-		{0xFFFF, 0x4770},		/* BX lr */
-	};
-
-	uint16_t *insn = find_with_search_mask (region, kdata, ksize, sizeof (search_masks) / sizeof (*search_masks), search_masks);
+	uint16_t *insn = find_with_search_mask_matcher (ctx, region, kdata, ksize, &ios7_i_can_has_debugger_search);
 	if (!insn)
 		return 0;
 
 	return (int) ((uintptr_t) insn - (uintptr_t) kdata) + 2;
 }
 
-static int
-kcache_ios7_debugger_enabled (uint32_t region, uint8_t * kdata, size_t ksize)
+static uint32_t
+kcache_ios7_debugger_enabled (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize)
 {
-	const struct find_search_mask search_masks[] = {
-		{0xFFFF, 0x2800},		/* CMP r0, #0 */
-		{0xFFFF, 0xBF18},		/* IT ne */
-		{0xFFFF, 0x2001},		/* MOVne r0, #1 */
-		{0xFFFF, 0xF8C1},		/* STR r0, [r1, #val] */
-	};
-
-	uint16_t *insn = find_with_search_mask (region, kdata, ksize, sizeof (search_masks) / sizeof (*search_masks), search_masks);
+	uint16_t *insn = find_with_search_mask_matcher (ctx, region, kdata, ksize, &ios7_debugger_enabled_search);
 	if (!insn)
 		return 0;
 
 	return (int) ((uintptr_t) insn - (uintptr_t) kdata) + 2;
 }
 
-static int
-kcache_ios7_tfp0 (uint32_t region, uint8_t * kdata, size_t ksize)
+static uint32_t
+kcache_ios7_tfp0 (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize)
 {
 	// Find the task_for_pid function
 	const uint8_t search[] = { 0x58, 0x46, 0x51, 0x46, 0x90, 0x47, 0x31, 0x46 };
@@ -980,7 +1690,7 @@ kcache_ios7_tfp0 (uint32_t region, uint8_t * kdata, size_t ksize)
 		return 0;
 
 	// Find the beginning of it
-	uint16_t *fn_start = find_last_insn_matching (region, kdata, ksize, fn, insn_is_preamble_push);
+	uint16_t *fn_start = find_function_start (ctx, region, kdata, ksize, fn, insn_is_preamble_push);
 	if (!fn_start)
 		return 0;
 
@@ -988,13 +1698,7 @@ kcache_ios7_tfp0 (uint32_t region, uint8_t * kdata, size_t ksize)
 	int found = 0;
 	uint16_t *current_instruction = fn_start;
 	{
-		const struct find_search_mask search_masks[] = {
-			{0xFFF0, 0xF1B0},	/* CMP.w Rx, #0 */
-			{0xFFFF, 0x0F00},
-			{0xFFFF, 0xF000},	/* BEQ ... */
-		};
-
-		uint16_t *insn = find_with_search_mask (region, (uint8_t *) fn_start, 0x100, sizeof (search_masks) / sizeof (*search_masks), search_masks);
+		uint16_t *insn = find_with_search_mask_matcher (ctx, region, (uint8_t *) fn_start, 0x100, &ios7_tfp0_pid_check_search);
 		if (insn)
 			found = 1;
 		current_instruction = insn;
@@ -1010,17 +1714,11 @@ kcache_ios7_tfp0 (uint32_t region, uint8_t * kdata, size_t ksize)
 
 // NOP out the conditional branch here.
 static uint32_t
-kcache_ios7_vme (uint32_t region, uint8_t * kdata, size_t ksize)
+kcache_ios7_vme (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize)
 {
-	const struct find_search_mask search_masks[] = {
-		{0xFFFF, 0xBF08},		/* IT eq */
-		{0xFFF0, 0xF020},		/* BICeq Rx, Ry, #4 */
-		{0xF0FF, 0x0004},
-		{0xF8FF, 0x2800}		/* CMP Rx, #0 */
-	};
 	int found = 0;
 
-	uint16_t *insn = find_with_search_mask (region, kdata, ksize, sizeof (search_masks) / sizeof (*search_masks), search_masks);
+	uint16_t *insn = find_with_search_mask_matcher (ctx, region, kdata, ksize, &ios7_vme_search);
 	if (!insn)
 		return 0;
 
@@ -1034,7 +1732,7 @@ kcache_ios7_vme (uint32_t region, uint8_t * kdata, size_t ksize)
 			break;
 		}
 
-		current_instruction += insn_is_32bit (current_instruction) ? 2 : 1;
+		current_instruction = insn_next (&ctx->insn_map, current_instruction);
 	}
 	if (!found)
 		return 0;
@@ -1044,17 +1742,9 @@ kcache_ios7_vme (uint32_t region, uint8_t * kdata, size_t ksize)
 
 // NOP out the conditional branch here.
 static uint32_t
-kcache_ios7_mount_common (uint32_t region, uint8_t * kdata, size_t ksize)
-{
-	const struct find_search_mask search_masks[] = {
-		{0xFFFF, 0xF04F},		/* MOV Rx, #1 */
-		{0xFF00, 0x0A00},
-		{0xFFFF, 0xBF08},		/* IT eq */
-		{0xFFF0, 0xF440},		/* ORReq Rx, Ry, #0x10000 */
-		{0xFFFF, 0x3580}
-	};
-
-	uint16_t *insn = find_with_search_mask (region, kdata, ksize, sizeof (search_masks) / sizeof (*search_masks), search_masks);
+kcache_ios7_mount_common (struct kcache_ctx *ctx, uint32_t region, uint8_t * kdata, size_t ksize)
+{
+	uint16_t *insn = find_with_search_mask_matcher (ctx, region, kdata, ksize, &ios7_mount_common_search);
 	if (!insn)
 		return 0;
 
@@ -1066,7 +1756,7 @@ kcache_ios7_mount_common (uint32_t region, uint8_t * kdata, size_t ksize)
 // it to be allowed if it is outside of /private/var/mobile, or inside of /private/var/mobile/Library/Preferences but not /private/var/mobile/Library/Preferences/com.apple*
 // To force it to allow, *r0 = 0 and *(r0 + 0x4) = 0x18. If not, just call the original function via the trampoline.
 static uint32_t
-kcache_ios7_sb(uint32_t region, uint8_t* kdata, size_t ksize)
+kcache_ios7_sb(struct kcache_ctx* ctx, uint32_t region, uint8_t* kdata, size_t ksize)
 {
     // Find location of the "control_name" string.
     uint8_t* control_name = memmem(kdata, ksize, "control_name", sizeof("control_name"));
@@ -1074,54 +1764,226 @@ kcache_ios7_sb(uint32_t region, uint8_t* kdata, size_t ksize)
         return 0;
 
     // Find a reference to the "control_name" string.
-    uint16_t* ref = find_literal_ref(region, kdata, ksize, (uint16_t*) kdata, (uintptr_t)control_name - (uintptr_t)kdata);
+    uint16_t* ref = find_literal_ref(ctx, region, kdata, ksize, (uint16_t*) kdata, (uintptr_t)control_name - (uintptr_t)kdata);
     if(!ref)
         return 0;
 
     // Find the start of the function referencing "control_name"
-    uint16_t* fn_start = ref;
-    while(1)
-    {
-        fn_start = find_last_insn_matching(region, kdata, ksize, fn_start, insn_is_push);
-        if(!fn_start)
-            return 0;
-
-        uint16_t registers = insn_push_registers(fn_start);
-        // We match PUSH {R0, R1} as well to detect an already patched version.
-        if((registers & (1 << 14)) != 0 || (registers & (1 << 0 | 1 << 1)) == (1 << 0 | 1 << 1))
-            break;
-    }
+    uint16_t* fn_start = find_function_start(ctx, region, kdata, ksize, ref, insn_is_sb_entry_push);
+    if(!fn_start)
+        return 0;
 
     return ((uintptr_t)fn_start) - ((uintptr_t)kdata);
 }
 
 
-static inline uint8_t *
-kcache_off2pat_patch (int offset, uint8_t * patch, int bufsize, int patchsize)
+typedef uint32_t (*kcache_finder_t) (struct kcache_ctx * ctx, uint32_t region, uint8_t * kdata, size_t ksize);
+
+/*
+ * A finder and the patch its result becomes. Finders that only look at
+ * code around their site can be seeded; the others need the whole image.
+ * symbol names the function the site is in, for kernels that still carry
+ * a symbol table. scope says where the site lives: the kernel's own
+ * __TEXT,__text, the __TEXT of the prelinked kext named by kext, or
+ * anywhere in the image.
+ */
+enum
+{
+	KCACHE_SCOPE_ALL,
+	KCACHE_SCOPE_KERNEL,
+	KCACHE_SCOPE_KEXT
+};
+
+struct kcache_finder_task
+{
+	const char *name;
+	const char *patch;
+	kcache_finder_t finder;
+	boolean_t seedable;
+	const char *symbol;
+	int scope;
+	const char *kext;
+	uint32_t result;
+	boolean_t seeded;
+};
+
+struct kcache_finder_pool
+{
+	struct kcache_ctx *ctx;
+	struct kcache_finder_task *tasks;
+	int count;
+	int next;
+};
+
+/*
+ * Virtual address of an image offset, passed to the finders as their
+ * region. Offsets outside every segment keep the fixed kernel base.
+ */
+static uint32_t
+kcache_region (struct kcache_ctx *ctx, uint32_t offset)
+{
+	uint32_t va;
+
+	if (macho_offset_to_va (&ctx->macho, offset, &va) == kLoadSuccess)
+		return va;
+	return KERNEL_VMADDR + offset;
+}
+
+/*
+ * The part of the image a task's scope covers. Fails for KCACHE_SCOPE_ALL
+ * and when the image does not have the section or the kext.
+ */
+static int
+kcache_scope_range (struct kcache_ctx *ctx, struct kcache_finder_task *task, uint32_t * va, uint32_t * start, uint32_t * length)
+{
+	const struct prelink_kext *kext;
+	const macho_range_t *text;
+
+	switch (task->scope) {
+	case KCACHE_SCOPE_KERNEL:
+		if (!(text = macho_find_section (&ctx->macho, kSegTextName, "__text")) || !text->filesize)
+			return -ENOENT;
+		*va = text->vmaddr;
+		*start = text->fileoff;
+		*length = text->filesize;
+		break;
+	case KCACHE_SCOPE_KEXT:
+		if (!(kext = prelink_find_kext (&ctx->kexts, task->kext)) || !kext->size)
+			return -ENOENT;
+		*va = kext->vmaddr;
+		*start = kext->offset;
+		*length = kext->size;
+		break;
+	default:
+		return -ENOENT;
+	}
+
+	if (*start >= ctx->image.size || *length > ctx->image.size - *start)
+		return -ERANGE;
+	return 0;
+}
+
+/*
+ * Search the seeded window first, then the function named by the task's
+ * symbol, then the task's scope, and the whole image if none of them
+ * turns up a site. The kernel's __text comes first in the file, so a hit
+ * there is the one a whole-image search would have returned.
+ */
+static uint32_t
+kcache_run_finder (struct kcache_ctx *ctx, struct kcache_finder_task *task)
+{
+	uint32_t start, length, result, va;
+
+	task->seeded = FALSE;
+	if (task->seedable && !patch_seed_window (ctx->seed, task->patch, &start, &length)) {
+		result = task->finder (ctx, kcache_region (ctx, start), ctx->image.image + start, length);
+		if (result && !patch_seed_check (ctx->seed, task->patch, ctx->image.image, ctx->image.size, start + result)) {
+			task->seeded = TRUE;
+			return start + result;
+		}
+	}
+
+	if (task->symbol && macho_find_symbol (&ctx->macho, task->symbol, &va, &length) == kLoadSuccess
+		&& macho_va_to_offset (&ctx->macho, va, &start) == kLoadSuccess && length && length <= ctx->image.size - start) {
+		result = task->finder (ctx, va, ctx->image.image + start, length);
+		if (result)
+			return start + result;
+	}
+
+	if (!kcache_scope_range (ctx, task, &va, &start, &length)) {
+		result = task->finder (ctx, va, ctx->image.image + start, length);
+		if (result)
+			return start + result;
+	}
+
+	return task->finder (ctx, kcache_region (ctx, 0), ctx->image.image, ctx->image.size);
+}
+
+static void *
+kcache_finder_worker (void *arg)
 {
-	uint8_t *buffer = (uint8_t *) _xmalloc (bufsize);
-	memcpy (buffer, current_image.image + offset, bufsize);
-	memcpy (buffer, patch, patchsize);
-	return buffer;
+	struct kcache_finder_pool *pool = (struct kcache_finder_pool *) arg;
+	int i;
+
+	while ((i = __sync_fetch_and_add (&pool->next, 1)) < pool->count)
+		pool->tasks[i].result = kcache_run_finder (pool->ctx, &pool->tasks[i]);
+
+	return NULL;
 }
 
+/*
+ * The finders only read the image, so they run side by side on a small
+ * pool of threads. Every task writes its own slot, so the results come out
+ * in table order no matter which thread finished first.
+ * KCACHE_FINDER_THREADS in the environment overrides the pool size.
+ */
 static void
-kcache_ios7_dynapatch (void)
+kcache_run_finders (struct kcache_ctx *ctx, struct kcache_finder_task *tasks, int count)
 {
+	struct kcache_finder_pool pool = { ctx, tasks, count, 0 };
+	pthread_t threads[16];
+	long nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+	int i, started = 0;
+
+	if (getenv ("KCACHE_FINDER_THREADS"))
+		nthreads = atoi (getenv ("KCACHE_FINDER_THREADS"));
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads > (long) (sizeof (threads) / sizeof (*threads)))
+		nthreads = sizeof (threads) / sizeof (*threads);
+
+	/*
+	 * Resolve the lazily picked scanner before anything runs concurrently.
+	 */
+	pthread_once (&search_mask_once, find_with_search_mask_select);
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create (&threads[started], NULL, kcache_finder_worker, &pool))
+			break;
+		started++;
+	}
+
+	kcache_finder_worker (&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join (threads[i], NULL);
+
+	if (ctx->seed) {
+		for (i = 0; i < count; i++) {
+			if (tasks[i].seedable)
+				patch_seed_count (ctx->seed, tasks[i].seeded);
+		}
+		patch_seed_report (ctx->seed);
+	}
+}
+
+static int
+kcache_ios7_dynapatch (struct kcache_ctx *ctx)
+{
+	struct kcache_finder_task finders[] = {
+		{"MobileSubstrate fix", "MobileSubstrate entitlement fix", kcache_ios7_mspatch, TRUE, NULL, KCACHE_SCOPE_KEXT, "com.apple.driver.AppleMobileFileIntegrity"},
+		{"PE_I_can_has_debugger", "PE_I_can_has_debugger", kcache_ios7_i_can_has_debugger, TRUE, "_PE_i_can_has_debugger", KCACHE_SCOPE_KERNEL},
+		{"debugger_enabled", "Debugger enabled", kcache_ios7_debugger_enabled, TRUE, NULL, KCACHE_SCOPE_KERNEL},
+		{"task_for_pid 0", "task_for_pid 0", kcache_ios7_tfp0, TRUE, "_task_for_pid", KCACHE_SCOPE_KERNEL},
+		{"vm_map_enter", "vm_map_enter", kcache_ios7_vme, TRUE, "_vm_map_enter", KCACHE_SCOPE_KERNEL},
+		{"mount_common", "mount_common RW support", kcache_ios7_mount_common, TRUE, "_mount_common", KCACHE_SCOPE_KERNEL},
+		{"sandbox", "sandbox patch", kcache_ios7_sb, FALSE, NULL, KCACHE_SCOPE_KEXT, "com.apple.security.sandbox"},
+	};
 	int mspatch = 0, pedebugger = 0, debugger = 0, tfp0 = 0, vme = 0, mcommon = 0, sbox = 0;
 
 	printf ("Patching kernel...\n");
-	mspatch = kcache_ios7_mspatch (KERNEL_VMADDR, current_image.image, current_image.size);
-	pedebugger = kcache_ios7_i_can_has_debugger (KERNEL_VMADDR, current_image.image, current_image.size);
-	debugger = kcache_ios7_debugger_enabled (KERNEL_VMADDR, current_image.image, current_image.size);
-	tfp0 = kcache_ios7_tfp0 (KERNEL_VMADDR, current_image.image, current_image.size);
-	vme = kcache_ios7_vme (KERNEL_VMADDR, current_image.image, current_image.size);
-	mcommon = kcache_ios7_mount_common (KERNEL_VMADDR, current_image.image, current_image.size);
-	sbox = kcache_ios7_sb (KERNEL_VMADDR, current_image.image, current_image.size);
+	kcache_run_finders (ctx, finders, sizeof (finders) / sizeof (*finders));
+	mspatch = finders[0].result;
+	pedebugger = finders[1].result;
+	debugger = finders[2].result;
+	tfp0 = finders[3].result;
+	vme = finders[4].result;
+	mcommon = finders[5].result;
+	sbox = finders[6].result;
 
 	if (!mspatch || !pedebugger || !debugger || !tfp0 || !vme || !mcommon || !sbox) {
 		warn ("failed to find one or more patches, aborting!");
-		return;
+		return -1;
 	}
 
 	printf ("MobileSubstrate fix patch at %x.\n", mspatch);
@@ -1145,127 +2007,162 @@ kcache_ios7_dynapatch (void)
 	/*
 	 * Convert the conditional branch into an unconditional one. 
 	 */
-	memcpy (fixup, current_image.image + vme, 4);
+	memcpy (fixup, ctx->image.image + vme, 4);
 	fixup[1] = 0xE0;
 
-	patch_list_initialize ();
-	patch_list_add_patch ("MobileSubstrate entitlement fix", current_image.image + mspatch, kcache_off2pat_patch (mspatch, (uint8_t *) nop, 16, sizeof (nop)), 16);
-	patch_list_add_patch ("PE_I_can_has_debugger", current_image.image + pedebugger, kcache_off2pat_patch (pedebugger, (uint8_t *) movs_r0_imm1_bx_lr, 16, sizeof (movs_r0_imm1_bx_lr)), 16);
-	patch_list_add_patch ("Debugger enabled", current_image.image + debugger, kcache_off2pat_patch (debugger, (uint8_t *) movs_r0_imm1_movs_r0_imm1, 16, sizeof (movs_r0_imm1_movs_r0_imm1)), 16);
-	patch_list_add_patch ("task_for_pid 0", current_image.image + tfp0, kcache_off2pat_patch (tfp0, (uint8_t *) nop_nop, 16, sizeof (nop_nop)), 16);
-	patch_list_add_patch ("mount_common RW support", current_image.image + mcommon, kcache_off2pat_patch (mcommon, (uint8_t *) nop_nop, 16, sizeof (nop_nop)), 16);
-	patch_list_add_patch ("vm_map_enter", current_image.image + vme, kcache_off2pat_patch (vme, (uint8_t *) fixup, 16, sizeof (fixup)), 16);
-	patch_list_add_patch ("sandbox patch", current_image.image + sbox, kcache_off2pat_patch (sbox, (uint8_t *) sandbox_hack, 16, sizeof (sandbox_hack)), 16);
-	patch_list_iterate ();
+	patch_list_initialize (&ctx->plan);
+	patch_list_add_patch (&ctx->plan, "MobileSubstrate entitlement fix", mspatch, ctx->image.image + mspatch, nop, sizeof (nop));
+	patch_list_add_patch (&ctx->plan, "PE_I_can_has_debugger", pedebugger, ctx->image.image + pedebugger, movs_r0_imm1_bx_lr, sizeof (movs_r0_imm1_bx_lr));
+	patch_list_add_patch (&ctx->plan, "Debugger enabled", debugger, ctx->image.image + debugger, movs_r0_imm1_movs_r0_imm1, sizeof (movs_r0_imm1_movs_r0_imm1));
+	patch_list_add_patch (&ctx->plan, "task_for_pid 0", tfp0, ctx->image.image + tfp0, nop_nop, sizeof (nop_nop));
+	patch_list_add_patch (&ctx->plan, "mount_common RW support", mcommon, ctx->image.image + mcommon, nop_nop, sizeof (nop_nop));
+	patch_list_add_patch (&ctx->plan, "vm_map_enter", vme, ctx->image.image + vme, fixup, sizeof (fixup));
+	patch_list_add_patch (&ctx->plan, "sandbox patch", sbox, ctx->image.image + sbox, sandbox_hack, sizeof (sandbox_hack));
+	patch_list_iterate (&ctx->plan);
+	return 0;
 }
 
-static void
-kcache_patch_kernel (void)
+static int
+kcache_patch_kernel (struct kcache_ctx *ctx)
 {
-	struct patch_list *head, *iter;
-	int total_patches, i = 0, j = 0;
-	double progress = 0.0;
+	int error;
+
 	printf ("Patching kernel *NOW*...\n");
 
-	if (patch_list_get_head (&head, &total_patches)) {
-		warn ("failed to get patch list head\n");
-		return;
+	if ((error = image_file_patch (&ctx->file, &ctx->plan)) < 0)
+		warnx ("failed to apply patch list");
+	return error < 0 ? error : 0;
+}
+
+/*
+ * Build everything the finders search through. Only needed when the
+ * plan cache misses, so it is left out of kcache_map_file().
+ */
+static int
+kcache_analyze (struct kcache_ctx *ctx)
+{
+	if (macho_map_build (&ctx->macho, ctx->image.image, ctx->image.size) != kLoadSuccess) {
+		warnx ("cannot index the kernel's load commands and symbols");
+		return -1;
 	}
 
 	/*
-	 * Patch it!
+	 * A bare kernel has no __PRELINK_INFO, its kext finders search
+	 * everything.
 	 */
-	for (iter = head, i = 0; i < total_patches; iter = iter->next, i++) {
-		for (j = 0; j < current_image.size; j++) {
-			if (!memcmp (current_image.image + j, iter->patch.original, iter->patch.size)) {
-				memcpy (current_image.image + j, iter->patch.patched, iter->patch.size);
-				progress = ((i + 1) / (double) total_patches) * 100.0;
-				printf ("%4.1f%% done. [(%d/%d) %-32.32s]\r", progress, i + 1, total_patches, iter->patch.name);
-				fflush (stdout);
-			}
-		}
-	}
-	printf ("\n");
+	if (!prelink_index_build (&ctx->kexts, &ctx->macho, ctx->image.image, ctx->image.size))
+		printf ("%d prelinked kexts indexed\n", ctx->kexts.count);
+
+	insn_boundary_map_build (ctx);
+	function_table_build_current (ctx);
+	literal_xref_index_build (ctx);
+
+	/*
+	 * Worth it when many queries run against one image, see
+	 * kcache_build_halfword_index().
+	 */
+	if (getenv ("KCACHE_HALFWORD_INDEX"))
+		kcache_build_halfword_index (ctx);
+
+	return 0;
 }
 
 int
-kcache_dynapatch (void)
+kcache_dynapatch (struct kcache_ctx *ctx)
 {
+	int error;
+
 	printf ("starting dynapatch...\n");
 
-	switch ((int) kcache_get_ios_version ()) {
+	switch ((int) kcache_get_ios_version (ctx)) {
 	case 7:					/* iOS 7. */
-		kcache_ios7_dynapatch ();
+		if (!patch_plan_cache_lookup (KCACHE_IOS7_PLAN_TAG, ctx->image.image, ctx->image.size, &ctx->plan, ctx->digest)) {
+			patch_list_iterate (&ctx->plan);
+			break;
+		}
+		if ((error = kcache_analyze (ctx)))
+			return error;
+		if (getenv ("PATCH_SEED"))
+			ctx->seed = patch_seed_load (KCACHE_IOS7_PLAN_TAG, getenv ("PATCH_SEED"), ctx->image.image, ctx->image.size);
+		if ((error = kcache_ios7_dynapatch (ctx))) {
+			warnx ("kernel patch finders failed, not patching");
+			return error;
+		}
+		patch_plan_cache_store (KCACHE_IOS7_PLAN_TAG, ctx->image.image, ctx->image.size, &ctx->plan, ctx->digest);
 		break;
 	default:
-		warn ("iOS %.1f not supported yet for kernel patcher", kcache_get_ios_version ());
+		warn ("iOS %.1f not supported yet for kernel patcher", kcache_get_ios_version (ctx));
 		return -1;
 	}
 
-	kcache_patch_kernel ();
-	return 0;
+	return kcache_patch_kernel (ctx);
 }
 
 int
-kcache_write_file (const char *filename)
+kcache_write_file (struct kcache_ctx *ctx, const char *filename)
 {
-	struct stat buf;
-	FILE *fp = fopen (filename, "wb");
-
-	if (!fp)
-		return -ENOENT;
-	if (stat (filename, &buf) > 0)
-		return -ENOENT;
-
-	fwrite ((void *) current_image.image, current_image.size, 1, fp);
-	fclose (fp);
+	return image_file_write (&ctx->file, filename);
+}
 
-	free (current_image.image);
-	current_image.image = NULL;
-	current_image.size = 0;
+/*
+ * Release a context and everything built for its image.
+ */
+void
+kcache_close (struct kcache_ctx *ctx)
+{
+	if (!ctx)
+		return;
 
-	return 0;
+	image_file_close (&ctx->file);
+	halfword_index_free (&ctx->index);
+	insn_boundary_map_free (&ctx->insn_map);
+	literal_xref_index_free (&ctx->xrefs);
+	function_table_free (&ctx->functions);
+	prelink_index_free (&ctx->kexts);
+	macho_map_free (&ctx->macho);
+	patch_list_free (&ctx->plan);
+	patch_seed_free (ctx->seed);
+	free (ctx);
 }
 
 int
-kcache_map_file (const char *filename)
+kcache_map_file (struct kcache_ctx **ctxp, const char *filename)
 {
-	struct stat buf;
 #if USE_KERNELCACHE
 	int decompressed_size = 0;
 	void *decompressed;
 #endif
 	uint32_t kernel_entrypoint;
-	loader_context_t ctx;
-
-	FILE *fp = fopen (filename, "rb");
-
-	if (!fp)
-		return -ENOENT;
-	if (stat (filename, &buf) > 0)
-		return -ENOENT;
-
-	current_image.image = (uint8_t *) _xmalloc (buf.st_size);
-	current_image.size = buf.st_size;
-	fread ((void *) current_image.image, buf.st_size, 1, fp);
-	fclose (fp);
+	loader_context_t loader;
+	struct kcache_ctx *ctx;
+	int error;
+
+	ctx = (struct kcache_ctx *) _xmalloc (sizeof (struct kcache_ctx));
+	if ((error = image_file_open (&ctx->file, filename)) != 0) {
+		free (ctx);
+		return error;
+	}
+	ctx->image.image = ctx->file.data;
+	ctx->image.size = ctx->file.size;
 
 #if USE_KERNELCACHE				/* Just use MachOs directly. */
-	if (kcache_decompress_kernel (current_image.image, NULL, &decompressed_size)) {
-		free (current_image.image);
+	if (kcache_decompress_kernel (ctx->image.image, NULL, &decompressed_size)) {
+		kcache_close (ctx);
 		return -1;
 	}
 
 	printf ("decompressed kernelcache size %d\n", decompressed_size);
 	decompressed = _xmalloc (decompressed_size);
-	if (kcache_decompress_kernel (current_image.image, decompressed, &decompressed_size)) {
+	if (kcache_decompress_kernel (ctx->image.image, decompressed, &decompressed_size)) {
 		free (decompressed);
+		kcache_close (ctx);
 		return -1;
 	}
-	free (current_image.image);
+	image_file_close (&ctx->file);
+	image_file_from_buffer (&ctx->file, decompressed, decompressed_size, TRUE);
 
-	current_image.image = (uint8_t *) decompressed;
-	current_image.size = decompressed_size;
+	ctx->image.image = (uint8_t *) decompressed;
+	ctx->image.size = decompressed_size;
 #endif
 
 	/*
@@ -1275,16 +2172,18 @@ kcache_map_file (const char *filename)
 	do {							\
 		if(!(x)) {					\
 			warn(#x " failed");		\
+			kcache_close (ctx);		\
 			return -1;				\
 		}							\
 	} while(0);
 
-	mach_assert (!macho_initialize (&ctx, (void *) current_image.image));
-	mach_assert (!macho_set_vm_bias (&ctx, KERNEL_VMADDR));
-	mach_assert (!macho_file_map (&ctx, 0, 0));
-	mach_assert (!macho_get_entrypoint (&ctx, &kernel_entrypoint));
+	mach_assert (!macho_initialize (&loader, (void *) ctx->image.image));
+	mach_assert (!macho_set_vm_bias (&loader, KERNEL_VMADDR));
+	mach_assert (!macho_file_map (&loader, 0, 0));
+	mach_assert (!macho_get_entrypoint (&loader, &kernel_entrypoint));
 	mach_assert (kernel_entrypoint > KERNEL_VMADDR);
 #undef mach_assert
 
+	*ctxp = ctx;
 	return 0;
 }
@@ -0,0 +1,217 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Checks the SSE2 and AVX2 search mask scanners, interpreted and generated,
+ * against the scalar one. Run by "make check". The seed is fixed so runs
+ * repeat; pass another one as the argument to explore.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "kcache_scan.h"
+
+/*
+ * A table to check the scanners with: either one of the generated
+ * matchers, or random masks run through the interpreted scanners only.
+ */
+struct search_mask_check
+{
+	const char *name;
+	const struct find_search_mask *masks;
+	int num_masks;
+	const struct search_mask_matcher *matcher;
+};
+
+static const char *search_mask_level_names[SEARCH_MASK_LEVELS] = { "scalar", "sse2", "avx2" };
+
+static uint32_t
+search_mask_check_random (uint32_t * state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/* The mask the vector scanners test first, picked as search_mask_key() does. */
+static int
+search_mask_check_key (const struct search_mask_check *check)
+{
+	int i, key = 0;
+
+	for (i = 1; i < check->num_masks; i++) {
+		if (__builtin_popcount (check->masks[i].mask) > __builtin_popcount (check->masks[key].mask))
+			key = i;
+	}
+	return key;
+}
+
+/*
+ * Fill count halfwords at buffer. Random fill rarely matches anything; the
+ * adversarial fill satisfies the key mask everywhere, so the vector loops
+ * hand every position to the verify step and most of them fail it.
+ */
+static void
+search_mask_check_fill (uint16_t * buffer, size_t count, const struct search_mask_check *check, int adversarial, uint32_t * state)
+{
+	int key = search_mask_check_key (check);
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		buffer[i] = search_mask_check_random (state);
+		if (adversarial)
+			buffer[i] = (buffer[i] & ~check->masks[key].mask) | check->masks[key].value;
+	}
+}
+
+static void
+search_mask_check_plant (uint8_t * at, const struct search_mask_check *check, uint32_t * state)
+{
+	uint16_t halfword;
+	int i;
+
+	for (i = 0; i < check->num_masks; i++) {
+		halfword = (search_mask_check_random (state) & ~check->masks[i].mask) | check->masks[i].value;
+		memcpy (at + i * sizeof (uint16_t), &halfword, sizeof (halfword));
+	}
+}
+
+/*
+ * Run every scanner up to levels over kdata and compare each one with
+ * the scalar reference. Returns the number of scanners that disagree.
+ */
+static int
+search_mask_check_scan (const struct search_mask_check *check, uint8_t * kdata, size_t ksize, const char *fill, int levels)
+{
+	uint16_t *expected, *result;
+	int level, failures = 0;
+
+	expected = search_mask_scanners[SEARCH_MASK_SCALAR] (kdata, ksize, check->num_masks, check->masks);
+	for (level = 0; level < SEARCH_MASK_LEVELS; level++) {
+		if (level > levels || !search_mask_scanners[level])
+			break;
+		result = search_mask_scanners[level] (kdata, ksize, check->num_masks, check->masks);
+		if (result != expected) {
+			warnx ("%s: %s scanner returned %p, expected %p (%s, start %u, size %zu)", check->name, search_mask_level_names[level], result, expected, fill,
+			    (uint32_t) ((uintptr_t) kdata & 31), ksize);
+			failures++;
+		}
+		if (!check->matcher)
+			continue;
+		result = check->matcher->scan[level] (kdata, ksize);
+		if (result != expected) {
+			warnx ("%s: generated %s scanner returned %p, expected %p (%s, start %u, size %zu)", check->name, search_mask_level_names[level], result, expected,
+			    fill, (uint32_t) ((uintptr_t) kdata & 31), ksize);
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+#define SEARCH_MASK_CHECK_HALFWORDS		160
+#define SEARCH_MASK_CHECK_RANDOM_TABLES	64
+#define SEARCH_MASK_CHECK_SEED			0x736e3077
+
+static int
+search_mask_check_table (const struct search_mask_check *check, uint32_t * state, int levels, int *cases)
+{
+	size_t length = SEARCH_MASK_CHECK_HALFWORDS * sizeof (uint16_t);
+	uint16_t buffer[SEARCH_MASK_CHECK_HALFWORDS + 32];
+	uint8_t *base = (uint8_t *) buffer;
+	size_t start, ksize, at;
+	int adversarial, failures = 0;
+
+	for (adversarial = 0; adversarial < 2; adversarial++) {
+		const char *fill = adversarial ? "adversarial" : "random";
+
+		for (start = 0; start < 32; start++) {
+			/* Every size from empty to the whole buffer, so every tail length is hit. */
+			search_mask_check_fill (buffer, SEARCH_MASK_CHECK_HALFWORDS + 32, check, adversarial, state);
+			for (ksize = 0; ksize <= length; ksize++, (*cases)++)
+				failures += search_mask_check_scan (check, base + start, ksize, fill, levels);
+
+			/* One planted match at every position, the first hit must win. */
+			for (at = 0; at + check->num_masks * sizeof (uint16_t) <= length; at += sizeof (uint16_t), (*cases)++) {
+				search_mask_check_fill (buffer, SEARCH_MASK_CHECK_HALFWORDS + 32, check, adversarial, state);
+				search_mask_check_plant (base + start + at, check, state);
+				failures += search_mask_check_scan (check, base + start, length, fill, levels);
+				failures += search_mask_check_scan (check, base + start, at + check->num_masks * sizeof (uint16_t), fill, levels);
+			}
+		}
+	}
+
+	return failures;
+}
+
+/*
+ * Check that the SSE2 and AVX2 scanners, interpreted and generated, find
+ * the same first hit as the scalar reference for every table in
+ * kcache_masks.def and a set of random tables. Buffers start at every
+ * alignment within a vector and are cut to every length. Every level the
+ * CPU supports is checked, whatever the environment selects.
+ */
+static int
+search_mask_check (uint32_t seed)
+{
+	struct find_search_mask masks[4];
+	struct search_mask_check check;
+	uint32_t state = seed ? seed : SEARCH_MASK_CHECK_SEED;
+	int i, j, cases = 0, failures = 0;
+	int levels = search_mask_cpu_level ();
+
+	for (i = 0; i < search_mask_matcher_count; i++) {
+		check.name = search_mask_matchers[i]->name;
+		check.masks = search_mask_matchers[i]->masks;
+		check.num_masks = search_mask_matchers[i]->num_masks;
+		check.matcher = search_mask_matchers[i];
+		failures += search_mask_check_table (&check, &state, levels, &cases);
+	}
+
+	for (i = 0; i < SEARCH_MASK_CHECK_RANDOM_TABLES; i++) {
+		check.name = "random";
+		check.masks = masks;
+		check.num_masks = 1 + i % 4;
+		check.matcher = NULL;
+		for (j = 0; j < check.num_masks; j++) {
+			masks[j].mask = search_mask_check_random (&state);
+			masks[j].value = search_mask_check_random (&state) & masks[j].mask;
+		}
+		failures += search_mask_check_table (&check, &state, levels, &cases);
+	}
+
+	printf ("search mask check: %d cases up to %s, seed %u, %d mismatches\n", cases, search_mask_level_names[levels], seed, failures);
+	return failures ? -1 : 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	uint32_t seed = argc >= 2 ? strtoul (argv[1], NULL, 0) : SEARCH_MASK_CHECK_SEED;
+
+	return search_mask_check (seed) ? 1 : 0;
+}
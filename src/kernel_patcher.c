@@ -36,20 +36,48 @@
 #include "util.h"
 #include "macho_loader.h"
 #include "kcache.h"
+#include "batch.h"
+
+static int
+kernel_patcher_job (const char *in, const char *out)
+{
+	kcache_ctx_t *ctx;
+	int ret;
+
+	if (kcache_map_file (&ctx, in))
+		return BATCH_JOB_LOAD_FAILED;
+	printf ("xnu-%s\n", kcache_get_darwin_version (ctx));
+	printf ("iOS %.1f\n", kcache_get_ios_version (ctx));
+	if (getenv ("KCACHE_BENCH_MASKS"))
+		kcache_benchmark_search_masks (ctx, atoi (getenv ("KCACHE_BENCH_MASKS")));
+	if (getenv ("KCACHE_BENCH_LZSS"))
+		kcache_benchmark_lzss (ctx, atoi (getenv ("KCACHE_BENCH_LZSS")));
+	if (kcache_dynapatch (ctx))
+		ret = BATCH_JOB_PATCH_FAILED;
+	else
+		ret = kcache_write_file (ctx, out) ? BATCH_JOB_WRITE_FAILED : BATCH_JOB_OK;
+	kcache_close (ctx);
+	return ret;
+}
 
 int
 main (int argc, char *argv[])
 {
+	if (argc >= 2 && !strcmp (argv[1], "-b")) {
+		/*
+		 * Images already run in parallel, keep each one to a single finder thread.
+		 */
+		setenv ("KCACHE_FINDER_THREADS", "1", 0);
+		return batch_main (argv[0], argc, argv, kernel_patcher_job);
+	}
+
 	if (argc != 3) {
 		printf ("usage: %s [in] [out]\n", argv[0]);
+		printf ("       %s -b [-j jobs] [manifest|directory] [outdir]\n", argv[0]);
 		return -1;
 	}
 
-	assert (kcache_map_file (argv[1]) == 0);
-	printf ("xnu-%s\n", kcache_get_darwin_version ());
-	printf ("iOS %.1f\n", kcache_get_ios_version ());
-	assert (kcache_dynapatch () == 0);
-	assert (kcache_write_file (argv[2]) == 0);
+	assert (kernel_patcher_job (argv[1], argv[2]) == 0);
 
 	return 0;
 }
@@ -0,0 +1,304 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Round trip checks for the LZSS encoders in libsn0wcore/lzss.c. Run by
+ * "make check". Every stream is decoded again and must give back the
+ * input and its Adler-32. The inputs come from a fixed seed, so runs
+ * repeat.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#include <xpwn/lzss.h>
+#include "util.h"
+
+#define LZSS_CHECK_SEED		0x6c7a7373
+#define LZSS_CHECK_SEGMENT	(1 << 20)	/* SEGMENT_MIN in lzss.c */
+#define LZSS_CHECK_THRESHOLD	2		/* THRESHOLD in lzss.c */
+
+static uint32_t
+lzss_check_random (uint32_t * state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/*
+ * Input that gives every encoder something to do: stretches of random
+ * bytes, repeated phrases at varying distances and runs of one byte.
+ */
+static void
+lzss_check_fill (uint8_t * buffer, uint32_t size, uint32_t * state)
+{
+	uint32_t i = 0, length, distance;
+
+	while (i < size) {
+		length = 1 + lzss_check_random (state) % 300;
+		if (length > size - i)
+			length = size - i;
+
+		switch (lzss_check_random (state) % 3) {
+		case 0:
+			while (length--)
+				buffer[i++] = lzss_check_random (state);
+			break;
+		case 1:
+			distance = 1 + lzss_check_random (state) % 5000;
+			for (; length--; i++)
+				buffer[i] = i >= distance ? buffer[i - distance] : (uint8_t) i;
+			break;
+		default:
+			memset (buffer + i, lzss_check_random (state), length);
+			i += length;
+			break;
+		}
+	}
+}
+
+/*
+ * Walk the tokens of a stream and return the index of the one that starts
+ * at output offset at, or -1 if no token does.
+ */
+static int64_t
+lzss_check_token_at (const uint8_t * stream, uint32_t length, uint32_t at)
+{
+	const uint8_t *p = stream, *end = stream + length;
+	uint32_t position = 0, token = 0, flags = 0;
+
+	while (p < end && position <= at) {
+		if (!(token & 7))
+			flags = *p++;
+		if (position == at)
+			return token;
+		if (p >= end)
+			break;
+		if (flags & (1 << (token & 7))) {
+			p++;
+			position++;
+		}
+		else {
+			if (end - p < 2)
+				break;
+			position += (p[1] & 0x0F) + LZSS_CHECK_THRESHOLD + 1;
+			p += 2;
+		}
+		token++;
+	}
+
+	return -1;
+}
+
+/* Decode a stream and compare it with the input. */
+static int
+lzss_check_decode (const char *what, uint8_t * stream, uint8_t * end, uint8_t * input, uint32_t size)
+{
+	uint8_t *decoded = _xmalloc (size + 1);
+	uint32_t adler;
+	int length, error = 0;
+
+	if (!end) {
+		warnx ("%s: encoder failed on %u bytes", what, size);
+		free (decoded);
+		return 1;
+	}
+	if ((uint32_t) (end - stream) > compress_lzss_bound (size)) {
+		warnx ("%s: %u bytes compressed to %u, past the bound", what, size, (uint32_t) (end - stream));
+		error = 1;
+	}
+
+	length = decompress_lzss_adler (decoded, size, stream, end - stream, &adler);
+	if (length != (int) size || memcmp (decoded, input, size)) {
+		warnx ("%s: %u bytes do not round trip (decoded %d)", what, size, length);
+		error = 1;
+	}
+	else if (adler != lzadler32 (input, size)) {
+		warnx ("%s: Adler-32 of the decoded stream is %08x, expected %08x", what, adler, lzadler32 (input, size));
+		error = 1;
+	}
+
+	free (decoded);
+	return error;
+}
+
+/* Every level, and the tree encoder, on inputs from empty to a few hundred KB. */
+static int
+lzss_check_levels (uint32_t * state)
+{
+	static const uint32_t sizes[] = { 0, 1, 2, 3, 17, 18, 19, 4095, 4096, 4097, 65536 + 7, 300000 };
+	uint8_t *input, *stream, *end;
+	uint32_t bound, i;
+	int level, failures = 0;
+	char what[32];
+
+	for (i = 0; i < sizeof (sizes) / sizeof (*sizes); i++) {
+		input = _xmalloc (sizes[i] + 1);
+		lzss_check_fill (input, sizes[i], state);
+		bound = compress_lzss_bound (sizes[i]);
+		stream = _xmalloc (bound * 2 + 1);
+
+		for (level = LZSS_LEVEL_FAST; level <= LZSS_LEVEL_BEST; level++) {
+			snprintf (what, sizeof (what), "level %d", level);
+			end = compress_lzss_level (stream, bound, input, sizes[i], level);
+			failures += lzss_check_decode (what, stream, end, input, sizes[i]);
+		}
+		/* The tree encoder has no output for empty input. */
+		if (sizes[i]) {
+			end = compress_lzss (stream, bound * 2 + 1, input, sizes[i]);
+			failures += lzss_check_decode ("tree", stream, end, input, sizes[i]);
+		}
+
+		free (stream);
+		free (input);
+	}
+
+	return failures;
+}
+
+/*
+ * The segmented encoder with an explicit thread count, on inputs of two
+ * segments and more. Segments start at every multiple of size / threads;
+ * at least one of them must start inside a flag group, so the group's bits
+ * come from two segments.
+ */
+static int
+lzss_check_parallel (uint32_t * state)
+{
+	static const struct {
+		uint32_t size;
+		int threads;
+	} cases[] = {
+		{ 2 * LZSS_CHECK_SEGMENT, 2 },
+		{ 2 * LZSS_CHECK_SEGMENT + 12345, 2 },
+		{ 3 * LZSS_CHECK_SEGMENT + 7, 3 },
+		{ 4 * LZSS_CHECK_SEGMENT + 1, 4 },
+	};
+	uint8_t *input, *stream, *end;
+	uint32_t bound, i;
+	int t, straddled = 0, failures = 0;
+	int64_t token;
+	char what[32];
+
+	for (i = 0; i < sizeof (cases) / sizeof (*cases); i++) {
+		input = _xmalloc (cases[i].size);
+		lzss_check_fill (input, cases[i].size, state);
+		bound = compress_lzss_bound (cases[i].size);
+		stream = _xmalloc (bound);
+
+		snprintf (what, sizeof (what), "parallel x%d", cases[i].threads);
+		end = compress_lzss_parallel (stream, bound, input, cases[i].size, LZSS_LEVEL_DEFAULT, cases[i].threads);
+		if (lzss_check_decode (what, stream, end, input, cases[i].size)) {
+			failures++;
+			goto next;
+		}
+
+		for (t = 1; t < cases[i].threads; t++) {
+			token = lzss_check_token_at (stream, end - stream, t * (cases[i].size / cases[i].threads));
+			if (token < 0) {
+				warnx ("%s: no token starts at segment %d", what, t);
+				failures++;
+			}
+			else if (token & 7)
+				straddled++;
+		}
+
+		/* One byte short of the stream must fail, not overrun. */
+		if (compress_lzss_parallel (stream, end - stream - 1, input, cases[i].size, LZSS_LEVEL_DEFAULT, cases[i].threads)) {
+			warnx ("%s: encoded into an undersized buffer", what);
+			failures++;
+		}
+
+	  next:
+		free (stream);
+		free (input);
+	}
+
+	if (!straddled) {
+		warnx ("parallel: no flag group straddled a segment boundary");
+		failures++;
+	}
+
+	return failures;
+}
+
+/*
+ * Destinations one byte short of the stream, or empty, must make every
+ * level return NULL without writing past their end.
+ */
+static int
+lzss_check_undersized (uint32_t * state)
+{
+	uint32_t size = 100000, bound = compress_lzss_bound (size), limit, i;
+	uint8_t *input = _xmalloc (size), *stream = _xmalloc (bound + 16);
+	uint8_t *end;
+	int level, failures = 0;
+
+	lzss_check_fill (input, size, state);
+	for (level = LZSS_LEVEL_FAST; level <= LZSS_LEVEL_BEST; level++) {
+		end = compress_lzss_level (stream, bound, input, size, level);
+		if (!end) {
+			warnx ("level %d: encoder failed on %u bytes", level, size);
+			failures++;
+			continue;
+		}
+
+		for (limit = end - stream - 1;; limit = 0) {
+			memset (stream + limit, 0xA5, 16);
+			if (compress_lzss_level (stream, limit, input, size, level)) {
+				warnx ("level %d: encoded into %u bytes, needs %u", level, limit, (uint32_t) (end - stream));
+				failures++;
+			}
+			for (i = 0; i < 16 && stream[limit + i] == 0xA5; i++) ;
+			if (i < 16) {
+				warnx ("level %d: wrote past a %u byte destination", level, limit);
+				failures++;
+			}
+			if (!limit)
+				break;
+		}
+	}
+
+	free (stream);
+	free (input);
+	return failures;
+}
+
+int
+main (int argc, char *argv[])
+{
+	uint32_t seed = argc >= 2 ? strtoul (argv[1], NULL, 0) : LZSS_CHECK_SEED;
+	uint32_t state = seed ? seed : LZSS_CHECK_SEED;
+	int failures = 0;
+
+	failures += lzss_check_levels (&state);
+	failures += lzss_check_undersized (&state);
+	failures += lzss_check_parallel (&state);
+
+	printf ("lzss check: seed %u, %d failures\n", seed, failures);
+	return failures ? 1 : 0;
+}
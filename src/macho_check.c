@@ -0,0 +1,291 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Checks the compiled relocation map of macho_loader.c. Run by "make
+ * check". A synthetic image gets a dysymtab with every kind of local
+ * relocation; the map is compiled once and applied with two slides, and
+ * macho_rebase() once more, each against a per-entry reference. The
+ * entries come from a fixed seed, so runs repeat.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "macho_loader.h"
+#include "util.h"
+
+#define MACHO_CHECK_SEED		0x6d61636f
+#define MACHO_CHECK_SIZE		(0x20000 + 0x5c)	/* ends in a partial bitmap block */
+#define MACHO_CHECK_RELOCS		0x1000
+#define MACHO_CHECK_DATA		0x8000
+#define MACHO_CHECK_ENTRIES		1500
+#define MACHO_CHECK_VMADDR		0x80001000
+
+/*
+ * Slots are placed one per 8 byte cell, so no two slots overlap and the
+ * order the reference adds them in does not matter.
+ */
+#define MACHO_CHECK_CELLS		((MACHO_CHECK_SIZE - MACHO_CHECK_DATA) / 8)
+
+enum
+{
+	ENTRY_VANILLA,
+	ENTRY_SCATTERED,
+	ENTRY_PB_LA_PTR,
+	ENTRY_SECTDIFF,
+	ENTRY_LOCAL_SECTDIFF,
+	ENTRY_ABSOLUTE,
+	ENTRY_PCREL,
+	ENTRY_DUPLICATE,
+	ENTRY_KINDS
+};
+
+static uint32_t
+macho_check_random (uint32_t * state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/*
+ * Give every cell its slot: aligned at either end of the cell, or
+ * unaligned by one to three bytes.
+ */
+static void
+macho_check_slots (uint32_t * slots, uint32_t * state)
+{
+	static const uint32_t within[] = { 0, 4, 0, 4, 1, 2, 3 };
+	uint32_t cell;
+
+	for (cell = 0; cell < MACHO_CHECK_CELLS; cell++)
+		slots[cell] = MACHO_CHECK_DATA + cell * 8 + within[macho_check_random (state) % (sizeof (within) / sizeof (*within))];
+}
+
+/*
+ * Build the image: a header with one segment and a dysymtab, the local
+ * relocations, then random data. The slot of every entry that should move
+ * it is recorded in entries, duplicates included.
+ */
+static uint32_t
+macho_check_build (uint8_t * image, const uint32_t * slots, uint32_t * entries, uint32_t * state)
+{
+	mach_header_t *mh = (mach_header_t *) image;
+	struct segment_command *sc = (struct segment_command *) (mh + 1);
+	struct dysymtab_command *dc = (struct dysymtab_command *) (sc + 1);
+	uint32_t *reloc = (uint32_t *) (image + MACHO_CHECK_RELOCS);
+	uint32_t i, n = 0, count = 0, offset, cell;
+
+	memset (image, 0, MACHO_CHECK_SIZE);
+	mh->magic = kMachMagic;
+	mh->filetype = kMachExecute;
+	mh->ncmds = 2;
+	mh->sizeofcmds = sizeof (*sc) + sizeof (*dc);
+	sc->cmd = kLoadCommandSegment;
+	sc->cmdsize = sizeof (*sc);
+	strcpy (sc->segname, "__DATA");
+	sc->vmaddr = MACHO_CHECK_VMADDR;
+	sc->vmsize = MACHO_CHECK_SIZE;
+	sc->filesize = MACHO_CHECK_SIZE;
+	dc->cmd = kLoadCommandDsymtab;
+	dc->cmdsize = sizeof (*dc);
+	dc->locreloff = MACHO_CHECK_RELOCS;
+
+	for (i = MACHO_CHECK_DATA; i < MACHO_CHECK_SIZE; i++)
+		image[i] = macho_check_random (state);
+
+	for (i = 0; i < MACHO_CHECK_ENTRIES; i++) {
+		int kind = macho_check_random (state) % ENTRY_KINDS;
+
+		if (MACHO_CHECK_RELOCS + (n + 2) * 8 > MACHO_CHECK_DATA)
+			errx (1, "too many relocation entries for the table");
+
+		/* The last cells always move, to cover the partial block. */
+		if (i < 4) {
+			kind = ENTRY_VANILLA + i % 3;
+			cell = MACHO_CHECK_CELLS - 1 - i;
+		}
+		else if (i & 1)
+			cell = macho_check_random (state) % MACHO_CHECK_CELLS;
+		else	/* packed, so whole blocks hold many slots */
+			cell = macho_check_random (state) % 256;
+		offset = slots[cell];
+		if (kind == ENTRY_DUPLICATE)
+			offset = count ? entries[macho_check_random (state) % count] : offset;
+
+		switch (kind) {
+		case ENTRY_VANILLA:
+		case ENTRY_DUPLICATE:
+			reloc[n * 2] = offset;
+			reloc[n * 2 + 1] = 1 | (2 << 25);	/* section 1, long */
+			n++;
+			break;
+		case ENTRY_SCATTERED:
+		case ENTRY_PB_LA_PTR:
+			reloc[n * 2] = R_SCATTERED | (2 << 28) | ((kind == ENTRY_SCATTERED ? GENERIC_RELOC_VANILLA : GENERIC_RELOC_PB_LA_PTR) << 24) | offset;
+			reloc[n * 2 + 1] = MACHO_CHECK_VMADDR + offset;
+			n++;
+			break;
+		case ENTRY_SECTDIFF:
+		case ENTRY_LOCAL_SECTDIFF:
+			reloc[n * 2] = R_SCATTERED | (2 << 28) | ((kind == ENTRY_SECTDIFF ? GENERIC_RELOC_SECTDIFF : GENERIC_RELOC_LOCAL_SECTDIFF) << 24) | offset;
+			reloc[n * 2 + 1] = MACHO_CHECK_VMADDR;
+			reloc[n * 2 + 2] = R_SCATTERED | (2 << 28) | (GENERIC_RELOC_PAIR << 24);
+			reloc[n * 2 + 3] = MACHO_CHECK_VMADDR + 0x100;
+			n += 2;
+			continue;
+		case ENTRY_ABSOLUTE:
+			reloc[n * 2] = offset;
+			reloc[n * 2 + 1] = R_ABS | (2 << 25);
+			n++;
+			continue;
+		case ENTRY_PCREL:
+			reloc[n * 2] = offset;
+			reloc[n * 2 + 1] = 1 | (1 << 24) | (2 << 25);
+			n++;
+			continue;
+		}
+
+		entries[count++] = offset;
+	}
+
+	dc->nlocrel = n;
+	return count;
+}
+
+/* Apply delta entry by entry, moving each slot once however often it is listed. */
+static void
+macho_check_reference (uint8_t * image, const uint32_t * entries, uint32_t count, uint32_t delta)
+{
+	uint8_t *done = calloc (MACHO_CHECK_SIZE, 1);
+	uint32_t i, value;
+
+	if (!done)
+		err (1, "cannot allocate chunk");
+	for (i = 0; i < count; i++) {
+		if (done[entries[i]])
+			continue;
+		done[entries[i]] = 1;
+		memcpy (&value, image + entries[i], sizeof (value));
+		value += delta;
+		memcpy (image + entries[i], &value, sizeof (value));
+	}
+	free (done);
+}
+
+static int
+macho_check_compare (const char *what, const uint8_t * image, const uint8_t * expected)
+{
+	uint32_t i;
+
+	for (i = 0; i < MACHO_CHECK_SIZE; i++) {
+		if (image[i] != expected[i]) {
+			warnx ("%s: image differs from the reference at %x", what, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint32_t slides[] = { 0x90000000, 0x7ff00000 };
+	uint32_t seed = argc >= 2 ? strtoul (argv[1], NULL, 0) : MACHO_CHECK_SEED;
+	uint32_t state = seed ? seed : MACHO_CHECK_SEED;
+	uint32_t *entries = _xmalloc (MACHO_CHECK_ENTRIES * sizeof (*entries));
+	uint32_t *slots = _xmalloc (MACHO_CHECK_CELLS * sizeof (*slots));
+	uint8_t *source = _xmalloc (MACHO_CHECK_SIZE), *image = _xmalloc (MACHO_CHECK_SIZE), *expected = _xmalloc (MACHO_CHECK_SIZE);
+	uint8_t *moved = _xmalloc (MACHO_CHECK_SIZE);
+	uint32_t count, nslots = 0, nunaligned = 0, i;
+	loader_context_t ctx;
+	macho_reloc_map_t map;
+	loader_return_t ret;
+	int failures = 0;
+	char what[32];
+
+	macho_check_slots (slots, &state);
+	count = macho_check_build (source, slots, entries, &state);
+
+	/* Slots the map must hold, each counted once. */
+	memset (moved, 0, MACHO_CHECK_SIZE);
+	for (i = 0; i < count; i++) {
+		if (moved[entries[i]])
+			continue;
+		moved[entries[i]] = 1;
+		nslots++;
+		nunaligned += (entries[i] & 3) != 0;
+	}
+
+	/* Compile once, from a context of its own, and apply to two copies. */
+	memset (&ctx, 0, sizeof (ctx));
+	if (macho_initialize (&ctx, source) != kLoadSuccess)
+		errx (1, "synthetic image does not load");
+	ret = macho_reloc_compile (&map, &ctx, MACHO_CHECK_SIZE);
+	if (ret != kLoadSuccess)
+		errx (1, "macho_reloc_compile failed: %d", ret);
+	if (map.nslots != nslots || map.nunaligned != nunaligned) {
+		warnx ("map holds %u slots, %u unaligned; expected %u, %u unaligned", map.nslots, map.nunaligned, nslots, nunaligned);
+		failures++;
+	}
+
+	for (i = 0; i < sizeof (slides) / sizeof (*slides); i++) {
+		memcpy (image, source, MACHO_CHECK_SIZE);
+		memcpy (expected, source, MACHO_CHECK_SIZE);
+		macho_reloc_apply (&map, image, slides[i] - MACHO_CHECK_VMADDR);
+		macho_check_reference (expected, entries, count, slides[i] - MACHO_CHECK_VMADDR);
+		snprintf (what, sizeof (what), "slide %08x", slides[i]);
+		failures += macho_check_compare (what, image, expected);
+	}
+	macho_reloc_free (&map);
+
+	/* macho_rebase() compiles and applies in place, over the file extent. */
+	memcpy (image, source, MACHO_CHECK_SIZE);
+	memset (&ctx, 0, sizeof (ctx));
+	macho_initialize (&ctx, image);
+	macho_set_vm_bias (&ctx, MACHO_CHECK_VMADDR);
+	ret = macho_rebase (&ctx, slides[0]);
+	if (ret != kLoadSuccess) {
+		warnx ("macho_rebase failed: %d", ret);
+		failures++;
+	}
+	else {
+		memcpy (expected, source, MACHO_CHECK_SIZE);
+		macho_check_reference (expected, entries, count, slides[0] - MACHO_CHECK_VMADDR);
+		failures += macho_check_compare ("macho_rebase", image, expected);
+	}
+
+	printf ("macho reloc check: %u entries, %u slots (%u unaligned), seed %u, %d failures\n", count, nslots, nunaligned, seed, failures);
+
+	free (entries);
+	free (slots);
+	free (source);
+	free (image);
+	free (expected);
+	free (moved);
+	return failures ? 1 : 0;
+}
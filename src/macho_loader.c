@@ -31,6 +31,7 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <err.h>
 #include <assert.h>
@@ -205,40 +206,585 @@ uint32_t macho_get_vmsize(loader_context_t * ctx)
     return vmsize_count;
 }
 
+static macho_range_t *macho_map_add(macho_range_t ** ranges, uint32_t * count)
+{
+    macho_range_t *grown;
+
+    /* Capacity is 16, then doubles whenever count reaches a power of two. */
+    if (!*count || (*count >= 16 && !(*count & (*count - 1)))) {
+        grown = (macho_range_t *) realloc(*ranges, (*count ? *count * 2 : 16) * sizeof(macho_range_t));
+        if (!grown)
+            return NULL;
+        *ranges = grown;
+    }
+
+    memset(&(*ranges)[*count], 0, sizeof(macho_range_t));
+    return &(*ranges)[(*count)++];
+}
+
+static int macho_range_compare_vmaddr(const void *a, const void *b)
+{
+    uint32_t x = ((const macho_range_t *) a)->vmaddr, y = ((const macho_range_t *) b)->vmaddr;
+    return (x > y) - (x < y);
+}
+
+static int macho_range_compare_fileoff(const void *a, const void *b)
+{
+    uint32_t x = ((const macho_range_t *) a)->fileoff, y = ((const macho_range_t *) b)->fileoff;
+    return (x > y) - (x < y);
+}
+
+static int macho_value_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t macho_symbol_hash(const char *name)
+{
+    uint32_t h = 2166136261U;
+
+    while (*name)
+        h = (h ^ (uint8_t) * name++) * 16777619U;
+    return h;
+}
+
+/* Last of the count ranges sorted by vmaddr that starts at or below va. */
+static const macho_range_t *macho_range_lookup(const macho_range_t * ranges, uint32_t count, uint32_t va)
+{
+    uint32_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ranges[mid].vmaddr <= va)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo || va - ranges[lo - 1].vmaddr >= ranges[lo - 1].vmsize)
+        return NULL;
+    return &ranges[lo - 1];
+}
+
+static loader_return_t macho_map_symbols(macho_map_t * map, struct symtab_command *st)
+{
+    struct nlist *nl;
+    const char *strings;
+    uint32_t i, buckets = 1;
+
+    if (st->symoff > map->size || st->nsyms > (map->size - st->symoff) / sizeof(struct nlist))
+        return kLoadMalformedSection;
+    if (st->stroff > map->size || st->strsize > map->size - st->stroff)
+        return kLoadMalformedSection;
+
+    nl = (struct nlist *)add_ptr2(map->source, st->symoff);
+    strings = (const char *)add_ptr2(map->source, st->stroff);
+
+    map->symbols = (macho_symbol_t *) malloc((st->nsyms ? st->nsyms : 1) * sizeof(macho_symbol_t));
+    map->values = (uint32_t *) malloc((st->nsyms ? st->nsyms : 1) * sizeof(uint32_t));
+    if (!map->symbols || !map->values)
+        return kLoadFailure;
+
+    /* Only symbols defined in a section, with a terminated name. */
+    for (i = 0; i < st->nsyms; i++) {
+        if ((nl[i].n_type & N_STAB) || (nl[i].n_type & N_TYPE) != N_SECT)
+            continue;
+        if (nl[i].n_strx >= st->strsize || !memchr(strings + nl[i].n_strx, 0, st->strsize - nl[i].n_strx))
+            continue;
+
+        map->symbols[map->nsymbols].name = strings + nl[i].n_strx;
+        map->symbols[map->nsymbols].value = nl[i].n_value;
+        map->values[map->nsymbols] = nl[i].n_value;
+        map->nsymbols++;
+    }
+
+    qsort(map->values, map->nsymbols, sizeof(uint32_t), macho_value_compare);
+
+    while (buckets < map->nsymbols * 2)
+        buckets <<= 1;
+    map->buckets = (uint32_t *) malloc(buckets * sizeof(uint32_t));
+    if (!map->buckets)
+        return kLoadFailure;
+    memset(map->buckets, 0xFF, buckets * sizeof(uint32_t));
+    map->mask = buckets - 1;
+
+    /* Push in reverse so the first definition of a name wins. */
+    for (i = map->nsymbols; i-- > 0;) {
+        uint32_t h = macho_symbol_hash(map->symbols[i].name) & map->mask;
+        map->symbols[i].next = map->buckets[h];
+        map->buckets[h] = i;
+    }
+
+    return kLoadSuccess;
+}
+
 /**
- * macho_rebase
+ * macho_map_build
+ *
+ * Build the segment and section tables, and the symbol index if the
+ * image has a symbol table, for an image of size bytes.
  */
-loader_return_t macho_rebase(loader_context_t * ctx, uint32_t slide)
+loader_return_t macho_map_build(macho_map_t * map, void *file, uint32_t size)
 {
-    assert(ctx->dsymtab);
-    struct relocation_info* rbase = (struct relocation_info *)add_ptr2(ctx->source, ctx->dsymtab->locreloff);;
-
-    /* Fix up MachO rebase information. */
-    for (uint32_t i = 0; i < ctx->dsymtab->nlocrel; i++)
-    {
-        struct relocation_info* rinfo = &rbase[i]; /* Relocation offset */
-        
-        if (rinfo->r_address & R_SCATTERED)
-        {
-            err(-1, "R_SCATTERED not supported yet!");
+    mach_header_t *mh = (mach_header_t *) file;
+    struct load_command *lc = (struct load_command *)(mh + 1);
+    struct symtab_command *st = NULL;
+    loader_return_t ret;
+
+    if (!map || !file) {
+        return kLoadInvalidParameter;
+    }
+    memset(map, 0, sizeof(macho_map_t));
+
+    if (size < sizeof(mach_header_t) || mh->magic != kMachMagic) {
+        return kLoadBadImage;
+    }
+    map->source = (uint8_t *) file;
+    map->size = size;
+
+    for_each_lc(lc, mh) {
+        if ((uintptr_t)(lc + 1) > add_ptr2(file, size) || lc->cmdsize < sizeof(struct load_command)
+            || lc->cmdsize > add_ptr2(file, size) - (uintptr_t)lc) {
+            break;
         }
+
+        if (lc->cmd == kLoadCommandSegment && lc->cmdsize >= sizeof(struct segment_command)) {
+            struct segment_command *sc = (struct segment_command *)lc;
+            struct section *sect;
+            macho_range_t *r;
+
+            if (!(r = macho_map_add(&map->segments, &map->nsegments))) {
+                macho_map_free(map);
+                return kLoadFailure;
+            }
+            memcpy(r->segname, sc->segname, 16);
+            r->vmaddr = sc->vmaddr;
+            r->vmsize = sc->vmsize;
+            r->fileoff = sc->fileoff;
+            r->filesize = sc->filesize;
+            r->flags = sc->initprot;
+
+            if (sc->nsects > (lc->cmdsize - sizeof(struct segment_command)) / sizeof(struct section)) {
+                continue;
+            }
+            for_each_section(sect, sc) {
+                if (!(r = macho_map_add(&map->sections, &map->nsections))) {
+                    macho_map_free(map);
+                    return kLoadFailure;
+                }
+                memcpy(r->segname, sect->segname, 16);
+                memcpy(r->sectname, sect->sectname, 16);
+                r->vmaddr = sect->addr;
+                r->vmsize = sect->size;
+                r->fileoff = sect->offset;
+                r->filesize = sect->offset ? sect->size : 0;
+                r->flags = sect->flags;
+            }
+        } else if (lc->cmd == kLoadCommandSymtab && lc->cmdsize >= sizeof(struct symtab_command)) {
+            st = (struct symtab_command *)lc;
+        }
+    }
+
+    qsort(map->segments, map->nsegments, sizeof(macho_range_t), macho_range_compare_vmaddr);
+    qsort(map->sections, map->nsections, sizeof(macho_range_t), macho_range_compare_vmaddr);
+
+    /* Segments without file contents have no offset to translate. */
+    map->by_fileoff = (macho_range_t *) malloc((map->nsegments ? map->nsegments : 1) * sizeof(macho_range_t));
+    if (!map->by_fileoff) {
+        macho_map_free(map);
+        return kLoadFailure;
+    }
+    for (uint32_t i = 0; i < map->nsegments; i++) {
+        if (map->segments[i].filesize)
+            map->by_fileoff[map->nfileoff++] = map->segments[i];
+    }
+    qsort(map->by_fileoff, map->nfileoff, sizeof(macho_range_t), macho_range_compare_fileoff);
+
+    if (st && (ret = macho_map_symbols(map, st)) != kLoadSuccess) {
+        macho_map_free(map);
+        return ret;
+    }
+
+    return kLoadSuccess;
+}
+
+/**
+ * macho_map_free
+ */
+void macho_map_free(macho_map_t * map)
+{
+    free(map->segments);
+    free(map->by_fileoff);
+    free(map->sections);
+    free(map->symbols);
+    free(map->buckets);
+    free(map->values);
+    memset(map, 0, sizeof(macho_map_t));
+}
+
+/**
+ * macho_va_to_offset
+ *
+ * File offset of a virtual address backed by the file.
+ */
+loader_return_t macho_va_to_offset(const macho_map_t * map, uint32_t va, uint32_t * offset)
+{
+    const macho_range_t *r = macho_range_lookup(map->segments, map->nsegments, va);
+
+    if (!r || va - r->vmaddr >= r->filesize) {
+        return kLoadFailure;
+    }
+    *offset = r->fileoff + (va - r->vmaddr);
+    return kLoadSuccess;
+}
+
+/**
+ * macho_offset_to_va
+ *
+ * Virtual address a file offset is mapped at.
+ */
+loader_return_t macho_offset_to_va(const macho_map_t * map, uint32_t offset, uint32_t * va)
+{
+    uint32_t lo = 0, hi = map->nfileoff;
+    const macho_range_t *r;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (map->by_fileoff[mid].fileoff <= offset)
+            lo = mid + 1;
         else
-        {
-            if (rinfo->r_length != 2) {
-                return kLoadBadImage;
+            hi = mid;
+    }
+    if (!lo) {
+        return kLoadFailure;
+    }
+
+    r = &map->by_fileoff[lo - 1];
+    if (offset - r->fileoff >= r->filesize) {
+        return kLoadFailure;
+    }
+    *va = r->vmaddr + (offset - r->fileoff);
+    return kLoadSuccess;
+}
+
+/**
+ * macho_find_segment
+ */
+const macho_range_t *macho_find_segment(const macho_map_t * map, const char *segname)
+{
+    for (uint32_t i = 0; i < map->nsegments; i++) {
+        if (!strcmp(map->segments[i].segname, segname))
+            return &map->segments[i];
+    }
+    return NULL;
+}
+
+/**
+ * macho_find_section
+ */
+const macho_range_t *macho_find_section(const macho_map_t * map, const char *segname, const char *sectname)
+{
+    for (uint32_t i = 0; i < map->nsections; i++) {
+        if (!strcmp(map->sections[i].segname, segname) && !strcmp(map->sections[i].sectname, sectname))
+            return &map->sections[i];
+    }
+    return NULL;
+}
+
+/**
+ * macho_find_symbol
+ *
+ * Value of a defined symbol, and how far it extends: up to the next
+ * symbol, or the end of its section if that comes first.
+ */
+loader_return_t macho_find_symbol(const macho_map_t * map, const char *name, uint32_t * value, uint32_t * size)
+{
+    const macho_range_t *sect;
+    uint32_t i, lo = 0, hi = map->nsymbols, end;
+
+    if (!map->buckets) {
+        return kLoadFailure;
+    }
+
+    for (i = map->buckets[macho_symbol_hash(name) & map->mask]; i != 0xFFFFFFFF; i = map->symbols[i].next) {
+        if (!strcmp(map->symbols[i].name, name))
+            break;
+    }
+    if (i == 0xFFFFFFFF) {
+        return kLoadFailure;
+    }
+    *value = map->symbols[i].value;
+
+    if (size) {
+        /* First value above this one. */
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (map->values[mid] <= *value)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        end = lo < map->nsymbols ? map->values[lo] : 0xFFFFFFFF;
+
+        sect = macho_range_lookup(map->sections, map->nsections, *value);
+        if (sect && end - sect->vmaddr > sect->vmsize)
+            end = sect->vmaddr + sect->vmsize;
+        *size = end == 0xFFFFFFFF ? 0 : end - *value;
+    }
+
+    return kLoadSuccess;
+}
+
+/*
+ * Raw relocation word decoding. The bitfield layout of relocation_info and
+ * scattered_relocation_info depends on __BIG_ENDIAN__/__LITTLE_ENDIAN__,
+ * which not every host compiler defines, so the entries are picked apart
+ * by hand. The layout is that of a little endian file.
+ */
+#define RELOC_SYMBOLNUM(w)      ((w) & 0xFFFFFF)
+#define RELOC_PCREL(w)          (((w) >> 24) & 1)
+#define RELOC_LENGTH(w)         (((w) >> 25) & 3)
+#define RELOC_EXTERN(w)         (((w) >> 27) & 1)
+#define RELOC_TYPE(w)           (((w) >> 28) & 0xF)
+
+#define SRELOC_ADDRESS(w)       ((w) & 0xFFFFFF)
+#define SRELOC_TYPE(w)          (((w) >> 24) & 0xF)
+#define SRELOC_LENGTH(w)        (((w) >> 28) & 3)
+#define SRELOC_PCREL(w)         (((w) >> 30) & 1)
+
+static loader_return_t macho_reloc_add(macho_reloc_map_t * map, uint32_t offset, uint32_t * ucapacity)
+{
+    if (offset > map->size || map->size - offset < sizeof(uint32_t)) {
+        return kLoadMalformedSection;
+    }
+
+    if (offset & 3) {
+        if (map->nunaligned == *ucapacity) {
+            uint32_t *grown;
+
+            *ucapacity = *ucapacity ? *ucapacity * 2 : 16;
+            grown = realloc(map->unaligned, *ucapacity * sizeof(uint32_t));
+            if (!grown) {
+                return kLoadFailure;
+            }
+            map->unaligned = grown;
+        }
+        map->unaligned[map->nunaligned++] = offset;
+    } else {
+        uint32_t slot = offset >> 2;
+
+        if (map->bitmap[slot >> 5] & (1U << (slot & 31))) {
+            return kLoadSuccess;
+        }
+        map->bitmap[slot >> 5] |= 1U << (slot & 31);
+    }
+
+    map->nslots++;
+    return kLoadSuccess;
+}
+
+/**
+ * macho_reloc_compile
+ *
+ * Compile the local relocations of the first size bytes of the image into
+ * a slot bitmap. Vanilla and prebound lazy pointer entries, scattered or
+ * not, become slots; section differences stay the same under any slide and
+ * are dropped along with their pairs, as are pc relative and absolute
+ * entries.
+ */
+loader_return_t macho_reloc_compile(macho_reloc_map_t * map, loader_context_t * ctx, uint32_t size)
+{
+    const uint32_t *rbase;
+    uint32_t ucapacity = 0;
+    loader_return_t ret = kLoadSuccess;
+
+    if (!map || !ctx || !ctx->source) {
+        return kLoadInvalidParameter;
+    }
+
+    memset(map, 0, sizeof(macho_reloc_map_t));
+    if (!ctx->dsymtab) {
+        macho_get_vmsize(ctx);
+    }
+    if (!ctx->dsymtab) {
+        return kLoadBadImage;
+    }
+    if (ctx->dsymtab->locreloff > size ||
+        (size - ctx->dsymtab->locreloff) / sizeof(struct relocation_info) < ctx->dsymtab->nlocrel) {
+        return kLoadMalformedSection;
+    }
+
+    map->size = size;
+    map->nwords = (size / sizeof(uint32_t) + 31) / 32;
+    map->bitmap = calloc(map->nwords ? map->nwords : 1, sizeof(uint32_t));
+    if (!map->bitmap) {
+        return kLoadFailure;
+    }
+
+    rbase = (const uint32_t *)add_ptr2(ctx->source, ctx->dsymtab->locreloff);
+    for (uint32_t i = 0; i < ctx->dsymtab->nlocrel && ret == kLoadSuccess; i++) {
+        uint32_t address = rbase[i * 2], info = rbase[i * 2 + 1];
+
+        if (address & R_SCATTERED) {
+            switch (SRELOC_TYPE(address)) {
+            case GENERIC_RELOC_VANILLA:
+            case GENERIC_RELOC_PB_LA_PTR:
+                if (SRELOC_PCREL(address)) {
+                    break;
+                }
+                if (SRELOC_LENGTH(address) != 2) {
+                    ret = kLoadBadImage;
+                    break;
+                }
+                ret = macho_reloc_add(map, SRELOC_ADDRESS(address), &ucapacity);
+                break;
+            case GENERIC_RELOC_SECTDIFF:
+            case GENERIC_RELOC_LOCAL_SECTDIFF:
+                /* Both ends move together; skip the pair that follows. */
+                if (i + 1 < ctx->dsymtab->nlocrel && (rbase[(i + 1) * 2] & R_SCATTERED) &&
+                    SRELOC_TYPE(rbase[(i + 1) * 2]) == GENERIC_RELOC_PAIR) {
+                    i++;
+                }
+                break;
+            case GENERIC_RELOC_PAIR:
+                break;
+            default:
+                ret = kLoadBadImage;
+                break;
             }
-            if (rinfo->r_type != GENERIC_RELOC_VANILLA) {
-                return kLoadBadImage;
+        } else {
+            if (RELOC_TYPE(info) == GENERIC_RELOC_PAIR || RELOC_PCREL(info) ||
+                (!RELOC_EXTERN(info) && RELOC_SYMBOLNUM(info) == R_ABS)) {
+                continue;
             }
-            if (rinfo->r_symbolnum == R_ABS) {
-                return kLoadBadImage;
+            if (RELOC_LENGTH(info) != 2 || RELOC_EXTERN(info) || RELOC_TYPE(info) != GENERIC_RELOC_VANILLA) {
+                ret = kLoadBadImage;
+                break;
             }
-            
-            /* Relocate */
-            uint32_t* pp = (uint32_t*)add_ptr2(ctx->source, rinfo->r_address);
-            *pp = (*pp - ctx->vm_bias + slide);
+            ret = macho_reloc_add(map, address, &ucapacity);
         }
     }
 
+    if (ret != kLoadSuccess) {
+        macho_reloc_free(map);
+        return ret;
+    }
+
+    /* Aligned slots are deduplicated by the bitmap, do the same here. */
+    if (map->nunaligned) {
+        uint32_t n = 1;
+
+        qsort(map->unaligned, map->nunaligned, sizeof(uint32_t), macho_value_compare);
+        for (uint32_t i = 1; i < map->nunaligned; i++) {
+            if (map->unaligned[i] != map->unaligned[n - 1]) {
+                map->unaligned[n++] = map->unaligned[i];
+            }
+        }
+        map->nslots -= map->nunaligned - n;
+        map->nunaligned = n;
+    }
+
+    return kLoadSuccess;
+}
+
+/**
+ * macho_reloc_apply
+ *
+ * Add delta to every slot of a compiled map in image, which must be at
+ * least map->size bytes. Whole 128 byte blocks add the delta masked by
+ * their bit, which the compiler turns into vector adds; the last partial
+ * block walks its set bits.
+ */
+void macho_reloc_apply(const macho_reloc_map_t * map, uint8_t * image, uint32_t delta)
+{
+    uint32_t full = map->size / (32 * sizeof(uint32_t));
+    uint32_t w, b;
+
+    for (w = 0; w < full; w++) {
+        uint32_t bits = map->bitmap[w];
+        uint32_t *slot = (uint32_t *)(image + w * 32 * sizeof(uint32_t));
+
+        if (!bits) {
+            continue;
+        }
+        for (b = 0; b < 32; b++) {
+            slot[b] += delta & -((bits >> b) & 1);
+        }
+    }
+
+    for (; w < map->nwords; w++) {
+        uint32_t bits = map->bitmap[w];
+        uint32_t *slot = (uint32_t *)(image + w * 32 * sizeof(uint32_t));
+
+        while (bits) {
+            b = __builtin_ctz(bits);
+            slot[b] += delta;
+            bits &= bits - 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < map->nunaligned; i++) {
+        uint32_t value;
+
+        memcpy(&value, image + map->unaligned[i], sizeof(value));
+        value += delta;
+        memcpy(image + map->unaligned[i], &value, sizeof(value));
+    }
+}
+
+void macho_reloc_free(macho_reloc_map_t * map)
+{
+    free(map->bitmap);
+    free(map->unaligned);
+    memset(map, 0, sizeof(macho_reloc_map_t));
+}
+
+/*
+ * End of the file backed part of the image, past which no relocation
+ * can point.
+ */
+static uint32_t macho_file_extent(loader_context_t * ctx)
+{
+    mach_header_t *mh = (mach_header_t *) ctx->source;
+    struct load_command *lc = (struct load_command *)((mach_header_t *) mh + 1);
+    uint32_t extent = 0;
+
+    for_each_lc(lc, mh) {
+        if (lc->cmd == kLoadCommandSegment) {
+            struct segment_command *sc = (struct segment_command *)lc;
+
+            if (sc->fileoff + sc->filesize > extent) {
+                extent = sc->fileoff + sc->filesize;
+            }
+        }
+    }
+
+    return extent;
+}
+
+/**
+ * macho_rebase
+ *
+ * Move every local relocation from vm_bias to slide. Callers sliding the
+ * same image more than once should compile the map themselves and apply
+ * it to each copy.
+ */
+loader_return_t macho_rebase(loader_context_t * ctx, uint32_t slide)
+{
+    macho_reloc_map_t map;
+    loader_return_t ret;
+
+    if (!ctx || !ctx->source) {
+        return kLoadInvalidParameter;
+    }
+
+    ret = macho_reloc_compile(&map, ctx, macho_file_extent(ctx));
+    if (ret != kLoadSuccess) {
+        return ret;
+    }
+
+    macho_reloc_apply(&map, ctx->source, slide - ctx->vm_bias);
+    macho_reloc_free(&map);
+
     return kLoadSuccess;
 }
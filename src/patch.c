@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <err.h>
 
 #include <assert.h>
@@ -33,100 +34,267 @@
 #include "patch.h"
 #include "util.h"
 
-static boolean_t patch_list_initialized = FALSE;
+#define PATCH_ARENA_CHUNK_SIZE	(64 * 1024)
 
-static struct patch_list_root patch_list_store;
-static struct patch_list *patch_list_head;
-static struct patch_list *patch_list_current_node;
+/*
+ * Arena chunks are chained newest first. Allocations are never freed one
+ * at a time, the whole chain goes when the plan is freed.
+ */
+struct patch_arena_chunk {
+	struct patch_arena_chunk *next;
+	size_t used;
+	size_t size;
+	uint8_t data[];
+};
 
-static struct patch_list *patch_list_object_allocate (void);
-static void patch_list_add_object (struct patch_list *);
+static const char patch_hex_digits[] = "0123456789ABCDEF";
 
-static inline char *
-patch_list_dump_hex (uint8_t * p, int size)
+static void *
+patch_arena_allocate (struct patch_plan *plan, size_t length)
 {
-	int i = 0, fixed_up = size * 2 + 1;
-	char *buffer = _xmalloc (fixed_up);
-	for (i = 0; i < size; i++) {
-		snprintf (buffer, fixed_up, "%s%02X", buffer, p[i]);
+	struct patch_arena_chunk *chunk = plan->arena;
+	size_t size;
+
+	if (!chunk || chunk->size - chunk->used < length) {
+		size = length > PATCH_ARENA_CHUNK_SIZE ? length : PATCH_ARENA_CHUNK_SIZE;
+		chunk = (struct patch_arena_chunk *) malloc (sizeof (struct patch_arena_chunk) + size);
+		if (!chunk)
+			err (-1, "cannot allocate chunk");
+		chunk->next = plan->arena;
+		chunk->used = 0;
+		chunk->size = size;
+		plan->arena = chunk;
 	}
-	buffer[fixed_up - 1] = '\0';
-	return buffer;
-}
 
-static struct patch_list *
-patch_list_object_allocate (void)
-{
-	return (struct patch_list *) _xmalloc (sizeof (struct patch_list));
+	chunk->used += length;
+	return chunk->data + chunk->used - length;
 }
 
-static void
-patch_list_add_object (struct patch_list *object)
+/*
+ * Write size bytes as hex into out, which must hold size * 2 + 1 chars.
+ */
+static char *
+patch_list_format_hex (char *out, const uint8_t * p, int size)
 {
-	patch_list_current_node->next = object;
-	patch_list_current_node = object;
-	if (patch_list_store.total == 0)
-		patch_list_head = patch_list_current_node;
-	patch_list_store.total++;
-	return;
+	char *cursor = out;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		*cursor++ = patch_hex_digits[p[i] >> 4];
+		*cursor++ = patch_hex_digits[p[i] & 0xF];
+	}
+	*cursor = '\0';
+	return out;
 }
 
 void
-patch_list_iterate (void)
+patch_list_iterate (struct patch_plan *plan)
 {
-	int i;
-	struct patch_list *iter = patch_list_head;
-	printf ("Total patches: %d\n", patch_list_store.total);
-	for (iter = patch_list_head, i = 0; i < patch_list_store.total; iter = iter->next, i++) {
-		printf ("Patch at %p\nName:          %s\nSearch for:    %s\nReplace with:  %s\nSize:          %d\n",
-				iter, iter->patch.name, patch_list_dump_hex (iter->patch.original, iter->patch.size),
-				patch_list_dump_hex (iter->patch.patched, iter->patch.size), iter->patch.size);
+	struct generic_patch *patch;
+	char *buffer;
+	int i, largest = 0;
+
+	printf ("Total patches: %d\n", plan->total);
+
+	for (i = 0; i < plan->total; i++) {
+		if (plan->patches[i].size > largest)
+			largest = plan->patches[i].size;
 	}
+
+	/* One buffer holds both strings for the largest patch. */
+	buffer = _xmalloc ((largest * 2 + 1) * 2);
+	for (i = 0; i < plan->total; i++) {
+		patch = &plan->patches[i];
+		printf ("Patch at %p\nName:          %s\nOffset:        %x\nExpect:        %s\nReplace with:  %s\nSize:          %d\n",
+				patch, patch->name, patch->offset, patch_list_format_hex (buffer, patch->original, patch->size),
+				patch_list_format_hex (buffer + largest * 2 + 1, patch->patched, patch->size), patch->size);
+	}
+	free (buffer);
 }
 
 int
-patch_list_get_head(struct patch_list** object_export, int* size)
+patch_list_get_patches (struct patch_plan *plan, struct generic_patch **patches, int *size)
 {
-	if (!patch_list_initialized)
+	if (!plan->initialized)
 		return -EPERM;
 
-	*object_export = patch_list_head;
-	*size = patch_list_store.total;
+	*patches = plan->patches;
+	*size = plan->total;
+
+	return 0;
+}
+
+/*
+ * Make room for count more patches, for callers that know how many are
+ * coming.
+ */
+int
+patch_list_reserve (struct patch_plan *plan, int count)
+{
+	struct generic_patch *patches;
+	int capacity;
+
+	if (!plan->initialized)
+		return -EACCES;
+	if (count < 0)
+		return -EINVAL;
+	if (plan->total + count <= plan->capacity)
+		return 0;
+
+	capacity = plan->capacity ? plan->capacity : 16;
+	while (capacity < plan->total + count)
+		capacity *= 2;
+
+	patches = (struct generic_patch *) realloc (plan->patches, capacity * sizeof (struct generic_patch));
+	if (!patches)
+		err (-1, "cannot allocate chunk");
+	plan->patches = patches;
+	plan->capacity = capacity;
 
 	return 0;
 }
 
+/*
+ * Release every patch in the plan. The plan itself belongs to the caller.
+ */
+void
+patch_list_free (struct patch_plan *plan)
+{
+	struct patch_arena_chunk *chunk, *next;
+
+	for (chunk = plan->arena; chunk; chunk = next) {
+		next = chunk->next;
+		free (chunk);
+	}
+	free (plan->patches);
+	bzero (plan, sizeof (struct patch_plan));
+}
+
+/*
+ * (Re)start a plan, dropping whatever it held.
+ */
 int
-patch_list_initialize (void)
+patch_list_initialize (struct patch_plan *plan)
 {
-	bzero (&patch_list_store, sizeof (struct patch_list_root));
-	patch_list_head = (struct patch_list *) &patch_list_store;
-	patch_list_current_node = patch_list_head;
-	patch_list_initialized = TRUE;
+	patch_list_free (plan);
+	plan->initialized = TRUE;
 	return 0;
 }
 
 int
-patch_list_add_patch (const char *name, uint8_t * original, uint8_t * patched, int size)
+patch_list_add_patch (struct patch_plan *plan, const char *name, int offset, uint8_t * original, uint8_t * patched, int size)
 {
-	struct patch_list *object;
+	struct generic_patch *patch;
+	size_t name_length;
 
-	if (!patch_list_initialized)
+	if (!plan->initialized)
 		return -EACCES;
+	if (offset < 0 || size <= 0)
+		return -EINVAL;
 
-	object = patch_list_object_allocate ();
+	patch_list_reserve (plan, 1);
+	patch = &plan->patches[plan->total];
 
 	/*
-	 * We don't verify the size of the objects being patched, you should do
-	 * that.
+	 * Keep our own copy of both byte strings, the original is usually
+	 * read straight out of the image we are about to patch.
 	 */
-	object->patch.original = original;
-	object->patch.patched = patched;
-	object->patch.name = strdup (name);
-	object->patch.size = size;
-	object->next = object;
+	name_length = strlen (name) + 1;
+	patch->original = (uint8_t *) patch_arena_allocate (plan, size * 2 + name_length);
+	patch->patched = patch->original + size;
+	patch->name = (char *) patch->patched + size;
+	memcpy (patch->original, original, size);
+	memcpy (patch->patched, patched, size);
+	memcpy (patch->name, name, name_length);
+	patch->size = size;
+	patch->offset = offset;
 
-	patch_list_add_object (object);
+	plan->total++;
 
 	return 0;
 }
+
+/*
+ * Check every patch against the bytes at its offset without writing
+ * anything.
+ */
+int
+patch_list_verify (struct patch_plan *plan, uint8_t * image, int size)
+{
+	struct generic_patch *patch;
+	int i;
+
+	if (!plan->initialized)
+		return -EPERM;
+
+	for (i = 0; i < plan->total; i++) {
+		patch = &plan->patches[i];
+		if (patch->offset > size || patch->size > size - patch->offset) {
+			warnx ("patch \"%s\" at %x is out of bounds", patch->name, patch->offset);
+			return -ERANGE;
+		}
+		if (memcmp (image + patch->offset, patch->original, patch->size)) {
+			warnx ("patch \"%s\" does not match the image at %x", patch->name, patch->offset);
+			return -EINVAL;
+		}
+	}
+
+	return plan->total;
+}
+
+static void
+patch_list_progress (struct patch_plan *plan, int i)
+{
+	double progress = ((i + 1) / (double) plan->total) * 100.0;
+
+	printf ("%4.1f%% done. [(%d/%d) %-32.32s]\r", progress, i + 1, plan->total, plan->patches[i].name);
+}
+
+/*
+ * Apply the patch list to an image. Every patch is checked against the
+ * bytes at its offset first, nothing is written unless all of them match.
+ */
+int
+patch_list_apply (struct patch_plan *plan, uint8_t * image, int size)
+{
+	struct generic_patch *patch;
+	int i, error;
+
+	if ((error = patch_list_verify (plan, image, size)) < 0)
+		return error;
+
+	for (i = 0; i < plan->total; i++) {
+		patch = &plan->patches[i];
+		memcpy (image + patch->offset, patch->patched, patch->size);
+		patch_list_progress (plan, i);
+	}
+	printf ("\n");
+	fflush (stdout);
+
+	return plan->total;
+}
+
+/*
+ * Write the replacement bytes of every patch into fd at their offsets.
+ * The plan must have been verified against the image fd holds a copy of.
+ */
+int
+patch_list_write (struct patch_plan *plan, int fd)
+{
+	struct generic_patch *patch;
+	int i;
+
+	if (!plan->initialized)
+		return -EPERM;
+
+	for (i = 0; i < plan->total; i++) {
+		patch = &plan->patches[i];
+		if (pwrite (fd, patch->patched, patch->size, patch->offset) != patch->size)
+			return -EIO;
+		patch_list_progress (plan, i);
+	}
+	printf ("\n");
+	fflush (stdout);
+
+	return plan->total;
+}
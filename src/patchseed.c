@@ -0,0 +1,312 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Diff-seeded patch finding.
+ *
+ * Neighbouring builds of a kernel or iBoot differ in a few places, and
+ * the code around a patch site mostly just moves. Given the previous
+ * build's image, whose verified plan is in the plan cache, every patch
+ * site is located in the new image by the bytes just before or just after
+ * it in the old one. Those anchors are found with a rolling hash, first
+ * near where the sites found so far say they should be and then over the
+ * whole image. Finders then search a small window around each predicted
+ * site and only fall back to the full image when that comes up empty or
+ * does not match the old plan.
+ *
+ * Environment:
+ *  PATCH_SEED  the previous build's image.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "structs.h"
+#include "patch.h"
+#include "util.h"
+#include "imagefile.h"
+#include "plancache.h"
+#include "patchseed.h"
+
+#define PATCH_SEED_ANCHOR	32			/* context bytes hashed on either side of a site */
+#define PATCH_SEED_NEAR		0x10000		/* first look for an anchor this far around its expected offset */
+#define PATCH_SEED_WINDOW	0x1000		/* finders search this far around a predicted site */
+#define PATCH_SEED_BASE		0x01000193
+
+struct patch_seed_site {
+	struct generic_patch *patch;	/* in the seed image's plan */
+	uint32_t predicted;
+	boolean_t aligned;
+};
+
+struct patch_seed {
+	struct image_file file;
+	struct patch_plan plan;
+	struct patch_seed_site *sites;
+	int count;
+	size_t size;				/* of the image being patched */
+	int hits;
+	int fallbacks;
+};
+
+static uint32_t
+patch_seed_hash (const uint8_t * p)
+{
+	uint32_t hash = 0;
+	int i;
+
+	for (i = 0; i < PATCH_SEED_ANCHOR; i++)
+		hash = hash * PATCH_SEED_BASE + p[i];
+	return hash;
+}
+
+/*
+ * Find anchor in image[lo, hi), preferring the match closest to expected.
+ */
+static int
+patch_seed_find (const uint8_t * image, uint32_t lo, uint32_t hi, const uint8_t * anchor, uint32_t expected, uint32_t * found)
+{
+	uint32_t target = patch_seed_hash (anchor), hash, power = 1, i, best_distance = UINT32_MAX, distance;
+	int error = -ENOENT;
+
+	if (hi < lo || hi - lo < PATCH_SEED_ANCHOR)
+		return -ENOENT;
+
+	/* PATCH_SEED_BASE ** (PATCH_SEED_ANCHOR - 1), for dropping the oldest byte. */
+	for (i = 1; i < PATCH_SEED_ANCHOR; i++)
+		power *= PATCH_SEED_BASE;
+
+	hash = patch_seed_hash (image + lo);
+	for (i = lo;; i++) {
+		if (hash == target && !memcmp (image + i, anchor, PATCH_SEED_ANCHOR)) {
+			distance = i > expected ? i - expected : expected - i;
+			if (distance < best_distance) {
+				best_distance = distance;
+				*found = i;
+				error = 0;
+			}
+		}
+		if (i + PATCH_SEED_ANCHOR >= hi)
+			break;
+		hash = (hash - image[i] * power) * PATCH_SEED_BASE + image[i + PATCH_SEED_ANCHOR];
+	}
+
+	return error;
+}
+
+/*
+ * Look for one anchor near its expected offset, then everywhere.
+ */
+static int
+patch_seed_locate (const uint8_t * image, size_t size, const uint8_t * anchor, int64_t expected, uint32_t * found)
+{
+	int64_t lo = expected - PATCH_SEED_NEAR, hi = expected + PATCH_SEED_NEAR + PATCH_SEED_ANCHOR;
+
+	if (lo < 0)
+		lo = 0;
+	if (hi > (int64_t) size)
+		hi = size;
+	if (expected < 0)
+		expected = 0;
+
+	if (lo < hi && !patch_seed_find (image, lo, hi, anchor, expected, found))
+		return 0;
+	return patch_seed_find (image, 0, size, anchor, expected, found);
+}
+
+static int
+patch_seed_site_compare (const void *a, const void *b)
+{
+	const struct patch_seed_site *x = a, *y = b;
+
+	return (x->patch->offset > y->patch->offset) - (x->patch->offset < y->patch->offset);
+}
+
+static void
+patch_seed_align (struct patch_seed *seed, uint8_t * image, size_t size)
+{
+	const uint8_t *old = seed->file.data;
+	int64_t delta = 0;
+	uint32_t found;
+	int i;
+
+	/* In offset order, so each site starts from the shift of the one before. */
+	qsort (seed->sites, seed->count, sizeof (struct patch_seed_site), patch_seed_site_compare);
+
+	for (i = 0; i < seed->count; i++) {
+		struct patch_seed_site *site = &seed->sites[i];
+		uint32_t offset = site->patch->offset, after = offset + site->patch->size;
+
+		if (offset >= PATCH_SEED_ANCHOR
+			&& !patch_seed_locate (image, size, old + offset - PATCH_SEED_ANCHOR, offset - PATCH_SEED_ANCHOR + delta, &found)) {
+			site->predicted = found + PATCH_SEED_ANCHOR;
+			site->aligned = TRUE;
+		}
+		else if (after + PATCH_SEED_ANCHOR <= seed->file.size && !patch_seed_locate (image, size, old + after, after + delta, &found)
+				 && found >= (uint32_t) site->patch->size) {
+			site->predicted = found - site->patch->size;
+			site->aligned = TRUE;
+		}
+
+		if (site->aligned)
+			delta = (int64_t) site->predicted - offset;
+	}
+}
+
+/*
+ * Load the previous build's image and its plan, and predict where each of
+ * its patch sites is in image. Returns NULL when there is nothing to seed
+ * from.
+ */
+struct patch_seed *
+patch_seed_load (const char *tag, const char *filename, uint8_t * image, size_t size)
+{
+	struct patch_seed *seed;
+	struct generic_patch *patches;
+	int i, aligned = 0;
+
+	if (!filename || !image)
+		return NULL;
+
+	seed = (struct patch_seed *) _xmalloc (sizeof (struct patch_seed));
+	if (image_file_open (&seed->file, filename)) {
+		warnx ("cannot open seed image %s", filename);
+		free (seed);
+		return NULL;
+	}
+	if (patch_plan_cache_fetch (tag, seed->file.data, seed->file.size, &seed->plan)
+		|| patch_list_get_patches (&seed->plan, &patches, &seed->count) || !seed->count) {
+		warnx ("no verified %s plan cached for seed image %s, patch it once first", tag, filename);
+		patch_seed_free (seed);
+		return NULL;
+	}
+
+	seed->size = size;
+	seed->sites = (struct patch_seed_site *) _xmalloc (seed->count * sizeof (struct patch_seed_site));
+	for (i = 0; i < seed->count; i++)
+		seed->sites[i].patch = &patches[i];
+	patch_seed_align (seed, image, size);
+
+	for (i = 0; i < seed->count; i++)
+		aligned += seed->sites[i].aligned;
+	printf ("patch seed: %d of %d sites aligned against %s\n", aligned, seed->count, filename);
+
+	return seed;
+}
+
+static struct patch_seed_site *
+patch_seed_site (struct patch_seed *seed, const char *name)
+{
+	int i;
+
+	for (i = 0; i < seed->count; i++) {
+		if (!strcmp (seed->sites[i].patch->name, name))
+			return &seed->sites[i];
+	}
+	return NULL;
+}
+
+/*
+ * The range a finder should search first for the named patch.
+ */
+int
+patch_seed_window (struct patch_seed *seed, const char *name, uint32_t * start, uint32_t * length)
+{
+	struct patch_seed_site *site;
+	uint32_t end;
+
+	if (!seed || !(site = patch_seed_site (seed, name)) || !site->aligned)
+		return -ENOENT;
+
+	*start = site->predicted > PATCH_SEED_WINDOW ? site->predicted - PATCH_SEED_WINDOW : 0;
+	end = site->predicted + site->patch->size + PATCH_SEED_WINDOW;
+	if (end > seed->size)
+		end = seed->size;
+	*start &= ~3;
+	*length = end - *start;
+
+	return 0;
+}
+
+/*
+ * Does what a finder came up with in its window replace the same bytes
+ * the previous build's patch did?
+ */
+int
+patch_seed_check (struct patch_seed *seed, const char *name, uint8_t * image, size_t size, uint32_t offset)
+{
+	struct patch_seed_site *site;
+
+	if (!seed || !(site = patch_seed_site (seed, name)))
+		return -ENOENT;
+	if (offset > size || site->patch->size > size - offset)
+		return -ERANGE;
+	if (memcmp (image + offset, site->patch->original, site->patch->size))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Record whether a seeded search held up or had to fall back to the full
+ * image.
+ */
+void
+patch_seed_count (struct patch_seed *seed, boolean_t hit)
+{
+	if (!seed)
+		return;
+	if (hit)
+		seed->hits++;
+	else
+		seed->fallbacks++;
+}
+
+void
+patch_seed_report (struct patch_seed *seed)
+{
+	uint32_t hits, fallbacks;
+
+	if (!seed)
+		return;
+
+	patch_plan_cache_count ("seedstats", seed->hits, seed->fallbacks, &hits, &fallbacks);
+	printf ("patch seed: %d found in their window, %d fell back to a full scan (%u and %u overall)\n", seed->hits, seed->fallbacks,
+			hits, fallbacks);
+}
+
+void
+patch_seed_free (struct patch_seed *seed)
+{
+	if (!seed)
+		return;
+
+	image_file_close (&seed->file);
+	patch_list_free (&seed->plan);
+	free (seed->sites);
+	free (seed);
+}
@@ -0,0 +1,500 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Persistent patch plan cache.
+ *
+ * A plan is the patch list a dynapatcher derived for one image. It is
+ * stored under the cache directory as <sha1 of image>-<finder tag>.plan,
+ * so a new finder version never picks up plans from an older one. Plans
+ * are verified against the image bytes before they are handed back, and
+ * a plan that does not verify is dropped and counted as a miss.
+ *
+ * Hits touch the plan file; after every store the least recently used
+ * plans are removed until the directory fits the size cap.
+ *
+ * Environment:
+ *  PATCH_CACHE_DIR      cache directory, RUNDIR "/patchcache" by default.
+ *  PATCH_CACHE_MAX_KB   size cap, 4096 KiB by default.
+ *  PATCH_CACHE_DISABLE  skip the cache altogether.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
+#include <string.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include "structs.h"
+#include "patch.h"
+#include "util.h"
+#include "sha1.h"
+#include "plancache.h"
+
+#define PLAN_CACHE_MAGIC		"SN0WPLAN"
+#define PLAN_CACHE_VERSION		1
+#define PLAN_CACHE_DEFAULT_KB	4096
+#define PLAN_CACHE_TAG_MAX		32
+#define PLAN_CACHE_NAME_MAX		256
+#define PLAN_CACHE_STALE_SECONDS	3600
+
+struct plan_cache_header {
+	char magic[8];
+	uint32_t version;
+	char tag[PLAN_CACHE_TAG_MAX];
+	uint8_t digest[20];
+	uint32_t image_size;
+	uint32_t count;
+};
+
+struct plan_cache_entry {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t name_length;
+};
+
+struct plan_cache_file {
+	char *path;
+	time_t mtime;
+	off_t size;
+};
+
+static const char *
+plan_cache_directory (void)
+{
+	const char *dir = getenv ("PATCH_CACHE_DIR");
+
+	return dir ? dir : RUNDIR "/patchcache";
+}
+
+/*
+ * Create the cache directory and any missing parents. On failure the
+ * cache simply misses.
+ */
+static int
+plan_cache_make_directory (void)
+{
+	char *path = strdup (plan_cache_directory ());
+	char *p;
+	int error = 0;
+
+	if (!path)
+		err (-1, "cannot allocate chunk");
+
+	for (p = path + 1;; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		if (p[-1] != '/') {
+			char c = *p;
+
+			*p = '\0';
+			if (mkdir (path, 0755) && errno != EEXIST)
+				error = -errno;
+			*p = c;
+		}
+		if (error || *p == '\0')
+			break;
+	}
+
+	if (error)
+		warnx ("cannot create patch plan cache directory %s: %s", path, strerror (-error));
+	free (path);
+	return error;
+}
+
+static int
+plan_cache_enabled (void)
+{
+	return getenv ("PATCH_CACHE_DISABLE") == NULL;
+}
+
+static void
+plan_cache_image_digest (uint8_t * image, int size, uint8_t * digest)
+{
+	SHA1Context ctx;
+	int i, chunk;
+
+	SHA1Reset (&ctx);
+	for (i = 0; i < size; i += chunk) {
+		chunk = size - i > 0x100000 ? 0x100000 : size - i;
+		SHA1Input (&ctx, image + i, chunk);
+	}
+	SHA1Result (&ctx);
+
+	for (i = 0; i < 5; i++) {
+		digest[i * 4] = ctx.Message_Digest[i] >> 24;
+		digest[i * 4 + 1] = ctx.Message_Digest[i] >> 16;
+		digest[i * 4 + 2] = ctx.Message_Digest[i] >> 8;
+		digest[i * 4 + 3] = ctx.Message_Digest[i];
+	}
+}
+
+static char *
+plan_cache_path (const char *tag, const uint8_t * digest)
+{
+	const char *dir = plan_cache_directory ();
+	size_t length = strlen (dir) + 1 + 40 + 1 + strlen (tag) + sizeof (".plan");
+	char *path = _xmalloc (length);
+	char hex[41];
+	int i;
+
+	for (i = 0; i < 20; i++)
+		snprintf (hex + i * 2, 3, "%02x", digest[i]);
+	snprintf (path, length, "%s/%s-%s.plan", dir, hex, tag);
+	return path;
+}
+
+/*
+ * Add to a pair of persistent hit and miss counters kept in the cache
+ * directory under the name counter, and return the new totals.
+ */
+void
+patch_plan_cache_count (const char *counter, uint32_t hit_count, uint32_t miss_count, uint32_t * hits, uint32_t * misses)
+{
+	char path[1024];
+	char buffer[64];
+	ssize_t length;
+	int fd;
+
+	*hits = *misses = 0;
+	if (plan_cache_make_directory ())
+		return;
+	snprintf (path, sizeof (path), "%s/%s", plan_cache_directory (), counter);
+	fd = open (path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return;
+
+	flock (fd, LOCK_EX);
+	length = read (fd, buffer, sizeof (buffer) - 1);
+	if (length > 0) {
+		buffer[length] = '\0';
+		sscanf (buffer, "hits %u\nmisses %u\n", hits, misses);
+	}
+	*hits += hit_count;
+	*misses += miss_count;
+
+	length = snprintf (buffer, sizeof (buffer), "hits %u\nmisses %u\n", *hits, *misses);
+	if (ftruncate (fd, 0) == 0 && lseek (fd, 0, SEEK_SET) == 0)
+		write (fd, buffer, length);
+	flock (fd, LOCK_UN);
+	close (fd);
+}
+
+static void
+plan_cache_report (int hit)
+{
+	uint32_t hits, misses;
+
+	patch_plan_cache_count ("stats", hit != 0, hit == 0, &hits, &misses);
+	printf ("patch plan cache %s (%u hits, %u misses)\n", hit ? "hit" : "miss", hits, misses);
+}
+
+/*
+ * Read a plan and load it into the patch list. Every entry must fit the
+ * image and match its bytes.
+ */
+static int
+plan_cache_read (FILE * fp, const char *tag, const uint8_t * digest, uint8_t * image, int size, struct patch_plan *plan)
+{
+	struct plan_cache_header header;
+	struct plan_cache_entry entry;
+	uint8_t *bytes = NULL;
+	char name[PLAN_CACHE_NAME_MAX + 1];
+	uint32_t i, capacity = 0;
+	int error = -EINVAL;
+
+	if (fread (&header, sizeof (header), 1, fp) != 1)
+		return -EINVAL;
+	if (memcmp (header.magic, PLAN_CACHE_MAGIC, sizeof (header.magic)) || header.version != PLAN_CACHE_VERSION)
+		return -EINVAL;
+	if (strncmp (header.tag, tag, sizeof (header.tag)) || memcmp (header.digest, digest, 20) || header.image_size != (uint32_t) size)
+		return -EINVAL;
+	if (header.count > (uint32_t) size)
+		return -EINVAL;
+
+	patch_list_initialize (plan);
+	patch_list_reserve (plan, header.count);
+	for (i = 0; i < header.count; i++) {
+		if (fread (&entry, sizeof (entry), 1, fp) != 1)
+			goto out;
+		if (!entry.size || entry.offset > (uint32_t) size || entry.size > (uint32_t) size - entry.offset || entry.name_length > PLAN_CACHE_NAME_MAX)
+			goto out;
+
+		/* One scratch buffer for every entry, the plan keeps its own copy. */
+		if (entry.size * 2 > capacity) {
+			capacity = entry.size * 2;
+			free (bytes);
+			bytes = _xmalloc (capacity);
+		}
+		if (fread (name, 1, entry.name_length, fp) != entry.name_length || fread (bytes, 1, entry.size * 2, fp) != entry.size * 2)
+			goto out;
+		name[entry.name_length] = '\0';
+		if (memcmp (image + entry.offset, bytes, entry.size)) {
+			warnx ("cached patch \"%s\" does not match the image at %x", name, entry.offset);
+			goto out;
+		}
+		patch_list_add_patch (plan, name, entry.offset, bytes, bytes + entry.size, entry.size);
+	}
+	error = 0;
+
+  out:
+	free (bytes);
+	if (error)
+		patch_list_initialize (plan);
+	return error;
+}
+
+static int
+plan_cache_lookup (const char *tag, uint8_t * image, int size, struct patch_plan *plan, uint8_t * digest, int report)
+{
+	char *path;
+	FILE *fp;
+	int error;
+
+	if (!plan_cache_enabled () || !image || size <= 0)
+		return -ENOENT;
+
+	plan_cache_image_digest (image, size, digest);
+	path = plan_cache_path (tag, digest);
+
+	fp = fopen (path, "rb");
+	if (!fp) {
+		if (report)
+			plan_cache_report (0);
+		free (path);
+		return -ENOENT;
+	}
+
+	error = plan_cache_read (fp, tag, digest, image, size, plan);
+	fclose (fp);
+
+	if (error) {
+		unlink (path);
+		if (report)
+			plan_cache_report (0);
+	}
+	else {
+		utimes (path, NULL);
+		if (report)
+			plan_cache_report (1);
+	}
+
+	free (path);
+	return error;
+}
+
+/*
+ * Load the cached plan for this image into plan. Returns 0 on a hit; on a
+ * miss plan is left empty. The image digest is left in digest for the
+ * patch_plan_cache_store() that follows a miss.
+ */
+int
+patch_plan_cache_lookup (const char *tag, uint8_t * image, int size, struct patch_plan *plan, uint8_t * digest)
+{
+	return plan_cache_lookup (tag, image, size, plan, digest, 1);
+}
+
+/*
+ * Same as patch_plan_cache_lookup(), for plans of images other than the
+ * one being patched. These do not count as hits or misses.
+ */
+int
+patch_plan_cache_fetch (const char *tag, uint8_t * image, int size, struct patch_plan *plan)
+{
+	uint8_t digest[20];
+
+	return plan_cache_lookup (tag, image, size, plan, digest, 0);
+}
+
+static int
+plan_cache_file_compare (const void *a, const void *b)
+{
+	const struct plan_cache_file *x = a, *y = b;
+
+	return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/*
+ * Temporary files are <plan>.XXXXXX, see patch_plan_cache_store().
+ */
+static int
+plan_cache_temporary_name (const char *name, size_t length)
+{
+	return length >= sizeof (".plan.XXXXXX") && !strncmp (name + length - (sizeof (".plan.XXXXXX") - 1), ".plan.", sizeof (".plan.") - 1);
+}
+
+/*
+ * Remove least recently used plans until the directory fits the cap.
+ * Temporary files left behind by writers that died are older than any
+ * live write and are removed outright; younger ones count towards the cap.
+ */
+static void
+plan_cache_evict (void)
+{
+	const char *dir = plan_cache_directory ();
+	struct plan_cache_file *files = NULL;
+	int count = 0, capacity = 0, i;
+	off_t total = 0, limit = PLAN_CACHE_DEFAULT_KB * 1024LL;
+	time_t now = time (NULL);
+	struct dirent *dirent;
+	struct stat st;
+	DIR *dp;
+
+	if (getenv ("PATCH_CACHE_MAX_KB"))
+		limit = atoll (getenv ("PATCH_CACHE_MAX_KB")) * 1024LL;
+
+	dp = opendir (dir);
+	if (!dp)
+		return;
+
+	while ((dirent = readdir (dp)) != NULL) {
+		size_t length = strlen (dirent->d_name);
+		int temporary = plan_cache_temporary_name (dirent->d_name, length);
+		char *path;
+
+		if (!temporary && (length < sizeof (".plan") || strcmp (dirent->d_name + length - (sizeof (".plan") - 1), ".plan")))
+			continue;
+
+		path = _xmalloc (strlen (dir) + 1 + length + 1);
+		sprintf (path, "%s/%s", dir, dirent->d_name);
+		if (stat (path, &st)) {
+			free (path);
+			continue;
+		}
+		if (temporary) {
+			if (now - st.st_mtime <= PLAN_CACHE_STALE_SECONDS || unlink (path))
+				total += st.st_size;
+			free (path);
+			continue;
+		}
+
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			files = realloc (files, capacity * sizeof (*files));
+			if (!files)
+				err (-1, "cannot allocate chunk");
+		}
+		files[count].path = path;
+		files[count].mtime = st.st_mtime;
+		files[count].size = st.st_size;
+		total += st.st_size;
+		count++;
+	}
+	closedir (dp);
+
+	qsort (files, count, sizeof (*files), plan_cache_file_compare);
+	for (i = 0; i < count; i++) {
+		if (total > limit && !unlink (files[i].path))
+			total -= files[i].size;
+		free (files[i].path);
+	}
+	free (files);
+}
+
+/*
+ * Save plan as the plan for this image, using the digest from the lookup
+ * (NULL hashes the image again). Written to a temporary file and renamed
+ * into place, so concurrent runs never see a partial plan.
+ */
+int
+patch_plan_cache_store (const char *tag, uint8_t * image, int size, struct patch_plan *plan, const uint8_t * digest)
+{
+	struct plan_cache_header header;
+	struct plan_cache_entry entry;
+	struct generic_patch *patches;
+	char *path, *temporary;
+	int i, total, fd, error = 0;
+	FILE *fp;
+
+	if (!plan_cache_enabled () || !image || size <= 0)
+		return -ENOENT;
+	if (patch_list_get_patches (plan, &patches, &total) || total <= 0)
+		return -EINVAL;
+	for (i = 0; i < total; i++)
+		if (strlen (patches[i].name) > PLAN_CACHE_NAME_MAX)
+			return -ENAMETOOLONG;
+
+	if ((error = plan_cache_make_directory ()))
+		return error;
+
+	bzero (&header, sizeof (header));
+	memcpy (header.magic, PLAN_CACHE_MAGIC, sizeof (header.magic));
+	header.version = PLAN_CACHE_VERSION;
+	strncpy (header.tag, tag, sizeof (header.tag) - 1);
+	if (digest)
+		memcpy (header.digest, digest, 20);
+	else
+		plan_cache_image_digest (image, size, header.digest);
+	header.image_size = size;
+	header.count = total;
+
+	path = plan_cache_path (tag, header.digest);
+	temporary = _xmalloc (strlen (path) + sizeof (".XXXXXX"));
+	sprintf (temporary, "%s.XXXXXX", path);
+
+	fd = mkstemp (temporary);
+	if (fd < 0 || !(fp = fdopen (fd, "wb"))) {
+		error = -errno;
+		if (fd >= 0) {
+			close (fd);
+			unlink (temporary);
+		}
+		free (temporary);
+		free (path);
+		return error;
+	}
+	fchmod (fd, 0644);
+
+	if (fwrite (&header, sizeof (header), 1, fp) != 1)
+		error = -EIO;
+	for (i = 0; !error && i < total; i++) {
+		entry.offset = patches[i].offset;
+		entry.size = patches[i].size;
+		entry.name_length = strlen (patches[i].name);
+		if (fwrite (&entry, sizeof (entry), 1, fp) != 1
+			|| fwrite (patches[i].name, 1, entry.name_length, fp) != entry.name_length
+			|| fwrite (patches[i].original, 1, entry.size, fp) != entry.size || fwrite (patches[i].patched, 1, entry.size, fp) != entry.size)
+			error = -EIO;
+	}
+
+	if (fclose (fp) && !error)
+		error = -EIO;
+	if (!error && rename (temporary, path))
+		error = -errno;
+	if (error)
+		unlink (temporary);
+	else
+		plan_cache_evict ();
+
+	free (temporary);
+	free (path);
+	return error;
+}
@@ -0,0 +1,326 @@
+/*-
+ * Copyright 2013, winocm <winocm@icloud.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * $Id$
+ */
+
+/*
+ * Prelinked kext index for kernelcaches.
+ *
+ * __PRELINK_INFO,__info holds an XML plist with one dictionary per kext
+ * under _PrelinkInfoDictionary. Only those dictionaries' own keys matter:
+ * the bundle identifier and where the executable was linked and placed.
+ * Repeated values are written once with an ID attribute and referenced
+ * with IDREF afterwards, so those are remembered as the scan goes. Each
+ * kext's own header then gives the extent of its __TEXT.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "util.h"
+#include "macho_loader.h"
+#include "prelink.h"
+
+/* plist > dict > array > dict */
+#define PRELINK_KEXT_DEPTH		3
+#define PRELINK_MAX_ID			(1 << 20)
+
+struct prelink_text {
+	const char *text;
+	int length;
+};
+
+struct prelink_parser {
+	const macho_map_t *map;
+	uint8_t *image;
+	size_t size;
+	struct prelink_text *ids;
+	int nids;
+	struct prelink_text key;
+	struct prelink_text bundle;
+	uint32_t load_addr;
+	uint32_t source_addr;
+	uint32_t exec_size;
+	int capacity;
+};
+
+static uint32_t
+prelink_integer (struct prelink_text *value)
+{
+	char buffer[32];
+	int length = value->length < (int) sizeof (buffer) - 1 ? value->length : (int) sizeof (buffer) - 1;
+
+	memcpy (buffer, value->text, length);
+	buffer[length] = '\0';
+	return strtoul (buffer, NULL, 0);
+}
+
+static int
+prelink_text_equal (struct prelink_text *value, const char *s)
+{
+	return value->length == (int) strlen (s) && !memcmp (value->text, s, value->length);
+}
+
+/*
+ * Value of an attribute inside a tag, as a number.
+ */
+static int
+prelink_attribute (const char *tag, const char *end, const char *name, uint32_t * value)
+{
+	int n = strlen (name);
+	const char *p;
+
+	for (p = tag; p + n + 2 <= end; p++) {
+		if (p[-1] == ' ' && !memcmp (p, name, n) && p[n] == '=' && p[n + 1] == '"') {
+			*value = strtoul (p + n + 2, NULL, 0);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void
+prelink_remember (struct prelink_parser *parser, uint32_t id, struct prelink_text *value)
+{
+	int n;
+
+	if (id >= PRELINK_MAX_ID)
+		return;
+	if ((int) id >= parser->nids) {
+		n = parser->nids ? parser->nids : 256;
+		while (n <= (int) id)
+			n *= 2;
+		parser->ids = (struct prelink_text *) realloc (parser->ids, n * sizeof (struct prelink_text));
+		if (!parser->ids)
+			err (-1, "cannot allocate chunk");
+		bzero (parser->ids + parser->nids, (n - parser->nids) * sizeof (struct prelink_text));
+		parser->nids = n;
+	}
+	parser->ids[id] = *value;
+}
+
+/*
+ * The part of the image holding a kext's __TEXT, from the kext's own load
+ * commands. Falls back to the whole executable when the header is not
+ * readable.
+ */
+static int
+prelink_kext_text (struct prelink_parser *parser, uint32_t * offset, uint32_t * size)
+{
+	mach_header_t *mh;
+	struct load_command *lc;
+	uint32_t base, n;
+
+	if (macho_va_to_offset (parser->map, parser->source_addr, &base) != kLoadSuccess || parser->exec_size > parser->size - base)
+		return -1;
+
+	*offset = base;
+	*size = parser->exec_size;
+
+	mh = (mach_header_t *) (parser->image + base);
+	if (parser->exec_size < sizeof (mach_header_t) || mh->magic != kMachMagic)
+		return 0;
+
+	lc = (struct load_command *) (mh + 1);
+	for (n = 0; n < mh->ncmds; n++, lc = (struct load_command *) ((uint8_t *) lc + lc->cmdsize)) {
+		struct segment_command *sc = (struct segment_command *) lc;
+
+		if ((uint8_t *) (lc + 1) > parser->image + base + parser->exec_size || lc->cmdsize < sizeof (struct load_command))
+			break;
+		if (lc->cmd != kLoadCommandSegment || strncmp (sc->segname, kSegTextName, sizeof (sc->segname)))
+			continue;
+
+		/* Linked at load_addr, placed at source_addr. */
+		if (sc->vmaddr - parser->load_addr < parser->exec_size && sc->filesize <= parser->exec_size - (sc->vmaddr - parser->load_addr)) {
+			*offset = base + (sc->vmaddr - parser->load_addr);
+			*size = sc->filesize;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static void
+prelink_add_kext (struct prelink_index *index, struct prelink_parser *parser)
+{
+	struct prelink_kext *kext;
+	uint32_t offset, size;
+
+	if (!parser->bundle.length || !parser->source_addr || !parser->exec_size)
+		return;
+	if (!parser->load_addr)
+		parser->load_addr = parser->source_addr;
+	if (prelink_kext_text (parser, &offset, &size))
+		return;
+
+	if (index->count == parser->capacity) {
+		parser->capacity = parser->capacity ? parser->capacity * 2 : 64;
+		index->kexts = (struct prelink_kext *) realloc (index->kexts, parser->capacity * sizeof (struct prelink_kext));
+		if (!index->kexts)
+			err (-1, "cannot allocate chunk");
+	}
+
+	kext = &index->kexts[index->count++];
+	kext->bundle = (char *) _xmalloc (parser->bundle.length + 1);
+	memcpy (kext->bundle, parser->bundle.text, parser->bundle.length);
+	if (macho_offset_to_va (parser->map, offset, &kext->vmaddr) != kLoadSuccess)
+		kext->vmaddr = parser->source_addr;
+	kext->offset = offset;
+	kext->size = size;
+}
+
+static int
+prelink_kext_compare (const void *a, const void *b)
+{
+	return strcmp (((const struct prelink_kext *) a)->bundle, ((const struct prelink_kext *) b)->bundle);
+}
+
+int
+prelink_index_build (struct prelink_index *index, const macho_map_t * map, uint8_t * image, size_t size)
+{
+	struct prelink_parser parser;
+	const macho_range_t *info;
+	const char *p, *end, *lt, *gt, *content;
+	int depth = 0, closing, empty, n;
+	struct prelink_text value;
+	uint32_t id;
+
+	bzero (index, sizeof (*index));
+	info = macho_find_section (map, "__PRELINK_INFO", "__info");
+	if (!info || !info->filesize || info->fileoff > size || info->filesize > size - info->fileoff)
+		return -ENOENT;
+
+	bzero (&parser, sizeof (parser));
+	parser.map = map;
+	parser.image = image;
+	parser.size = size;
+
+	p = (const char *) image + info->fileoff;
+	end = p + info->filesize;
+
+	while (p < end && (lt = memchr (p, '<', end - p)) != NULL) {
+		if ((gt = memchr (lt, '>', end - lt)) == NULL)
+			break;
+		p = gt + 1;
+		if (lt[1] == '?' || lt[1] == '!')
+			continue;
+
+		closing = lt[1] == '/';
+		empty = gt[-1] == '/';
+		content = gt + 1;
+		lt += closing ? 2 : 1;
+		for (n = 0; lt + n < gt && lt[n] != ' ' && lt[n] != '/'; n++);
+
+		/* Text up to the next tag. */
+		value.text = content;
+		value.length = 0;
+		if (!closing && !empty) {
+			const char *next = memchr (content, '<', end - content);
+			value.length = (next ? next : end) - content;
+		}
+
+		if ((n == 4 && !memcmp (lt, "dict", 4)) || (n == 5 && !memcmp (lt, "array", 5))) {
+			if (empty)
+				continue;
+			if (closing) {
+				if (depth == PRELINK_KEXT_DEPTH && n == 4)
+					prelink_add_kext (index, &parser);
+				depth--;
+				continue;
+			}
+			if (++depth == PRELINK_KEXT_DEPTH && n == 4) {
+				bzero (&parser.bundle, sizeof (parser.bundle));
+				parser.load_addr = parser.source_addr = parser.exec_size = 0;
+			}
+			continue;
+		}
+		if (closing)
+			continue;
+
+		if (n == 3 && !memcmp (lt, "key", 3)) {
+			parser.key = value;
+			continue;
+		}
+		if (!(n == 6 && !memcmp (lt, "string", 6)) && !(n == 7 && !memcmp (lt, "integer", 7)))
+			continue;
+
+		if (empty) {
+			if (prelink_attribute (lt, gt, "IDREF", &id) || (int) id >= parser.nids)
+				continue;
+			value = parser.ids[id];
+		}
+		else if (!prelink_attribute (lt, gt, "ID", &id)) {
+			prelink_remember (&parser, id, &value);
+		}
+
+		if (depth != PRELINK_KEXT_DEPTH)
+			continue;
+		if (prelink_text_equal (&parser.key, "CFBundleIdentifier"))
+			parser.bundle = value;
+		else if (prelink_text_equal (&parser.key, "_PrelinkExecutableLoadAddr"))
+			parser.load_addr = prelink_integer (&value);
+		else if (prelink_text_equal (&parser.key, "_PrelinkExecutableSourceAddr"))
+			parser.source_addr = prelink_integer (&value);
+		else if (prelink_text_equal (&parser.key, "_PrelinkExecutableSize"))
+			parser.exec_size = prelink_integer (&value);
+	}
+
+	free (parser.ids);
+
+	if (index->count)
+		qsort (index->kexts, index->count, sizeof (struct prelink_kext), prelink_kext_compare);
+	return 0;
+}
+
+const struct prelink_kext *
+prelink_find_kext (const struct prelink_index *index, const char *bundle)
+{
+	int lo = 0, hi = index->count, c;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		c = strcmp (index->kexts[mid].bundle, bundle);
+		if (!c)
+			return &index->kexts[mid];
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+void
+prelink_index_free (struct prelink_index *index)
+{
+	int i;
+
+	for (i = 0; i < index->count; i++)
+		free (index->kexts[i].bundle);
+	free (index->kexts);
+	bzero (index, sizeof (*index));
+}